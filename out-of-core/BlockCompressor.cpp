@@ -0,0 +1,573 @@
+#include "BlockCompressor.h"
+
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BLOCK_COMPRESSOR_SSE2
+#include <emmintrin.h>
+#endif
+
+// Texels of one 4x4 block, one row of 16 floats per channel
+typedef float BlockChannels[4][16];
+
+// BC7 4-bit interpolation weights, out of 64
+static const int bc7Weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+static inline float clampUnorm(float value)
+{
+	return std::min(std::max(value, 0.0f), 255.0f);
+}
+
+static void loadBlock(const uint8_t* pTexels, uint32_t width, uint32_t height, uint32_t blockX, uint32_t blockY, BlockChannels& block)
+{
+	for (uint32_t y = 0; y < 4; y++)
+	{
+		uint32_t texelY = std::min(blockY * 4 + y, height - 1);
+
+		for (uint32_t x = 0; x < 4; x++)
+		{
+			uint32_t texelX = std::min(blockX * 4 + x, width - 1);
+			const uint8_t* pTexel = pTexels + (static_cast<size_t>(texelY) * width + texelX) * 4;
+
+			for (uint32_t c = 0; c < 4; c++)
+				block[c][y * 4 + x] = static_cast<float>(pTexel[c]);
+		}
+	}
+}
+
+static void computeBounds(const float (*pChannels)[16], int channels, float minValue[4], float maxValue[4])
+{
+	for (int c = 0; c < channels; c++)
+	{
+#ifdef BLOCK_COMPRESSOR_SSE2
+		__m128 lo = _mm_loadu_ps(&pChannels[c][0]);
+		__m128 hi = lo;
+		for (int i = 4; i < 16; i += 4)
+		{
+			__m128 v = _mm_loadu_ps(&pChannels[c][i]);
+			lo = _mm_min_ps(lo, v);
+			hi = _mm_max_ps(hi, v);
+		}
+		lo = _mm_min_ps(lo, _mm_shuffle_ps(lo, lo, _MM_SHUFFLE(1, 0, 3, 2)));
+		lo = _mm_min_ps(lo, _mm_shuffle_ps(lo, lo, _MM_SHUFFLE(2, 3, 0, 1)));
+		hi = _mm_max_ps(hi, _mm_shuffle_ps(hi, hi, _MM_SHUFFLE(1, 0, 3, 2)));
+		hi = _mm_max_ps(hi, _mm_shuffle_ps(hi, hi, _MM_SHUFFLE(2, 3, 0, 1)));
+		minValue[c] = _mm_cvtss_f32(lo);
+		maxValue[c] = _mm_cvtss_f32(hi);
+#else
+		minValue[c] = maxValue[c] = pChannels[c][0];
+		for (int i = 1; i < 16; i++)
+		{
+			minValue[c] = std::min(minValue[c], pChannels[c][i]);
+			maxValue[c] = std::max(maxValue[c], pChannels[c][i]);
+		}
+#endif
+	}
+}
+
+// Nearest palette entry for every texel, returns the summed squared error
+static float selectNearest(const float (*pChannels)[16], int channels, const float (*pPalette)[4], int paletteSize, uint8_t indices[16])
+{
+	float error = 0.0f;
+
+#ifdef BLOCK_COMPRESSOR_SSE2
+	for (int i = 0; i < 16; i += 4)
+	{
+		__m128 best = _mm_set1_ps(FLT_MAX);
+		__m128i bestIndex = _mm_setzero_si128();
+
+		for (int p = 0; p < paletteSize; p++)
+		{
+			__m128 distance = _mm_setzero_ps();
+			for (int c = 0; c < channels; c++)
+			{
+				__m128 d = _mm_sub_ps(_mm_loadu_ps(&pChannels[c][i]), _mm_set1_ps(pPalette[p][c]));
+				distance = _mm_add_ps(distance, _mm_mul_ps(d, d));
+			}
+
+			__m128i closer = _mm_castps_si128(_mm_cmplt_ps(distance, best));
+			best = _mm_min_ps(distance, best);
+			bestIndex = _mm_or_si128(_mm_and_si128(closer, _mm_set1_epi32(p)), _mm_andnot_si128(closer, bestIndex));
+		}
+
+		alignas(16) int32_t lanes[4];
+		alignas(16) float distances[4];
+		_mm_store_si128(reinterpret_cast<__m128i*>(lanes), bestIndex);
+		_mm_store_ps(distances, best);
+
+		for (int j = 0; j < 4; j++)
+		{
+			indices[i + j] = static_cast<uint8_t>(lanes[j]);
+			error += distances[j];
+		}
+	}
+#else
+	for (int i = 0; i < 16; i++)
+	{
+		float best = FLT_MAX;
+		int bestIndex = 0;
+
+		for (int p = 0; p < paletteSize; p++)
+		{
+			float distance = 0.0f;
+			for (int c = 0; c < channels; c++)
+			{
+				float d = pChannels[c][i] - pPalette[p][c];
+				distance += d * d;
+			}
+
+			if (distance < best) {
+				best = distance;
+				bestIndex = p;
+			}
+		}
+
+		indices[i] = static_cast<uint8_t>(bestIndex);
+		error += best;
+	}
+#endif
+
+	return error;
+}
+
+// Endpoint pair spanning the block, e0 is the high end
+static void fitEndpoints(const float (*pChannels)[16], int channels, BlockQuality quality, float e0[4], float e1[4])
+{
+	float minValue[4], maxValue[4];
+	computeBounds(pChannels, channels, minValue, maxValue);
+
+	float axis[4] = {};
+	float axisLength = 0.0f;
+	for (int c = 0; c < channels; c++)
+	{
+		axis[c] = maxValue[c] - minValue[c];
+		axisLength += axis[c] * axis[c];
+	}
+
+	if (quality == BLOCK_QUALITY_FAST || axisLength == 0.0f)
+	{
+		// Inset the box a little, the extremes are rarely hit by the interpolated colors
+		for (int c = 0; c < channels; c++)
+		{
+			float inset = (maxValue[c] - minValue[c]) / 16.0f;
+			e0[c] = maxValue[c] - inset;
+			e1[c] = minValue[c] + inset;
+		}
+		return;
+	}
+
+	float mean[4] = {};
+	for (int c = 0; c < channels; c++)
+	{
+		for (int i = 0; i < 16; i++)
+			mean[c] += pChannels[c][i];
+		mean[c] /= 16.0f;
+	}
+
+	float covariance[4][4] = {};
+	for (int i = 0; i < 16; i++)
+	{
+		for (int a = 0; a < channels; a++)
+			for (int b = 0; b < channels; b++)
+				covariance[a][b] += (pChannels[a][i] - mean[a]) * (pChannels[b][i] - mean[b]);
+	}
+
+	// Power iteration towards the principal axis, starting from the box diagonal
+	for (int iteration = 0; iteration < 8; iteration++)
+	{
+		float next[4] = {};
+		float length = 0.0f;
+		for (int a = 0; a < channels; a++)
+		{
+			for (int b = 0; b < channels; b++)
+				next[a] += covariance[a][b] * axis[b];
+			length = std::max(length, std::abs(next[a]));
+		}
+
+		if (length == 0.0f) break;
+
+		for (int c = 0; c < channels; c++)
+			axis[c] = next[c] / length;
+	}
+
+	float minProjection = FLT_MAX, maxProjection = -FLT_MAX;
+	float axisDot = 0.0f;
+	for (int c = 0; c < channels; c++)
+		axisDot += axis[c] * axis[c];
+
+	for (int i = 0; i < 16; i++)
+	{
+		float projection = 0.0f;
+		for (int c = 0; c < channels; c++)
+			projection += (pChannels[c][i] - mean[c]) * axis[c];
+
+		minProjection = std::min(minProjection, projection);
+		maxProjection = std::max(maxProjection, projection);
+	}
+
+	for (int c = 0; c < channels; c++)
+	{
+		e0[c] = clampUnorm(mean[c] + maxProjection / axisDot * axis[c]);
+		e1[c] = clampUnorm(mean[c] + minProjection / axisDot * axis[c]);
+	}
+}
+
+// Least squares endpoints for fixed interpolation weights, weight 0 is e0 and weight 1 is e1
+static bool refineEndpoints(const float (*pChannels)[16], int channels, const float weights[16], float e0[4], float e1[4])
+{
+	float alpha2 = 0.0f, beta2 = 0.0f, alphaBeta = 0.0f;
+	float alphaX[4] = {}, betaX[4] = {};
+
+	for (int i = 0; i < 16; i++)
+	{
+		float beta = weights[i];
+		float alpha = 1.0f - beta;
+
+		alpha2 += alpha * alpha;
+		beta2 += beta * beta;
+		alphaBeta += alpha * beta;
+
+		for (int c = 0; c < channels; c++)
+		{
+			alphaX[c] += alpha * pChannels[c][i];
+			betaX[c] += beta * pChannels[c][i];
+		}
+	}
+
+	float determinant = alpha2 * beta2 - alphaBeta * alphaBeta;
+	if (std::abs(determinant) < 1e-6f)
+		return false;
+
+	for (int c = 0; c < channels; c++)
+	{
+		e0[c] = clampUnorm((alphaX[c] * beta2 - betaX[c] * alphaBeta) / determinant);
+		e1[c] = clampUnorm((betaX[c] * alpha2 - alphaX[c] * alphaBeta) / determinant);
+	}
+
+	return true;
+}
+
+static uint16_t packColor565(const float color[4])
+{
+	uint32_t r = static_cast<uint32_t>(color[0] * 31.0f / 255.0f + 0.5f);
+	uint32_t g = static_cast<uint32_t>(color[1] * 63.0f / 255.0f + 0.5f);
+	uint32_t b = static_cast<uint32_t>(color[2] * 31.0f / 255.0f + 0.5f);
+
+	return static_cast<uint16_t>((r << 11) | (g << 5) | b);
+}
+
+static void unpackColor565(uint16_t packed, float color[4])
+{
+	uint32_t r = (packed >> 11) & 31;
+	uint32_t g = (packed >> 5) & 63;
+	uint32_t b = packed & 31;
+
+	color[0] = static_cast<float>((r << 3) | (r >> 2));
+	color[1] = static_cast<float>((g << 2) | (g >> 4));
+	color[2] = static_cast<float>((b << 3) | (b >> 2));
+	color[3] = 255.0f;
+}
+
+// Indices for a 565 endpoint pair in four color mode, reorders the endpoints so c0 > c1
+static float encodeColorIndices(const float (*pChannels)[16], uint16_t& c0, uint16_t& c1, uint8_t indices[16])
+{
+	if (c0 < c1)
+		std::swap(c0, c1);
+
+	float palette[4][4];
+	unpackColor565(c0, palette[0]);
+	unpackColor565(c1, palette[1]);
+
+	for (int c = 0; c < 3; c++)
+	{
+		palette[2][c] = (2.0f * palette[0][c] + palette[1][c]) / 3.0f;
+		palette[3][c] = (palette[0][c] + 2.0f * palette[1][c]) / 3.0f;
+	}
+
+	// Equal endpoints switch decoders to three color mode, stay on the endpoints only
+	int paletteSize = (c0 == c1) ? 2 : 4;
+
+	return selectNearest(pChannels, 3, palette, paletteSize, indices);
+}
+
+static void encodeColorBlock(const BlockChannels& block, BlockQuality quality, uint8_t* pOut)
+{
+	float e0[4], e1[4];
+	fitEndpoints(block, 3, quality, e0, e1);
+
+	uint16_t c0 = packColor565(e0), c1 = packColor565(e1);
+	uint8_t indices[16];
+	float error = encodeColorIndices(block, c0, c1, indices);
+
+	if (quality == BLOCK_QUALITY_HIGH && error > 0.0f)
+	{
+		static const float colorWeights[4] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f };
+
+		float weights[16];
+		for (int i = 0; i < 16; i++)
+			weights[i] = colorWeights[indices[i]];
+
+		if (refineEndpoints(block, 3, weights, e0, e1))
+		{
+			uint16_t refined0 = packColor565(e0), refined1 = packColor565(e1);
+			uint8_t refinedIndices[16];
+			float refinedError = encodeColorIndices(block, refined0, refined1, refinedIndices);
+
+			if (refinedError < error) {
+				c0 = refined0;
+				c1 = refined1;
+				memcpy(indices, refinedIndices, sizeof(indices));
+			}
+		}
+	}
+
+	uint32_t bits = 0;
+	for (int i = 0; i < 16; i++)
+		bits |= static_cast<uint32_t>(indices[i]) << (i * 2);
+
+	pOut[0] = static_cast<uint8_t>(c0);
+	pOut[1] = static_cast<uint8_t>(c0 >> 8);
+	pOut[2] = static_cast<uint8_t>(c1);
+	pOut[3] = static_cast<uint8_t>(c1 >> 8);
+	memcpy(pOut + 4, &bits, sizeof(bits));
+}
+
+static void encodeAlphaBlock(const BlockChannels& block, uint8_t* pOut)
+{
+	const float (*pAlpha)[16] = &block[3];
+
+	float minValue[4], maxValue[4];
+	computeBounds(pAlpha, 1, minValue, maxValue);
+
+	uint8_t a0 = static_cast<uint8_t>(maxValue[0]);
+	uint8_t a1 = static_cast<uint8_t>(minValue[0]);
+
+	uint8_t indices[16] = {};
+	if (a0 != a1)
+	{
+		// Eight alpha mode, six values between the endpoints
+		float palette[8][4] = {};
+		palette[0][0] = a0;
+		palette[1][0] = a1;
+		for (int k = 1; k < 7; k++)
+			palette[k + 1][0] = ((7 - k) * a0 + k * a1) / 7.0f;
+
+		selectNearest(pAlpha, 1, palette, 8, indices);
+	}
+
+	uint64_t bits = 0;
+	for (int i = 0; i < 16; i++)
+		bits |= static_cast<uint64_t>(indices[i]) << (i * 3);
+
+	pOut[0] = a0;
+	pOut[1] = a1;
+	for (int i = 0; i < 6; i++)
+		pOut[2 + i] = static_cast<uint8_t>(bits >> (i * 8));
+}
+
+// Mode 6 endpoint, 7 bits per channel plus a shared p-bit
+static float quantizeMode6(const float endpoint[4], uint8_t quantized[4], uint8_t& pBit)
+{
+	float bestError = FLT_MAX;
+
+	for (uint8_t p = 0; p < 2; p++)
+	{
+		uint8_t candidate[4];
+		float error = 0.0f;
+
+		for (int c = 0; c < 4; c++)
+		{
+			int q = static_cast<int>((endpoint[c] - p) / 2.0f + 0.5f);
+			q = std::min(std::max(q, 0), 127);
+			candidate[c] = static_cast<uint8_t>(q);
+
+			float d = endpoint[c] - static_cast<float>((q << 1) | p);
+			error += d * d;
+		}
+
+		if (error < bestError) {
+			bestError = error;
+			pBit = p;
+			memcpy(quantized, candidate, sizeof(candidate));
+		}
+	}
+
+	return bestError;
+}
+
+static float encodeMode6Indices(const BlockChannels& block, const uint8_t q0[4], uint8_t p0, const uint8_t q1[4], uint8_t p1, uint8_t indices[16])
+{
+	float palette[16][4];
+	for (int c = 0; c < 4; c++)
+	{
+		int v0 = (q0[c] << 1) | p0;
+		int v1 = (q1[c] << 1) | p1;
+
+		for (int i = 0; i < 16; i++)
+			palette[i][c] = static_cast<float>(((64 - bc7Weights[i]) * v0 + bc7Weights[i] * v1 + 32) >> 6);
+	}
+
+	return selectNearest(block, 4, palette, 16, indices);
+}
+
+class BitWriter
+{
+public:
+	BitWriter(uint8_t* pOut) : pOut(pOut) { memset(pOut, 0, 16); }
+
+	void write(uint32_t value, uint32_t bits)
+	{
+		for (uint32_t i = 0; i < bits; i++, position++)
+		{
+			if ((value >> i) & 1)
+				pOut[position / 8] |= static_cast<uint8_t>(1 << (position % 8));
+		}
+	}
+
+private:
+	uint8_t* pOut;
+	uint32_t position = 0;
+};
+
+static void encodeMode6Block(const BlockChannels& block, BlockQuality quality, uint8_t* pOut)
+{
+	float e0[4], e1[4];
+	fitEndpoints(block, 4, quality, e0, e1);
+
+	uint8_t q0[4], q1[4], p0, p1;
+	quantizeMode6(e0, q0, p0);
+	quantizeMode6(e1, q1, p1);
+
+	uint8_t indices[16];
+	float error = encodeMode6Indices(block, q0, p0, q1, p1, indices);
+
+	if (quality == BLOCK_QUALITY_HIGH && error > 0.0f)
+	{
+		float weights[16];
+		for (int i = 0; i < 16; i++)
+			weights[i] = bc7Weights[indices[i]] / 64.0f;
+
+		if (refineEndpoints(block, 4, weights, e0, e1))
+		{
+			uint8_t refined0[4], refined1[4], refinedP0, refinedP1;
+			quantizeMode6(e0, refined0, refinedP0);
+			quantizeMode6(e1, refined1, refinedP1);
+
+			uint8_t refinedIndices[16];
+			float refinedError = encodeMode6Indices(block, refined0, refinedP0, refined1, refinedP1, refinedIndices);
+
+			if (refinedError < error) {
+				memcpy(q0, refined0, sizeof(q0));
+				memcpy(q1, refined1, sizeof(q1));
+				p0 = refinedP0;
+				p1 = refinedP1;
+				memcpy(indices, refinedIndices, sizeof(indices));
+			}
+		}
+	}
+
+	// The first index is stored with an implicit zero top bit, flip the pair if it is set
+	if (indices[0] & 8)
+	{
+		for (int c = 0; c < 4; c++)
+			std::swap(q0[c], q1[c]);
+		std::swap(p0, p1);
+
+		for (int i = 0; i < 16; i++)
+			indices[i] = static_cast<uint8_t>(15 - indices[i]);
+	}
+
+	BitWriter writer(pOut);
+	writer.write(1 << 6, 7);
+	for (int c = 0; c < 4; c++)
+	{
+		writer.write(q0[c], 7);
+		writer.write(q1[c], 7);
+	}
+	writer.write(p0, 1);
+	writer.write(p1, 1);
+
+	writer.write(indices[0], 3);
+	for (int i = 1; i < 16; i++)
+		writer.write(indices[i], 4);
+}
+
+size_t BlockCompressor::getBlockSize(BlockFormat format)
+{
+	switch (format)
+	{
+	case BLOCK_FORMAT_BC1:
+		return 8;
+	case BLOCK_FORMAT_BC3:
+	case BLOCK_FORMAT_BC7:
+		return 16;
+	default:
+		return 0;
+	}
+}
+
+size_t BlockCompressor::getDataSize(BlockFormat format, uint32_t width, uint32_t height)
+{
+	if (format == BLOCK_FORMAT_NONE)
+		return static_cast<size_t>(width) * height * 4;
+
+	size_t blocksX = (width + 3) / 4;
+	size_t blocksY = (height + 3) / 4;
+
+	return blocksX * blocksY * getBlockSize(format);
+}
+
+bool BlockCompressor::hasAlpha(const uint8_t * pTexels, uint32_t width, uint32_t height)
+{
+	size_t texelCount = static_cast<size_t>(width) * height;
+	for (size_t i = 0; i < texelCount; i++)
+	{
+		if (pTexels[i * 4 + 3] != 255)
+			return true;
+	}
+
+	return false;
+}
+
+void BlockCompressor::compress(BlockFormat format, BlockQuality quality, const uint8_t * pTexels, uint32_t width, uint32_t height, uint8_t * pBlocks)
+{
+	if (format == BLOCK_FORMAT_NONE) {
+		memcpy(pBlocks, pTexels, getDataSize(format, width, height));
+		return;
+	}
+
+	uint32_t blocksX = (width + 3) / 4;
+	uint32_t blocksY = (height + 3) / 4;
+	size_t blockSize = getBlockSize(format);
+
+	alignas(16) BlockChannels block;
+
+	for (uint32_t by = 0; by < blocksY; by++)
+	{
+		for (uint32_t bx = 0; bx < blocksX; bx++)
+		{
+			loadBlock(pTexels, width, height, bx, by, block);
+
+			uint8_t* pOut = pBlocks + (static_cast<size_t>(by) * blocksX + bx) * blockSize;
+
+			switch (format)
+			{
+			case BLOCK_FORMAT_BC1:
+				encodeColorBlock(block, quality, pOut);
+				break;
+			case BLOCK_FORMAT_BC3:
+				encodeAlphaBlock(block, pOut);
+				encodeColorBlock(block, quality, pOut + 8);
+				break;
+			case BLOCK_FORMAT_BC7:
+				encodeMode6Block(block, quality, pOut);
+				break;
+			default:
+				break;
+			}
+		}
+	}
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// Texel encodings stored in texture containers
+enum BlockFormat {
+	BLOCK_FORMAT_NONE = 0,	// Plain RGBA8
+	BLOCK_FORMAT_BC1 = 1,	// Opaque RGB, 8 bytes per 4x4 block
+	BLOCK_FORMAT_BC3 = 2,	// RGB plus interpolated alpha, 16 bytes per 4x4 block
+	BLOCK_FORMAT_BC7 = 3	// RGBA in mode 6, 16 bytes per 4x4 block
+};
+
+// Fast takes the bounding box of a block as endpoints,
+// high fits the principal axis and refines the endpoints by least squares
+enum BlockQuality {
+	BLOCK_QUALITY_FAST = 0,
+	BLOCK_QUALITY_HIGH = 1
+};
+
+class BlockCompressor
+{
+public:
+	static size_t getBlockSize(BlockFormat format);
+	// Bytes needed for one image, plain RGBA8 included
+	static size_t getDataSize(BlockFormat format, uint32_t width, uint32_t height);
+
+	static bool hasAlpha(const uint8_t* pTexels, uint32_t width, uint32_t height);
+
+	// Encode RGBA8 texels, blocks on the border repeat the last row and column of the image
+	static void compress(
+		BlockFormat format,
+		BlockQuality quality,
+		const uint8_t* pTexels,
+		uint32_t width,
+		uint32_t height,
+		uint8_t* pBlocks);
+};
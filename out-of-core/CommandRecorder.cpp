@@ -0,0 +1,87 @@
+#include "CommandRecorder.h"
+#include "Trace.h"
+
+#include <algorithm>
+
+
+CommandRecorder::CommandRecorder(VkDevice device, uint32_t queueFamilyIndex, JobSystem *jobs, uint32_t threadCount, uint32_t frameCount) : device(device), jobs(jobs)
+{
+	threads.resize(std::max(threadCount, 1u));
+	frameCmdBuffers.resize(frameCount);
+
+	for (auto& thread : threads)
+	{
+		// The pool is reset as a whole before every recording
+		VkCommandPoolCreateInfo cmdPoolInfo = {};
+		cmdPoolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+		cmdPoolInfo.queueFamilyIndex = queueFamilyIndex;
+		cmdPoolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+		VK_CHECK_RESULT(vkCreateCommandPool(device, &cmdPoolInfo, nullptr, &thread.cmdPool));
+
+		thread.cmdBuffers.resize(frameCount);
+
+		VkCommandBufferAllocateInfo cmdBufAllocateInfo = {};
+		cmdBufAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		cmdBufAllocateInfo.commandPool = thread.cmdPool;
+		cmdBufAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+		cmdBufAllocateInfo.commandBufferCount = frameCount;
+		VK_CHECK_RESULT(vkAllocateCommandBuffers(device, &cmdBufAllocateInfo, thread.cmdBuffers.data()));
+	}
+}
+
+
+CommandRecorder::~CommandRecorder()
+{
+	// Destroying a pool frees its command buffers
+	for (auto& thread : threads)
+		vkDestroyCommandPool(device, thread.cmdPool, nullptr);
+}
+
+void CommandRecorder::record(VkRenderPass renderPass, const std::vector<VkFramebuffer>& framebuffers, uint32_t itemCount, const RecordFunc & recordSlice, uint32_t threadCount)
+{
+	TRACE_ZONE("CommandRecorder::record", "frame");
+
+	uint32_t workerCount = (threadCount == 0) ? static_cast<uint32_t>(threads.size()) : std::min(threadCount, static_cast<uint32_t>(threads.size()));
+	// Every worker gets at least one item
+	workerCount = std::max(std::min(workerCount, itemCount), 1u);
+
+	auto recordThread = [&](uint32_t t) {
+		ThreadData& thread = threads[t];
+
+		VK_CHECK_RESULT(vkResetCommandPool(device, thread.cmdPool, 0));
+
+		// Contiguous slices keep the draw order of the list
+		uint32_t first = static_cast<uint32_t>(static_cast<uint64_t>(itemCount) * t / workerCount);
+		uint32_t last = static_cast<uint32_t>(static_cast<uint64_t>(itemCount) * (t + 1) / workerCount);
+
+		for (uint32_t frame = 0; frame < thread.cmdBuffers.size(); frame++)
+		{
+			VkCommandBufferInheritanceInfo inheritanceInfo = {};
+			inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+			inheritanceInfo.renderPass = renderPass;
+			inheritanceInfo.subpass = 0;
+			inheritanceInfo.framebuffer = framebuffers[frame];
+
+			VkCommandBufferBeginInfo cmdBufInfo = {};
+			cmdBufInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+			cmdBufInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+			cmdBufInfo.pInheritanceInfo = &inheritanceInfo;
+
+			VK_CHECK_RESULT(vkBeginCommandBuffer(thread.cmdBuffers[frame], &cmdBufInfo));
+			recordSlice(thread.cmdBuffers[frame], frame, first, last - first);
+			VK_CHECK_RESULT(vkEndCommandBuffer(thread.cmdBuffers[frame]));
+		}
+	};
+
+	// One slice per range, the calling thread records as well
+	jobs->parallelFor(workerCount, 1, [&](size_t t, size_t) {
+		recordThread(static_cast<uint32_t>(t));
+	}, workerCount);
+
+	for (uint32_t frame = 0; frame < frameCmdBuffers.size(); frame++)
+	{
+		frameCmdBuffers[frame].resize(workerCount);
+		for (uint32_t t = 0; t < workerCount; t++)
+			frameCmdBuffers[frame][t] = threads[t].cmdBuffers[frame];
+	}
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "VkUtils.h"
+#include "JobSystem.h"
+
+#include <functional>
+#include <vector>
+
+// Records a draw list into secondary command buffers on several threads
+// Every thread owns a command pool, so no pool is ever touched by two threads
+// Slice t of the list is recorded with the t-th pool for every frame, on whichever job thread picks it up
+class CommandRecorder
+{
+public:
+	// Records count items starting at first into the secondary cmdBuffer, called on a job thread
+	typedef std::function<void(VkCommandBuffer cmdBuffer, uint32_t frame, uint32_t first, uint32_t count)> RecordFunc;
+
+	CommandRecorder(VkDevice device, uint32_t queueFamilyIndex, JobSystem *jobs, uint32_t threadCount, uint32_t frameCount);
+	virtual ~CommandRecorder();
+
+	// Re-records all frames, the secondaries continue the given subpass of the frame's framebuffer
+	// threadCount limits the workers used for this recording, 0 uses all of them
+	void record(VkRenderPass renderPass, const std::vector<VkFramebuffer>& framebuffers, uint32_t itemCount, const RecordFunc& recordSlice, uint32_t threadCount = 0);
+
+	// Secondaries of a frame in draw order, one per thread that got a slice
+	inline const std::vector<VkCommandBuffer>& getCommandBuffers(uint32_t frame) { return frameCmdBuffers[frame]; }
+	inline uint32_t getThreadCount() { return static_cast<uint32_t>(threads.size()); }
+
+private:
+	struct ThreadData {
+		VkCommandPool cmdPool;
+		// One secondary per frame
+		std::vector<VkCommandBuffer> cmdBuffers;
+	};
+
+	VkDevice device;
+	JobSystem *jobs;
+	std::vector<ThreadData> threads;
+	std::vector<std::vector<VkCommandBuffer>> frameCmdBuffers;
+};
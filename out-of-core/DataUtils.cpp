@@ -0,0 +1,39 @@
+#include "DataUtils.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+void DataUtils::hashBytes(uint64_t & hash, const void * pData, size_t size)
+{
+	const uint64_t prime = 1099511628211ULL;
+	const uint8_t* pBytes = static_cast<const uint8_t*>(pData);
+
+	size_t words = size / sizeof(uint64_t);
+	for (size_t i = 0; i < words; i++)
+	{
+		uint64_t word;
+		memcpy(&word, pBytes + i * sizeof(uint64_t), sizeof(uint64_t));
+		hash = (hash ^ word) * prime;
+	}
+	for (size_t i = words * sizeof(uint64_t); i < size; i++)
+		hash = (hash ^ pBytes[i]) * prime;
+}
+
+bool DataUtils::writeFile(const std::string & filePath, const std::function<void(std::ostream&)>& writeContents)
+{
+	std::ofstream os(filePath.c_str(), std::ios::binary | std::ios::out | std::ios::trunc);
+	if (!os.is_open())
+		return false;
+
+	writeContents(os);
+
+	// Closing flushes, so its failure counts as well
+	os.close();
+	bool isGood = !os.fail();
+
+	if (!isGood)
+		std::remove(filePath.c_str());
+
+	return isGood;
+}
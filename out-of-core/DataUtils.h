@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <ostream>
+#include <string>
+
+// Start value of hashBytes
+#define DATA_HASH_SEED 14695981039346656037ULL
+
+// Helpers shared by the on-disk caches and the content keyed lookups
+class DataUtils
+{
+public:
+	// 64-bit FNV-1a over 8 byte words and the remaining bytes, continues from hash so data can be fed piece by piece
+	// Only stable within one build and byte order, containers storing a hash bump their version when it changes
+	static void hashBytes(uint64_t& hash, const void* pData, size_t size);
+
+	// Truncates filePath and hands the stream to writeContents
+	// A file that was not written completely is removed, so no truncated cache is ever read back
+	static bool writeFile(const std::string& filePath, const std::function<void(std::ostream&)>& writeContents);
+};
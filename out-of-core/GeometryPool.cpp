@@ -0,0 +1,78 @@
+#include "GeometryPool.h"
+
+
+GeometryPool::GeometryPool(ResourceManager *resMan, VkDeviceSize capacity, VkBufferUsageFlags usage) : resMan(resMan)
+{
+	resMan->createBufferInDevice(capacity, usage, &buffer);
+	freeBlocks[0] = capacity;
+}
+
+
+GeometryPool::~GeometryPool()
+{
+	resMan->destroyBuffer(buffer);
+}
+
+VkDeviceSize GeometryPool::allocate(VkDeviceSize size, VkDeviceSize alignment)
+{
+	for (auto it = freeBlocks.begin(); it != freeBlocks.end(); ++it)
+	{
+		VkDeviceSize blockOffset = it->first;
+		VkDeviceSize blockSize = it->second;
+
+		VkDeviceSize offset = (blockOffset + alignment - 1) / alignment * alignment;
+		VkDeviceSize padding = offset - blockOffset;
+		if (padding + size > blockSize)
+			continue;
+
+		freeBlocks.erase(it);
+
+		// Alignment padding and the tail stay free
+		if (padding > 0)
+			freeBlocks[blockOffset] = padding;
+		if (padding + size < blockSize)
+			freeBlocks[offset + size] = blockSize - padding - size;
+
+		usedSize += size;
+		return offset;
+	}
+
+	return GEOMETRY_POOL_INVALID_OFFSET;
+}
+
+void GeometryPool::free(VkDeviceSize offset, VkDeviceSize size)
+{
+	usedSize -= size;
+
+	auto next = freeBlocks.lower_bound(offset);
+
+	// Merge with the following block
+	if (next != freeBlocks.end() && offset + size == next->first)
+	{
+		size += next->second;
+		next = freeBlocks.erase(next);
+	}
+
+	// Merge with the preceding block
+	if (next != freeBlocks.begin())
+	{
+		auto previous = std::prev(next);
+		if (previous->first + previous->second == offset)
+		{
+			previous->second += size;
+			return;
+		}
+	}
+
+	freeBlocks[offset] = size;
+}
+
+void GeometryPool::upload(VkDeviceSize offset, const void * pData, VkDeviceSize size, std::vector<BufferUpdate>& updates)
+{
+	BufferUpdate update;
+	update.buffer = &buffer;
+	update.offset = offset;
+	update.pData = pData;
+	update.size = size;
+	updates.push_back(update);
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "ResourceManager.h"
+
+#include <map>
+
+#define GEOMETRY_POOL_INVALID_OFFSET (~static_cast<VkDeviceSize>(0))
+
+// One device buffer sub-allocated with a free list
+// Holds geometry that comes and goes at runtime without new buffer handles,
+// so recorded command buffers stay valid while ranges are streamed in and out
+class GeometryPool
+{
+public:
+	GeometryPool(ResourceManager *resMan, VkDeviceSize capacity, VkBufferUsageFlags usage);
+	virtual ~GeometryPool();
+
+	// First fit, returns GEOMETRY_POOL_INVALID_OFFSET when no free block is large enough
+	VkDeviceSize allocate(VkDeviceSize size, VkDeviceSize alignment);
+	void free(VkDeviceSize offset, VkDeviceSize size);
+
+	// Only queues the copy, the range holds the data once updates went through ResourceManager::updateBuffers
+	void upload(VkDeviceSize offset, const void* pData, VkDeviceSize size, std::vector<BufferUpdate>& updates);
+
+	inline VkBuffer getBuffer() { return buffer.buffer; }
+	inline VkDeviceSize getCapacity() { return buffer.size; }
+	inline VkDeviceSize getUsedSize() { return usedSize; }
+
+private:
+	ResourceManager *resMan;
+	Buffer buffer;
+
+	// Offset to size of every free block, neighbours are merged on free
+	std::map<VkDeviceSize, VkDeviceSize> freeBlocks;
+	VkDeviceSize usedSize = 0;
+};
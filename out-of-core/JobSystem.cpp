@@ -0,0 +1,269 @@
+#include "JobSystem.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+
+// Queue of the job system the current thread works for, other threads use queue 0
+static thread_local JobSystem *currentSystem = nullptr;
+static thread_local uint32_t currentQueue = 0;
+
+
+JobSystem::JobSystem(uint32_t workerCount) : queues(workerCount + 1)
+{
+	for (uint32_t i = 1; i < queues.size(); i++)
+		workers.emplace_back(&JobSystem::workerLoop, this, i);
+}
+
+
+JobSystem::~JobSystem()
+{
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		isStopping = true;
+	}
+	wakeCondition.notify_all();
+
+	for (auto& worker : workers)
+		worker.join();
+}
+
+void JobSystem::run(const Job & job, JobCounter * counter)
+{
+	counter->pending.fetch_add(1, std::memory_order_relaxed);
+	push({ job, counter });
+}
+
+void JobSystem::run(const Job & job, JobCounter * counter, JobCounter * dependency)
+{
+	counter->pending.fetch_add(1, std::memory_order_relaxed);
+
+	{
+		std::lock_guard<std::mutex> lock(dependency->mutex);
+		if (!dependency->isDone()) {
+			dependency->continuations.push_back({ job, counter });
+			return;
+		}
+	}
+
+	push({ job, counter });
+}
+
+void JobSystem::wait(JobCounter * counter)
+{
+	while (!counter->isDone())
+	{
+		if (!runOne())
+			std::this_thread::yield();
+	}
+
+	// Also waits for the job that finished last to release the counter
+	std::exception_ptr exception;
+	{
+		std::lock_guard<std::mutex> lock(counter->mutex);
+		std::swap(exception, counter->exception);
+	}
+
+	if (exception)
+		std::rethrow_exception(exception);
+}
+
+uint32_t JobSystem::parallelFor(size_t count, size_t grainSize, const std::function<void(size_t begin, size_t end)>& func, uint32_t maxThreads)
+{
+	grainSize = std::max<size_t>(grainSize, 1);
+	size_t rangeCount = (count + grainSize - 1) / grainSize;
+
+	uint32_t threadCount = (maxThreads == 0) ? getThreadCount() : std::min(maxThreads, getThreadCount());
+	threadCount = static_cast<uint32_t>(std::max<size_t>(std::min<size_t>(threadCount, rangeCount), 1));
+
+	// Ranges are handed out one at a time, so uneven ranges still balance
+	std::atomic<size_t> nextRange(0);
+	auto pullRanges = [&]() {
+		for (size_t range = nextRange++; range < rangeCount; range = nextRange++)
+			func(range * grainSize, std::min(count, (range + 1) * grainSize));
+	};
+
+	JobCounter counter;
+	for (uint32_t t = 1; t < threadCount; t++)
+		run(pullRanges, &counter);
+
+	// The caller pulls as well, an exception here still waits for the other threads
+	std::exception_ptr exception;
+	try {
+		pullRanges();
+	}
+	catch (...) {
+		exception = std::current_exception();
+		nextRange = rangeCount;
+	}
+
+	wait(&counter);
+
+	if (exception)
+		std::rethrow_exception(exception);
+
+	return threadCount;
+}
+
+void JobSystem::workerLoop(uint32_t queueIndex)
+{
+	currentSystem = this;
+	currentQueue = queueIndex;
+	TRACE_THREAD_NAME("Job " + std::to_string(queueIndex));
+
+	for (;;)
+	{
+		if (runOne())
+			continue;
+
+		std::unique_lock<std::mutex> lock(sleepMutex);
+		wakeCondition.wait(lock, [this]() { return isStopping || queuedCount.load() > 0; });
+		if (isStopping)
+			return;
+	}
+}
+
+uint32_t JobSystem::getQueueIndex()
+{
+	return (currentSystem == this) ? currentQueue : 0;
+}
+
+void JobSystem::push(Task task)
+{
+	WorkQueue& queue = queues[getQueueIndex()];
+	{
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.tasks.push_back(std::move(task));
+	}
+	queuedCount++;
+
+	// Taking the lock orders the wake up after a worker's check of queuedCount
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+	}
+	wakeCondition.notify_one();
+}
+
+bool JobSystem::runOne()
+{
+	uint32_t own = getQueueIndex();
+	uint32_t queueCount = static_cast<uint32_t>(queues.size());
+
+	Task task;
+	bool hasTask = false;
+
+	// Newest own task first, it is the most likely to be in cache
+	for (uint32_t i = 0; i < queueCount && !hasTask; i++)
+	{
+		WorkQueue& queue = queues[(own + i) % queueCount];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (queue.tasks.empty())
+			continue;
+
+		if (i == 0) {
+			task = std::move(queue.tasks.back());
+			queue.tasks.pop_back();
+		}
+		else {
+			task = std::move(queue.tasks.front());
+			queue.tasks.pop_front();
+		}
+		hasTask = true;
+	}
+
+	if (!hasTask)
+		return false;
+
+	queuedCount--;
+
+	try {
+		task.job();
+	}
+	catch (...) {
+		std::lock_guard<std::mutex> lock(task.counter->mutex);
+		if (!task.counter->exception)
+			task.counter->exception = std::current_exception();
+	}
+
+	finish(task.counter);
+	return true;
+}
+
+void JobSystem::finish(JobCounter * counter)
+{
+	// The decrement happens under the lock that wait takes before it returns,
+	// so the counter is not touched anymore once its owner may destroy it
+	std::vector<std::pair<Job, JobCounter*>> continuations;
+	{
+		std::lock_guard<std::mutex> lock(counter->mutex);
+		if (counter->pending.fetch_sub(1, std::memory_order_acq_rel) != 1)
+			return;
+		std::swap(continuations, counter->continuations);
+	}
+
+	for (auto& continuation : continuations)
+		push({ std::move(continuation.first), continuation.second });
+}
+
+uint32_t JobSystem::getDefaultWorkerCount()
+{
+	if (JOB_SYSTEM_WORKER_COUNT > 0)
+		return JOB_SYSTEM_WORKER_COUNT;
+	return std::max(1u, std::thread::hardware_concurrency()) - 1;
+}
+
+void JobSystem::benchmark()
+{
+	uint32_t maxThreadCount = std::max(1u, std::thread::hardware_concurrency());
+
+	// Push, pop and counter cost of jobs that do nothing
+	{
+		JobSystem jobs;
+		JobCounter counter;
+
+		auto tStart = std::chrono::high_resolution_clock::now();
+		for (uint32_t i = 0; i < JOB_SYSTEM_BENCHMARK_JOBS; i++)
+			jobs.run([]() {}, &counter);
+		jobs.wait(&counter);
+		auto tEnd = std::chrono::high_resolution_clock::now();
+
+		std::cout << "Job overhead: " << std::chrono::duration<double, std::nano>(tEnd - tStart).count() / JOB_SYSTEM_BENCHMARK_JOBS
+			<< " ns per empty job on " << jobs.getThreadCount() << " threads" << std::endl;
+
+		// One item per range measures the range hand out of parallelFor
+		tStart = std::chrono::high_resolution_clock::now();
+		jobs.parallelFor(JOB_SYSTEM_BENCHMARK_JOBS, 1, [](size_t, size_t) {});
+		tEnd = std::chrono::high_resolution_clock::now();
+
+		std::cout << "Job overhead: " << std::chrono::duration<double, std::nano>(tEnd - tStart).count() / JOB_SYSTEM_BENCHMARK_JOBS
+			<< " ns per parallel for item" << std::endl;
+	}
+
+	// The same compute bound loop on growing thread counts
+	const size_t itemCount = 1 << 22;
+	double singleMs = 0.0;
+
+	for (uint32_t threadCount = 1; ; threadCount = std::min(threadCount * 2, maxThreadCount))
+	{
+		JobSystem jobs(threadCount - 1);
+		std::vector<float> results(itemCount);
+
+		auto tStart = std::chrono::high_resolution_clock::now();
+		jobs.parallelFor(itemCount, 4096, [&results](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++)
+				results[i] = std::sqrt(static_cast<float>(i)) * std::sin(static_cast<float>(i));
+		});
+		auto tEnd = std::chrono::high_resolution_clock::now();
+
+		double ms = std::chrono::duration<double, std::milli>(tEnd - tStart).count();
+		if (threadCount == 1)
+			singleMs = ms;
+
+		std::cout << "Job scaling: " << threadCount << " threads " << ms << " ms (" << singleMs / ms << "x)" << std::endl;
+
+		if (threadCount == maxThreadCount)
+			break;
+	}
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Worker threads next to the threads that wait on jobs, 0 uses one less than the hardware threads
+#define JOB_SYSTEM_WORKER_COUNT 0
+// Print the task overhead and the parallel for scaling after startup
+#define JOB_SYSTEM_BENCHMARK 0
+// Empty jobs timed by the overhead benchmark
+#define JOB_SYSTEM_BENCHMARK_JOBS 100000
+
+typedef std::function<void()> Job;
+
+// Number of unfinished jobs of a group
+// Jobs may be started after a counter reaches zero, and the first exception of the group is kept for the waiter
+// isDone alone does not mean the jobs let go of the counter, it may only be destroyed once wait returned
+class JobCounter
+{
+public:
+	inline bool isDone() const { return pending.load(std::memory_order_acquire) == 0; }
+
+private:
+	friend class JobSystem;
+
+	std::atomic<uint32_t> pending = { 0 };
+
+	// Guards the members below
+	std::mutex mutex;
+	// Jobs started once pending drops to zero, with the counter each of them reports to
+	std::vector<std::pair<Job, JobCounter*>> continuations;
+	std::exception_ptr exception;
+};
+
+// Fixed pool of worker threads with one deque per thread
+// A thread pushes and pops at the back of its own deque and steals from the front of the others
+// Threads that are not workers share deque 0, and waiting threads run jobs instead of blocking
+class JobSystem
+{
+public:
+	JobSystem(uint32_t workerCount = getDefaultWorkerCount());
+	virtual ~JobSystem();
+
+	// The counter is incremented now and decremented when the job returns
+	void run(const Job& job, JobCounter* counter);
+	// Same, but the job is only queued once dependency has reached zero
+	void run(const Job& job, JobCounter* counter, JobCounter* dependency);
+
+	// Runs queued jobs until the counter reaches zero, rethrows the first exception of its jobs
+	void wait(JobCounter* counter);
+
+	// Calls func(begin, end) for ranges of grainSize items until all count items are done
+	// The ranges are pulled by at most maxThreads threads including the caller, 0 uses all of them
+	// Returns the number of threads the ranges were spread over
+	uint32_t parallelFor(size_t count, size_t grainSize, const std::function<void(size_t begin, size_t end)>& func, uint32_t maxThreads = 0);
+
+	// Workers plus the calling thread
+	inline uint32_t getThreadCount() { return static_cast<uint32_t>(workers.size()) + 1; }
+
+	// JOB_SYSTEM_WORKER_COUNT or one less than the hardware threads
+	static uint32_t getDefaultWorkerCount();
+
+	// Times empty jobs and a compute bound parallel for on 1, 2, 4, ... threads
+	static void benchmark();
+
+private:
+	struct Task {
+		Job job;
+		JobCounter *counter;
+	};
+
+	struct WorkQueue {
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	std::vector<std::thread> workers;
+	// One per worker, index 0 belongs to all other threads
+	std::vector<WorkQueue> queues;
+
+	// Tasks in all queues, workers sleep while it is zero
+	std::atomic<int64_t> queuedCount = { 0 };
+	std::mutex sleepMutex;
+	std::condition_variable wakeCondition;
+	bool isStopping = false;
+
+	void workerLoop(uint32_t queueIndex);
+	uint32_t getQueueIndex();
+
+	void push(Task task);
+	// Pops from the own queue or steals from another one, runs the task and returns false when all are empty
+	bool runOne();
+	void finish(JobCounter* counter);
+};
@@ -0,0 +1,199 @@
+#include "LzCodec.h"
+
+#include <cstring>
+#include <vector>
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+// A match has to start this far before the end, the last bytes are always literals
+#define LZ_MATCH_LIMIT 12
+#define LZ_LAST_LITERALS 5
+#define LZ_HASH_BITS 14
+
+static inline uint32_t read32(const uint8_t* p)
+{
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static inline uint32_t hash32(uint32_t sequence)
+{
+	return (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+// Lengths of 15 and more continue in extra bytes of 255 plus a remainder
+static inline bool writeLength(size_t length, uint8_t*& op, const uint8_t* opEnd)
+{
+	while (length >= 255)
+	{
+		if (op >= opEnd) return false;
+		*op++ = 255;
+		length -= 255;
+	}
+
+	if (op >= opEnd) return false;
+	*op++ = static_cast<uint8_t>(length);
+
+	return true;
+}
+
+static inline bool readLength(const uint8_t*& ip, const uint8_t* ipEnd, size_t& length)
+{
+	uint8_t byte;
+	do
+	{
+		if (ip >= ipEnd) return false;
+		byte = *ip++;
+		length += byte;
+	} while (byte == 255);
+
+	return true;
+}
+
+static bool writeSequence(
+	const uint8_t* pLiterals,
+	size_t literalLength,
+	size_t offset,
+	size_t matchLength,
+	uint8_t*& op,
+	const uint8_t* opEnd)
+{
+	if (op >= opEnd) return false;
+	uint8_t* pToken = op++;
+
+	size_t matchCode = (matchLength > 0) ? matchLength - LZ_MIN_MATCH : 0;
+	*pToken = static_cast<uint8_t>(((literalLength < 15 ? literalLength : 15) << 4) | (matchCode < 15 ? matchCode : 15));
+
+	if (literalLength >= 15 && !writeLength(literalLength - 15, op, opEnd))
+		return false;
+
+	if (static_cast<size_t>(opEnd - op) < literalLength) return false;
+	memcpy(op, pLiterals, literalLength);
+	op += literalLength;
+
+	// The final sequence carries literals only
+	if (matchLength == 0)
+		return true;
+
+	if (opEnd - op < 2) return false;
+	*op++ = static_cast<uint8_t>(offset);
+	*op++ = static_cast<uint8_t>(offset >> 8);
+
+	if (matchCode >= 15 && !writeLength(matchCode - 15, op, opEnd))
+		return false;
+
+	return true;
+}
+
+size_t LzCodec::getMaxCompressedSize(size_t srcSize)
+{
+	return srcSize + srcSize / 255 + 16;
+}
+
+size_t LzCodec::compress(const uint8_t * pSrc, size_t srcSize, uint8_t * pDst, size_t dstCapacity)
+{
+	uint8_t* op = pDst;
+	const uint8_t* opEnd = pDst + dstCapacity;
+
+	size_t anchor = 0;
+
+	if (srcSize > LZ_MATCH_LIMIT)
+	{
+		std::vector<uint32_t> table(static_cast<size_t>(1) << LZ_HASH_BITS, 0);
+
+		size_t matchStartLimit = srcSize - LZ_MATCH_LIMIT;
+		size_t matchEndLimit = srcSize - LZ_LAST_LITERALS;
+		size_t ip = 0;
+		// Skip faster through data that keeps missing
+		uint32_t misses = 0;
+
+		while (ip < matchStartLimit)
+		{
+			uint32_t sequence = read32(pSrc + ip);
+			uint32_t h = hash32(sequence);
+			size_t ref = table[h];
+			table[h] = static_cast<uint32_t>(ip);
+
+			if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(pSrc + ref) != sequence)
+			{
+				ip += 1 + (misses++ >> 6);
+				continue;
+			}
+			misses = 0;
+
+			size_t matchLength = LZ_MIN_MATCH;
+			while (ip + matchLength < matchEndLimit && pSrc[ref + matchLength] == pSrc[ip + matchLength])
+				matchLength++;
+
+			if (!writeSequence(pSrc + anchor, ip - anchor, ip - ref, matchLength, op, opEnd))
+				return 0;
+
+			ip += matchLength;
+			anchor = ip;
+		}
+	}
+
+	if (!writeSequence(pSrc + anchor, srcSize - anchor, 0, 0, op, opEnd))
+		return 0;
+
+	return static_cast<size_t>(op - pDst);
+}
+
+bool LzCodec::decompress(const uint8_t * pSrc, size_t srcSize, uint8_t * pDst, size_t dstSize)
+{
+	const uint8_t* ip = pSrc;
+	const uint8_t* ipEnd = pSrc + srcSize;
+	uint8_t* op = pDst;
+	uint8_t* opEnd = pDst + dstSize;
+
+	while (ip < ipEnd)
+	{
+		uint8_t token = *ip++;
+
+		size_t literalLength = token >> 4;
+		if (literalLength == 15 && !readLength(ip, ipEnd, literalLength))
+			return false;
+
+		if (static_cast<size_t>(ipEnd - ip) < literalLength || static_cast<size_t>(opEnd - op) < literalLength)
+			return false;
+
+		memcpy(op, ip, literalLength);
+		ip += literalLength;
+		op += literalLength;
+
+		// Literals only, end of the block
+		if (ip == ipEnd)
+			break;
+
+		if (ipEnd - ip < 2)
+			return false;
+
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		if (offset == 0 || offset > static_cast<size_t>(op - pDst))
+			return false;
+
+		size_t matchLength = token & 15;
+		if (matchLength == 15 && !readLength(ip, ipEnd, matchLength))
+			return false;
+		matchLength += LZ_MIN_MATCH;
+
+		if (static_cast<size_t>(opEnd - op) < matchLength)
+			return false;
+
+		const uint8_t* pMatch = op - offset;
+		if (offset >= matchLength) {
+			memcpy(op, pMatch, matchLength);
+			op += matchLength;
+		}
+		else {
+			// Overlapping copy repeats the last offset bytes
+			for (size_t i = 0; i < matchLength; i++)
+				*op++ = pMatch[i];
+		}
+	}
+
+	return op == opEnd;
+}
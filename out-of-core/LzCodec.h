@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// Byte oriented LZ77 codec in the LZ4 block layout, tuned for decode speed over ratio
+class LzCodec
+{
+public:
+	// Worst case output size, incompressible input grows slightly
+	static size_t getMaxCompressedSize(size_t srcSize);
+
+	// Returns the compressed size, 0 if dst is too small
+	static size_t compress(const uint8_t* pSrc, size_t srcSize, uint8_t* pDst, size_t dstCapacity);
+	// Fails on malformed input or when the output does not fill exactly dstSize bytes
+	static bool decompress(const uint8_t* pSrc, size_t srcSize, uint8_t* pDst, size_t dstSize);
+};
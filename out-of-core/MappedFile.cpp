@@ -0,0 +1,121 @@
+#include "MappedFile.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+MappedFile::MappedFile()
+{
+}
+
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+bool MappedFile::open(const std::string & filePath)
+{
+	close();
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(filePath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+		CloseHandle(file);
+		return false;
+	}
+
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping == nullptr) {
+		CloseHandle(file);
+		return false;
+	}
+
+	void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (view == nullptr) {
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+
+	fileHandle = file;
+	mappingHandle = mapping;
+	fileSize = static_cast<size_t>(size.QuadPart);
+	pData = view;
+#else
+	int fd = ::open(filePath.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size == 0) {
+		::close(fd);
+		return false;
+	}
+
+	void* view = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	if (view == MAP_FAILED) {
+		::close(fd);
+		return false;
+	}
+
+	fileDesc = fd;
+	fileSize = static_cast<size_t>(info.st_size);
+	pData = view;
+#endif
+
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (pData == nullptr)
+		return;
+
+#ifdef _WIN32
+	UnmapViewOfFile(pData);
+	CloseHandle(mappingHandle);
+	CloseHandle(fileHandle);
+	mappingHandle = nullptr;
+	fileHandle = nullptr;
+#else
+	munmap(const_cast<void*>(pData), fileSize);
+	::close(fileDesc);
+	fileDesc = -1;
+#endif
+
+	pData = nullptr;
+	fileSize = 0;
+}
+
+bool MappedFile::getFileStamp(const std::string & filePath, uint64_t * pSize, uint64_t * pModifiedTime)
+{
+#ifdef _WIN32
+	struct _stat64 info;
+	if (_stat64(filePath.c_str(), &info) != 0)
+		return false;
+#else
+	struct stat info;
+	if (stat(filePath.c_str(), &info) != 0)
+		return false;
+#endif
+
+	*pSize = static_cast<uint64_t>(info.st_size);
+	*pModifiedTime = static_cast<uint64_t>(info.st_mtime);
+
+	return true;
+}
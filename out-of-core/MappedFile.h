@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+// Read-only memory mapping of a whole file
+// Used to hand cached asset data straight to staging buffers without an intermediate copy
+class MappedFile
+{
+public:
+	MappedFile();
+	virtual ~MappedFile();
+
+	bool open(const std::string& filePath);
+	void close();
+
+	inline const void* data() const { return pData; }
+	inline size_t size() const { return fileSize; }
+	inline bool isOpen() const { return pData != nullptr; }
+
+	// Size and last write time of a file, used to detect stale caches
+	static bool getFileStamp(const std::string& filePath, uint64_t* pSize, uint64_t* pModifiedTime);
+
+private:
+	const void* pData = nullptr;
+	size_t fileSize = 0;
+
+#ifdef _WIN32
+	void* fileHandle = nullptr;
+	void* mappingHandle = nullptr;
+#else
+	int fileDesc = -1;
+#endif
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+};
@@ -0,0 +1,685 @@
+#include "MeshOptimizer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <unordered_set>
+
+// Forsyth's tuning, scores favour vertices deep in an LRU cache and vertices with few remaining triangles
+#define FORSYTH_CACHE_SIZE 32
+#define FORSYTH_CACHE_DECAY_POWER 1.5f
+#define FORSYTH_LAST_TRIANGLE_SCORE 0.75f
+#define FORSYTH_VALENCE_BOOST_SCALE 2.0f
+#define FORSYTH_VALENCE_BOOST_POWER 0.5f
+#define FORSYTH_MAX_VALENCE 32
+
+struct ForsythScores {
+	float cache[FORSYTH_CACHE_SIZE];
+	float valence[FORSYTH_MAX_VALENCE];
+
+	ForsythScores() {
+		for (int i = 0; i < FORSYTH_CACHE_SIZE; i++)
+		{
+			// The last triangle's vertices get a fixed score so the next one is not forced to reuse all three
+			if (i < 3)
+				cache[i] = FORSYTH_LAST_TRIANGLE_SCORE;
+			else
+				cache[i] = std::pow(1.0f - static_cast<float>(i - 3) / (FORSYTH_CACHE_SIZE - 3), FORSYTH_CACHE_DECAY_POWER);
+		}
+
+		valence[0] = 0.0f;
+		for (int i = 1; i < FORSYTH_MAX_VALENCE; i++)
+			valence[i] = FORSYTH_VALENCE_BOOST_SCALE * std::pow(static_cast<float>(i), -FORSYTH_VALENCE_BOOST_POWER);
+	}
+
+	inline float get(int cachePosition, uint32_t liveTriangles) const {
+		if (liveTriangles == 0)
+			return -1.0f;
+
+		float score = cachePosition >= 0 ? cache[cachePosition] : 0.0f;
+		return score + valence[std::min<uint32_t>(liveTriangles, FORSYTH_MAX_VALENCE - 1)];
+	}
+};
+
+void MeshOptimizer::optimizeVertexCache(uint32_t * pIndices, size_t indexCount, uint32_t vertexCount)
+{
+	static const ForsythScores scores;
+
+	size_t triangleCount = indexCount / 3;
+	if (triangleCount == 0)
+		return;
+
+	// Triangle adjacency of every vertex, liveTriangles shrinks as triangles are emitted
+	std::vector<uint32_t> liveTriangles(vertexCount, 0);
+	for (size_t i = 0; i < triangleCount * 3; i++)
+		liveTriangles[pIndices[i]]++;
+
+	std::vector<uint32_t> adjacencyOffsets(vertexCount + 1, 0);
+	for (uint32_t v = 0; v < vertexCount; v++)
+		adjacencyOffsets[v + 1] = adjacencyOffsets[v] + liveTriangles[v];
+
+	std::vector<uint32_t> adjacency(triangleCount * 3);
+	{
+		std::vector<uint32_t> fill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+		for (size_t t = 0; t < triangleCount; t++)
+			for (size_t j = 0; j < 3; j++)
+				adjacency[fill[pIndices[t * 3 + j]]++] = static_cast<uint32_t>(t);
+	}
+
+	std::vector<int> cachePositions(vertexCount, -1);
+	std::vector<float> vertexScores(vertexCount);
+	for (uint32_t v = 0; v < vertexCount; v++)
+		vertexScores[v] = scores.get(-1, liveTriangles[v]);
+
+	std::vector<float> triangleScores(triangleCount);
+	for (size_t t = 0; t < triangleCount; t++)
+		triangleScores[t] = vertexScores[pIndices[t * 3]] + vertexScores[pIndices[t * 3 + 1]] + vertexScores[pIndices[t * 3 + 2]];
+
+	std::vector<bool> isEmitted(triangleCount, false);
+	std::vector<uint32_t> result(triangleCount * 3);
+
+	// The extra slots hold the vertices pushed out by the newest triangle
+	uint32_t cache[FORSYTH_CACHE_SIZE + 3];
+	uint32_t cacheSize = 0;
+
+	size_t bestTriangle = 0;
+	for (size_t t = 1; t < triangleCount; t++)
+		if (triangleScores[t] > triangleScores[bestTriangle])
+			bestTriangle = t;
+
+	// Restart point for the linear scan when the cache holds no live triangle
+	size_t scanCursor = 0;
+
+	for (size_t emitted = 0; emitted < triangleCount; emitted++)
+	{
+		const uint32_t* tri = pIndices + bestTriangle * 3;
+		result[emitted * 3 + 0] = tri[0];
+		result[emitted * 3 + 1] = tri[1];
+		result[emitted * 3 + 2] = tri[2];
+		isEmitted[bestTriangle] = true;
+
+		// Drop the triangle from the adjacency of its vertices
+		for (size_t j = 0; j < 3; j++)
+		{
+			uint32_t v = tri[j];
+			uint32_t* begin = adjacency.data() + adjacencyOffsets[v];
+			uint32_t* end = begin + liveTriangles[v];
+			uint32_t* it = std::find(begin, end, static_cast<uint32_t>(bestTriangle));
+			std::swap(*it, *(end - 1));
+			liveTriangles[v]--;
+		}
+
+		// Move the triangle's vertices to the front of the LRU cache
+		uint32_t newCache[FORSYTH_CACHE_SIZE + 3];
+		uint32_t newCacheSize = 0;
+		for (size_t j = 0; j < 3; j++)
+			newCache[newCacheSize++] = tri[j];
+		for (uint32_t c = 0; c < cacheSize; c++)
+		{
+			uint32_t v = cache[c];
+			if (v != tri[0] && v != tri[1] && v != tri[2])
+				newCache[newCacheSize++] = v;
+		}
+
+		// Rescore the vertices whose position changed, including the ones that fell out
+		for (uint32_t c = 0; c < newCacheSize; c++)
+		{
+			uint32_t v = newCache[c];
+			cachePositions[v] = (c < FORSYTH_CACHE_SIZE) ? static_cast<int>(c) : -1;
+			vertexScores[v] = scores.get(cachePositions[v], liveTriangles[v]);
+		}
+
+		cacheSize = std::min<uint32_t>(newCacheSize, FORSYTH_CACHE_SIZE);
+		std::copy(newCache, newCache + cacheSize, cache);
+
+		// The next triangle is the best one touching the cache
+		float bestScore = -1.0f;
+		bool isFound = false;
+		for (uint32_t c = 0; c < cacheSize; c++)
+		{
+			uint32_t v = cache[c];
+			const uint32_t* begin = adjacency.data() + adjacencyOffsets[v];
+			for (uint32_t a = 0; a < liveTriangles[v]; a++)
+			{
+				uint32_t t = begin[a];
+				const uint32_t* adjTri = pIndices + t * 3;
+				float score = vertexScores[adjTri[0]] + vertexScores[adjTri[1]] + vertexScores[adjTri[2]];
+				triangleScores[t] = score;
+
+				if (score > bestScore)
+				{
+					bestScore = score;
+					bestTriangle = t;
+					isFound = true;
+				}
+			}
+		}
+
+		if (!isFound)
+		{
+			// Cache is exhausted, continue with the next triangle not emitted yet
+			while (scanCursor < triangleCount && isEmitted[scanCursor])
+				scanCursor++;
+			bestTriangle = scanCursor;
+		}
+	}
+
+	std::copy(result.begin(), result.end(), pIndices);
+}
+
+void MeshOptimizer::optimizeOverdraw(uint32_t * pIndices, size_t indexCount, const float * pPositions, size_t positionStride, uint32_t vertexCount)
+{
+	size_t triangleCount = indexCount / 3;
+	if (triangleCount == 0)
+		return;
+
+	auto getPosition = [&](uint32_t v) {
+		return reinterpret_cast<const float*>(reinterpret_cast<const uint8_t*>(pPositions) + v * positionStride);
+	};
+
+	// Split into clusters wherever the FIFO cache misses a whole triangle, those are the points
+	// the cache optimizer jumped to a new region so reordering there costs next to nothing
+	std::vector<size_t> clusterStarts;
+	{
+		std::vector<uint32_t> timestamps(vertexCount, 0);
+		uint32_t time = MESH_OPTIMIZER_FIFO_CACHE_SIZE + 1;
+
+		for (size_t t = 0; t < triangleCount; t++)
+		{
+			uint32_t misses = 0;
+			for (size_t j = 0; j < 3; j++)
+			{
+				uint32_t v = pIndices[t * 3 + j];
+				if (time - timestamps[v] > MESH_OPTIMIZER_FIFO_CACHE_SIZE)
+				{
+					timestamps[v] = time++;
+					misses++;
+				}
+			}
+
+			if (t == 0 || misses == 3)
+				clusterStarts.push_back(t);
+		}
+	}
+
+	if (clusterStarts.size() < 2)
+		return;
+
+	// Mesh centroid over the referenced vertices
+	float meshCentroid[3] = { 0.0f, 0.0f, 0.0f };
+	for (size_t i = 0; i < triangleCount * 3; i++)
+	{
+		const float* p = getPosition(pIndices[i]);
+		meshCentroid[0] += p[0];
+		meshCentroid[1] += p[1];
+		meshCentroid[2] += p[2];
+	}
+	for (size_t k = 0; k < 3; k++)
+		meshCentroid[k] /= static_cast<float>(triangleCount * 3);
+
+	// Clusters facing away from the centroid occlude the ones behind them, draw them first
+	std::vector<float> sortKeys(clusterStarts.size());
+	for (size_t c = 0; c < clusterStarts.size(); c++)
+	{
+		size_t begin = clusterStarts[c];
+		size_t end = (c + 1 < clusterStarts.size()) ? clusterStarts[c + 1] : triangleCount;
+
+		float centroid[3] = { 0.0f, 0.0f, 0.0f };
+		float normal[3] = { 0.0f, 0.0f, 0.0f };
+		float area = 0.0f;
+
+		for (size_t t = begin; t < end; t++)
+		{
+			const float* p0 = getPosition(pIndices[t * 3 + 0]);
+			const float* p1 = getPosition(pIndices[t * 3 + 1]);
+			const float* p2 = getPosition(pIndices[t * 3 + 2]);
+
+			float e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+			float e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+			// Twice the area weighted normal
+			float n[3] = {
+				e1[1] * e2[2] - e1[2] * e2[1],
+				e1[2] * e2[0] - e1[0] * e2[2],
+				e1[0] * e2[1] - e1[1] * e2[0] };
+			float triangleArea = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+
+			for (size_t k = 0; k < 3; k++)
+			{
+				centroid[k] += (p0[k] + p1[k] + p2[k]) * triangleArea;
+				normal[k] += n[k];
+			}
+			area += triangleArea;
+		}
+
+		float normalLength = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+		if (area == 0.0f || normalLength == 0.0f)
+		{
+			sortKeys[c] = 0.0f;
+			continue;
+		}
+
+		float key = 0.0f;
+		for (size_t k = 0; k < 3; k++)
+			key += (centroid[k] / (area * 3.0f) - meshCentroid[k]) * (normal[k] / normalLength);
+		sortKeys[c] = key;
+	}
+
+	std::vector<uint32_t> order(clusterStarts.size());
+	for (size_t c = 0; c < order.size(); c++)
+		order[c] = static_cast<uint32_t>(c);
+	std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return sortKeys[a] > sortKeys[b]; });
+
+	std::vector<uint32_t> result;
+	result.reserve(triangleCount * 3);
+	for (uint32_t c : order)
+	{
+		size_t begin = clusterStarts[c];
+		size_t end = (c + 1 < clusterStarts.size()) ? clusterStarts[c + 1] : triangleCount;
+		result.insert(result.end(), pIndices + begin * 3, pIndices + end * 3);
+	}
+
+	std::copy(result.begin(), result.end(), pIndices);
+}
+
+void MeshOptimizer::optimizeVertexFetch(uint32_t * pIndices, size_t indexCount, uint32_t vertexCount, std::vector<uint32_t>& remap)
+{
+	const uint32_t unused = ~0u;
+	remap.assign(vertexCount, unused);
+
+	uint32_t nextVertex = 0;
+	for (size_t i = 0; i < indexCount; i++)
+	{
+		uint32_t& target = remap[pIndices[i]];
+		if (target == unused)
+			target = nextVertex++;
+		pIndices[i] = target;
+	}
+
+	for (uint32_t v = 0; v < vertexCount; v++)
+		if (remap[v] == unused)
+			remap[v] = nextVertex++;
+}
+
+// Bounding sphere and normal cone of the triangles [begin, end)
+static void computeMeshletBounds(Meshlet& meshlet, const uint32_t* pIndices, size_t begin, size_t end, const float* pPositions, size_t positionStride)
+{
+	auto getPosition = [&](uint32_t v) {
+		return reinterpret_cast<const float*>(reinterpret_cast<const uint8_t*>(pPositions) + v * positionStride);
+	};
+
+	// Sphere around the box center, not minimal but cheap and tight enough for clusters
+	float boundsMin[3] = { getPosition(pIndices[begin * 3])[0], getPosition(pIndices[begin * 3])[1], getPosition(pIndices[begin * 3])[2] };
+	float boundsMax[3] = { boundsMin[0], boundsMin[1], boundsMin[2] };
+	for (size_t i = begin * 3; i < end * 3; i++)
+	{
+		const float* p = getPosition(pIndices[i]);
+		for (size_t k = 0; k < 3; k++)
+		{
+			boundsMin[k] = std::min(boundsMin[k], p[k]);
+			boundsMax[k] = std::max(boundsMax[k], p[k]);
+		}
+	}
+
+	float radiusSquared = 0.0f;
+	for (size_t k = 0; k < 3; k++)
+		meshlet.center[k] = (boundsMin[k] + boundsMax[k]) * 0.5f;
+	for (size_t i = begin * 3; i < end * 3; i++)
+	{
+		const float* p = getPosition(pIndices[i]);
+		float dx = p[0] - meshlet.center[0], dy = p[1] - meshlet.center[1], dz = p[2] - meshlet.center[2];
+		radiusSquared = std::max(radiusSquared, dx * dx + dy * dy + dz * dz);
+	}
+	meshlet.radius = std::sqrt(radiusSquared);
+
+	// Cone around the average normal, its half angle is the widest triangle normal
+	std::vector<float> normals;
+	normals.reserve((end - begin) * 3);
+	float axis[3] = { 0.0f, 0.0f, 0.0f };
+	for (size_t t = begin; t < end; t++)
+	{
+		const float* p0 = getPosition(pIndices[t * 3 + 0]);
+		const float* p1 = getPosition(pIndices[t * 3 + 1]);
+		const float* p2 = getPosition(pIndices[t * 3 + 2]);
+
+		float e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+		float e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+		float n[3] = {
+			e1[1] * e2[2] - e1[2] * e2[1],
+			e1[2] * e2[0] - e1[0] * e2[2],
+			e1[0] * e2[1] - e1[1] * e2[0] };
+		float length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+
+		// Degenerate triangles are never visible
+		if (length == 0.0f)
+			continue;
+
+		for (size_t k = 0; k < 3; k++)
+		{
+			normals.push_back(n[k] / length);
+			axis[k] += n[k] / length;
+		}
+	}
+
+	float axisLength = std::sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+
+	meshlet.coneAxis[0] = 0.0f;
+	meshlet.coneAxis[1] = 0.0f;
+	meshlet.coneAxis[2] = 1.0f;
+	meshlet.coneCutoff = 1.0f;
+
+	if (axisLength == 0.0f)
+		return;
+
+	for (size_t k = 0; k < 3; k++)
+		axis[k] /= axisLength;
+
+	float minDot = 1.0f;
+	for (size_t i = 0; i < normals.size(); i += 3)
+		minDot = std::min(minDot, normals[i] * axis[0] + normals[i + 1] * axis[1] + normals[i + 2] * axis[2]);
+
+	for (size_t k = 0; k < 3; k++)
+		meshlet.coneAxis[k] = axis[k];
+
+	// Cones wider than a hemisphere can never be culled
+	if (minDot > 0.1f)
+		meshlet.coneCutoff = std::sqrt(1.0f - minDot * minDot);
+}
+
+void MeshOptimizer::buildMeshlets(const uint32_t * pIndices, size_t indexCount, const float * pPositions, size_t positionStride, uint32_t vertexCount, std::vector<Meshlet>& meshlets)
+{
+	size_t triangleCount = indexCount / 3;
+
+	// Last meshlet that used each vertex
+	std::vector<uint32_t> vertexOwners(vertexCount, ~0u);
+	uint32_t meshletId = 0;
+
+	size_t begin = 0;
+	uint32_t meshletVertexCount = 0;
+
+	auto emit = [&](size_t end) {
+		Meshlet meshlet = {};
+		meshlet.indexOffset = static_cast<uint32_t>(begin * 3);
+		meshlet.triangleCount = static_cast<uint32_t>(end - begin);
+		meshlet.vertexCount = meshletVertexCount;
+		computeMeshletBounds(meshlet, pIndices, begin, end, pPositions, positionStride);
+		meshlets.push_back(meshlet);
+
+		begin = end;
+		meshletVertexCount = 0;
+		meshletId++;
+	};
+
+	for (size_t t = 0; t < triangleCount; t++)
+	{
+		const uint32_t* tri = pIndices + t * 3;
+
+		uint32_t newVertices = 0;
+		for (size_t j = 0; j < 3; j++)
+			newVertices += (vertexOwners[tri[j]] != meshletId && (j == 0 || tri[j] != tri[0]) && (j < 2 || tri[j] != tri[1])) ? 1 : 0;
+
+		if (meshletVertexCount + newVertices > MESHLET_MAX_VERTICES || t - begin >= MESHLET_MAX_TRIANGLES)
+			emit(t);
+
+		for (size_t j = 0; j < 3; j++)
+		{
+			if (vertexOwners[tri[j]] != meshletId)
+			{
+				vertexOwners[tri[j]] = meshletId;
+				meshletVertexCount++;
+			}
+		}
+	}
+
+	if (begin < triangleCount)
+		emit(triangleCount);
+}
+
+// Symmetric 4x4 error quadric of a set of planes, sum of squared distances to them
+struct Quadric {
+	double a00 = 0, a01 = 0, a02 = 0, a11 = 0, a12 = 0, a22 = 0;
+	double b0 = 0, b1 = 0, b2 = 0, c = 0;
+
+	void addPlane(double nx, double ny, double nz, double d) {
+		a00 += nx * nx; a01 += nx * ny; a02 += nx * nz;
+		a11 += ny * ny; a12 += ny * nz; a22 += nz * nz;
+		b0 += nx * d; b1 += ny * d; b2 += nz * d;
+		c += d * d;
+	}
+
+	void add(const Quadric& q) {
+		a00 += q.a00; a01 += q.a01; a02 += q.a02;
+		a11 += q.a11; a12 += q.a12; a22 += q.a22;
+		b0 += q.b0; b1 += q.b1; b2 += q.b2;
+		c += q.c;
+	}
+
+	double evaluate(const float* p) const {
+		double x = p[0], y = p[1], z = p[2];
+		double error =
+			a00 * x * x + 2 * a01 * x * y + 2 * a02 * x * z +
+			a11 * y * y + 2 * a12 * y * z + a22 * z * z +
+			2 * (b0 * x + b1 * y + b2 * z) + c;
+		return error > 0.0 ? error : 0.0;
+	}
+};
+
+static void computeNormal(const float* p0, const float* p1, const float* p2, double* n)
+{
+	double e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+	double e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+	n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+	n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+	n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+}
+
+float MeshOptimizer::simplify(const uint32_t * pIndices, size_t indexCount, const float * pPositions, size_t positionStride, uint32_t vertexCount, size_t targetIndexCount, std::vector<uint32_t>& destination)
+{
+	auto getPosition = [&](uint32_t v) {
+		return reinterpret_cast<const float*>(reinterpret_cast<const uint8_t*>(pPositions) + v * positionStride);
+	};
+	auto edgeKey = [](uint32_t a, uint32_t b) {
+		return (static_cast<uint64_t>(a) << 32) | b;
+	};
+
+	destination.assign(pIndices, pIndices + (indexCount / 3) * 3);
+
+	// Quadrics of the planes around every vertex
+	std::vector<Quadric> quadrics(vertexCount);
+	for (size_t t = 0; t < destination.size(); t += 3)
+	{
+		const float* p0 = getPosition(destination[t]);
+		double n[3];
+		computeNormal(p0, getPosition(destination[t + 1]), getPosition(destination[t + 2]), n);
+		double length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+		if (length == 0.0)
+			continue;
+
+		n[0] /= length; n[1] /= length; n[2] /= length;
+		double d = -(n[0] * p0[0] + n[1] * p0[1] + n[2] * p0[2]);
+		for (size_t j = 0; j < 3; j++)
+			quadrics[destination[t + j]].addPlane(n[0], n[1], n[2], d);
+	}
+
+	// A directed edge without its twin lies on a border, split vertices make attribute seams borders too
+	std::vector<bool> isLocked(vertexCount, false);
+	{
+		std::unordered_set<uint64_t> edges;
+		edges.reserve(destination.size());
+		for (size_t t = 0; t < destination.size(); t += 3)
+			for (size_t j = 0; j < 3; j++)
+				edges.insert(edgeKey(destination[t + j], destination[t + (j + 1) % 3]));
+
+		for (size_t t = 0; t < destination.size(); t += 3)
+		{
+			for (size_t j = 0; j < 3; j++)
+			{
+				uint32_t a = destination[t + j], b = destination[t + (j + 1) % 3];
+				if (edges.find(edgeKey(b, a)) == edges.end())
+					isLocked[a] = isLocked[b] = true;
+			}
+		}
+	}
+
+	struct Collapse {
+		uint32_t source;
+		uint32_t target;
+		double error;
+	};
+
+	double maxError = 0.0;
+	std::vector<uint32_t> remap(vertexCount);
+	std::vector<bool> isTouched(vertexCount);
+	std::vector<uint32_t> adjacencyOffsets(vertexCount + 1);
+	std::vector<uint32_t> adjacency;
+
+	// Every pass collapses the cheapest independent edges, so no vertex moves twice per pass
+	while (destination.size() > targetIndexCount)
+	{
+		size_t triangleCount = destination.size() / 3;
+
+		// Triangles around each vertex, for the flip test
+		std::fill(adjacencyOffsets.begin(), adjacencyOffsets.end(), 0);
+		for (uint32_t v : destination)
+			adjacencyOffsets[v + 1]++;
+		for (uint32_t v = 0; v < vertexCount; v++)
+			adjacencyOffsets[v + 1] += adjacencyOffsets[v];
+		adjacency.resize(destination.size());
+		{
+			std::vector<uint32_t> fill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+			for (size_t t = 0; t < triangleCount; t++)
+				for (size_t j = 0; j < 3; j++)
+					adjacency[fill[destination[t * 3 + j]]++] = static_cast<uint32_t>(t);
+		}
+
+		std::vector<Collapse> collapses;
+		collapses.reserve(destination.size());
+		for (size_t t = 0; t < triangleCount; t++)
+		{
+			for (size_t j = 0; j < 3; j++)
+			{
+				uint32_t a = destination[t * 3 + j], b = destination[t * 3 + (j + 1) % 3];
+				// Each interior edge is seen from both triangles, keep one
+				if (a > b && !isLocked[a] && !isLocked[b])
+					continue;
+
+				// Half edge collapse, the surviving vertex keeps its position so the vertex buffer is shared
+				Quadric q = quadrics[a];
+				q.add(quadrics[b]);
+				double errorAB = isLocked[a] ? -1.0 : q.evaluate(getPosition(b));
+				double errorBA = isLocked[b] ? -1.0 : q.evaluate(getPosition(a));
+
+				if (errorAB < 0.0 && errorBA < 0.0)
+					continue;
+				if (errorBA < 0.0 || (errorAB >= 0.0 && errorAB <= errorBA))
+					collapses.push_back({ a, b, errorAB });
+				else
+					collapses.push_back({ b, a, errorBA });
+			}
+		}
+
+		if (collapses.empty())
+			break;
+
+		std::sort(collapses.begin(), collapses.end(), [](const Collapse& l, const Collapse& r) { return l.error < r.error; });
+
+		for (uint32_t v = 0; v < vertexCount; v++)
+			remap[v] = v;
+		std::fill(isTouched.begin(), isTouched.end(), false);
+
+		// Every collapse removes about two triangles
+		size_t collapseBudget = (destination.size() - targetIndexCount) / 6 + 1;
+		// Keep the cheapest part of the pass so later passes can pick from refreshed quadrics
+		size_t passLimit = std::max<size_t>(collapses.size() / 4, 1);
+		size_t collapseCount = 0;
+
+		for (size_t i = 0; i < collapses.size() && collapseCount < collapseBudget && i < passLimit; i++)
+		{
+			const Collapse& collapse = collapses[i];
+			if (isTouched[collapse.source] || isTouched[collapse.target])
+				continue;
+
+			// Reject collapses that flip a surrounding triangle
+			const float* pTarget = getPosition(collapse.target);
+			bool isFlipping = false;
+			for (uint32_t a = adjacencyOffsets[collapse.source]; a < adjacencyOffsets[collapse.source + 1] && !isFlipping; a++)
+			{
+				const uint32_t* tri = destination.data() + adjacency[a] * 3;
+				if (tri[0] == collapse.target || tri[1] == collapse.target || tri[2] == collapse.target)
+					continue;
+
+				const float* p[3] = { getPosition(tri[0]), getPosition(tri[1]), getPosition(tri[2]) };
+				double before[3];
+				computeNormal(p[0], p[1], p[2], before);
+				for (size_t j = 0; j < 3; j++)
+					if (tri[j] == collapse.source)
+						p[j] = pTarget;
+				double after[3];
+				computeNormal(p[0], p[1], p[2], after);
+
+				isFlipping = before[0] * after[0] + before[1] * after[1] + before[2] * after[2] <= 0.0;
+			}
+			if (isFlipping)
+				continue;
+
+			// Neighbours of both ends are frozen for the rest of the pass
+			for (uint32_t v : { collapse.source, collapse.target })
+				for (uint32_t a = adjacencyOffsets[v]; a < adjacencyOffsets[v + 1]; a++)
+					for (size_t j = 0; j < 3; j++)
+						isTouched[destination[adjacency[a] * 3 + j]] = true;
+
+			remap[collapse.source] = collapse.target;
+			quadrics[collapse.target].add(quadrics[collapse.source]);
+			maxError = std::max(maxError, collapse.error);
+			collapseCount++;
+		}
+
+		if (collapseCount == 0)
+			break;
+
+		// Apply the pass and drop the triangles that became degenerate
+		size_t writeIndex = 0;
+		for (size_t t = 0; t < triangleCount; t++)
+		{
+			uint32_t a = remap[destination[t * 3 + 0]];
+			uint32_t b = remap[destination[t * 3 + 1]];
+			uint32_t c = remap[destination[t * 3 + 2]];
+			if (a == b || b == c || a == c)
+				continue;
+
+			destination[writeIndex++] = a;
+			destination[writeIndex++] = b;
+			destination[writeIndex++] = c;
+		}
+		destination.resize(writeIndex);
+	}
+
+	return static_cast<float>(std::sqrt(maxError));
+}
+
+VertexCacheStatistics MeshOptimizer::analyzeVertexCache(const uint32_t * pIndices, size_t indexCount, uint32_t vertexCount, uint32_t cacheSize)
+{
+	VertexCacheStatistics statistics;
+	statistics.triangleCount = static_cast<uint32_t>(indexCount / 3);
+
+	// A vertex is in the FIFO while fewer than cacheSize misses happened since it was loaded
+	std::vector<uint32_t> timestamps(vertexCount, 0);
+	std::vector<bool> isReferenced(vertexCount, false);
+	uint32_t time = cacheSize + 1;
+
+	for (size_t i = 0; i < indexCount; i++)
+	{
+		uint32_t v = pIndices[i];
+		if (time - timestamps[v] > cacheSize)
+		{
+			timestamps[v] = time++;
+			statistics.vertexTransforms++;
+		}
+
+		if (!isReferenced[v])
+		{
+			isReferenced[v] = true;
+			statistics.vertexCount++;
+		}
+	}
+
+	return statistics;
+}
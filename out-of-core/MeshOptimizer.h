@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// Size of the FIFO post-transform cache the statistics are simulated with
+#define MESH_OPTIMIZER_FIFO_CACHE_SIZE 16
+
+// Meshlet limits, sized after the common mesh shader limits
+#define MESHLET_MAX_VERTICES 64
+#define MESHLET_MAX_TRIANGLES 124
+
+// Result of a post-transform cache simulation
+// ACMR is transformed vertices per triangle (0.5 is the ideal for a regular grid, 3 the worst),
+// ATVR is transformed vertices per referenced vertex (1 is the ideal)
+struct VertexCacheStatistics {
+	uint32_t vertexTransforms = 0;
+	uint32_t triangleCount = 0;
+	uint32_t vertexCount = 0;
+
+	float getAcmr() const { return triangleCount ? static_cast<float>(vertexTransforms) / triangleCount : 0.0f; }
+	float getAtvr() const { return vertexCount ? static_cast<float>(vertexTransforms) / vertexCount : 0.0f; }
+
+	void accumulate(const VertexCacheStatistics& other) {
+		vertexTransforms += other.vertexTransforms;
+		triangleCount += other.triangleCount;
+		vertexCount += other.vertexCount;
+	}
+};
+
+// Contiguous run of triangles in a mesh's index list, the unit of culling and residency
+struct Meshlet {
+	// First index within the mesh's index list
+	uint32_t indexOffset;
+	uint32_t triangleCount;
+	uint32_t vertexCount;
+	uint32_t reserved;
+
+	// Bounding sphere
+	float center[3];
+	float radius;
+
+	// Normal cone, every triangle faces away from a viewer at p when
+	// dot(center - p, coneAxis) >= coneCutoff * length(center - p) + radius
+	// A cutoff of 1 never passes the test
+	float coneAxis[3];
+	float coneCutoff;
+};
+
+// Import time reordering of indexed triangle lists
+// Every function works on the mesh local indices of one mesh and is safe to run on different meshes in parallel
+class MeshOptimizer
+{
+public:
+	// Reorder triangles for post-transform cache locality, Forsyth's linear-speed vertex cache optimization
+	static void optimizeVertexCache(uint32_t* pIndices, size_t indexCount, uint32_t vertexCount);
+
+	// Sort the clusters of a cache optimized list so that outward facing ones are drawn first,
+	// clusters are split where the cache simulation restarts so the ACMR barely changes
+	static void optimizeOverdraw(uint32_t* pIndices, size_t indexCount, const float* pPositions, size_t positionStride, uint32_t vertexCount);
+
+	// Renumber vertices in order of first use, fills remap with the new index of every old vertex
+	// Unreferenced vertices are moved to the end
+	static void optimizeVertexFetch(uint32_t* pIndices, size_t indexCount, uint32_t vertexCount, std::vector<uint32_t>& remap);
+
+	// Split the index list into meshlets in its current order, so a cache optimized list gives compact meshlets
+	// The triangles are not moved, every meshlet is a range of the list
+	static void buildMeshlets(const uint32_t* pIndices, size_t indexCount, const float* pPositions, size_t positionStride, uint32_t vertexCount, std::vector<Meshlet>& meshlets);
+
+	// Quadric error edge collapse towards targetIndexCount, the result keeps indexing the same vertices
+	// Vertices on open borders and attribute seams are locked so the LOD does not crack
+	// Returns the largest geometric error introduced, in position units
+	static float simplify(const uint32_t* pIndices, size_t indexCount, const float* pPositions, size_t positionStride, uint32_t vertexCount, size_t targetIndexCount, std::vector<uint32_t>& destination);
+
+	static VertexCacheStatistics analyzeVertexCache(const uint32_t* pIndices, size_t indexCount, uint32_t vertexCount, uint32_t cacheSize = MESH_OPTIMIZER_FIFO_CACHE_SIZE);
+};
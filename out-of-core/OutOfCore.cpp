@@ -1,8 +1,24 @@
 #include "VkBase.h"
 #include "Scene.h"
+#include "CommandRecorder.h"
+#include "PipelineManager.h"
+#include "Trace.h"
+
+#include <chrono>
+#include <iomanip>
 
 #define MEMORY_BOUND_CHANGE_SIZE_MB 10
 
+// Scene draws are recorded into secondary command buffers in this many slices, 0 uses one per job system thread
+#define RECORDING_THREAD_COUNT 0
+// Rebuild the command buffers once per thread count 1, 2, 4, ... up to the recording threads after loading and print each time
+#define RECORDING_BENCHMARK 0
+
+// Copies of the model along each side of the instance grid
+#define INSTANCE_GRID_SIZE 1
+// Distance between neighbouring instances in world units
+#define INSTANCE_GRID_SPACING 8.0f
+
 const VkDeviceSize memoryBoundChangeSize = MEMORY_BOUND_CHANGE_SIZE_MB * 1000000;
 
 const char* vertShaderFile = "shaders/scene.vert.spv";
@@ -14,6 +30,8 @@ class VkApp : public VkBase
 public:
 	virtual ~VkApp()
 	{
+		delete(recorder);
+		delete(pipelineManager);
 		delete(scene);
 		vkDestroyRenderPass(device, renderPass, nullptr);
 	}
@@ -30,6 +48,16 @@ private:
 
 	Scene *scene;
 
+	CommandRecorder *recorder = nullptr;
+
+	PipelineManager *pipelineManager = nullptr;
+
+	// Streamed geometry at the last HUD update
+	VkDeviceSize overlayStreamedBytes = 0;
+
+	// Scene pipeline variant of each combination of material features
+	std::array<PipelineHandle, MATERIAL_FEATURE_COUNT> pipelineHandles;
+
 	struct {
 		glm::mat4 projectionMatrix;
 		glm::mat4 modelMatrix;
@@ -71,12 +99,28 @@ private:
 		else if (key == GLFW_KEY_RIGHT && action == GLFW_PRESS) {
 			app->extendMemoryBound();
 		}
+		else if (key == GLFW_KEY_O && action == GLFW_PRESS) {
+			app->toggleOverlayMode();
+		}
+		else if (key == GLFW_KEY_C && action == GLFW_PRESS) {
+			app->toggleCompressedHostTier();
+		}
+		else if (key == GLFW_KEY_T && action == GLFW_PRESS) {
+			if (!Trace::dump(TRACE_FILE))
+				std::cout << "Could not write trace file " << TRACE_FILE << std::endl;
+		}
 	}
 
 	void getHeapInfo() {
 		resMan->inspectHeap();
 	}
 
+	// Decides how the next bound reduction demotes textures
+	void toggleCompressedHostTier() {
+		resMan->setCompressedHostTier(!resMan->isCompressedHostTier());
+		resMan->printPackStats();
+	}
+
 	void reduceMemoryBound() {
 		resMan->reduceMemoryBound(memoryBoundChangeSize);
 		if(scene->rebindTexture())
@@ -115,20 +159,28 @@ private:
 		descriptorWrites[1].descriptorCount = 1;
 		descriptorWrites[1].pImageInfo = &sampleTexture.descInfo; //&imageInfo;
 		// descSet need to be in prompt state ( finish used by previous frame ) in order to update.
+		vkQueueWaitIdle(stdQueues.graphic);
 		vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, nullptr);
 
-		for (short i = 0; i < static_cast<short>(drawCmdBuffers.size()); i++)
-			vkResetCommandBuffer(drawCmdBuffers[i], VK_COMMAND_BUFFER_RESET_RELEASE_RESOURCES_BIT);
-
-		buildCommandBuffers();
+		rebuildCommandBuffer();
 
 		std::cout << "Migration Completed! New Image is " << sampleTexture.image << std::endl;
 	}
 
 	void loadAsset()
 	{
-		scene = new Scene(device, stdQueues.graphic, resMan);
-		scene->import("models/nanosuit/nanosuit.obj");
+		scene = new Scene(device, stdQueues.graphic, resMan, jobs, static_cast<uint32_t>(drawCmdBuffers.size()), enabledFeatures);
+		scene->import("models/nanosuit/nanosuit.obj", VERTEX_LAYOUT_COMPACT);
+
+		// Copies of the model on a square grid around the origin
+		for (int x = 0; x < INSTANCE_GRID_SIZE; x++)
+		{
+			for (int z = 0; z < INSTANCE_GRID_SIZE; z++)
+			{
+				glm::vec3 position = glm::vec3(x - (INSTANCE_GRID_SIZE - 1) * 0.5f, 0.0f, z - (INSTANCE_GRID_SIZE - 1) * 0.5f) * INSTANCE_GRID_SPACING;
+				scene->addInstance(glm::scale(glm::translate(glm::mat4(1.0f), position), glm::vec3(0.3f, 0.3f, 0.3f)));
+			}
+		}
 
 		updateUniformBuffers();
 	}
@@ -143,15 +195,9 @@ private:
 		) * glm::perspective(glm::radians(60.0f), (float)screenWidth / (float)screenHeight, 0.1f, 256.0f);
 
 		scene->uniformData.view = glm::lookAt(glm::vec3(10.0f, 10.0f, 10.0f), glm::vec3(0.0f, 8.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-		scene->uniformData.model = glm::mat4(1.0f);
-
-		scene->uniformData.model = glm::scale(scene->uniformData.model, glm::vec3(0.3f, 0.3f, 0.3f));
+		// The data reaches the uniform ring when each frame is drawn
 
-		void *pData;
-
-		resMan->mapMemory(scene->uniformBuffer.allocation, &pData);
-		memcpy(pData, &scene->uniformData, sizeof(scene->uniformData));
-		resMan->unmapMemory(scene->uniformBuffer.allocation);
+		scene->update(static_cast<float>(screenHeight), true);
 	}
 
 	void setupDescriptorSetLayout()
@@ -194,153 +240,55 @@ private:
 
 	void preparePipelines()
 	{
-		// Create the graphics pipeline used in this example
-		// Vulkan uses the concept of rendering pipelines to encapsulate fixed states, replacing OpenGL's complex state machine
-		// A pipeline is then stored and hashed on the GPU making pipeline changes very fast
-		// Note: There are still a few dynamic states that are not directly part of the pipeline (but the info that they are used is)
-
-		VkGraphicsPipelineCreateInfo pipelineCreateInfo = {};
-		pipelineCreateInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-		// The layout used for this pipeline (can be shared among multiple pipelines using the same layout)
-		pipelineCreateInfo.layout = scene->pipelineLayout;
-		// Renderpass this pipeline is attached to
-		pipelineCreateInfo.renderPass = renderPass;
-
-		// Construct the differnent states making up the pipeline
-
-		// Input assembly state describes how primitives are assembled
-		// This pipeline will assemble vertex data as a triangle lists (though we only use one triangle)
-		VkPipelineInputAssemblyStateCreateInfo inputAssemblyState = {};
-		inputAssemblyState.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-		inputAssemblyState.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-
-		// Rasterization state
-		VkPipelineRasterizationStateCreateInfo rasterizationState = {};
-		rasterizationState.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-		rasterizationState.polygonMode = VK_POLYGON_MODE_FILL;
-		rasterizationState.cullMode = VK_CULL_MODE_BACK_BIT;
-		rasterizationState.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
-		rasterizationState.depthClampEnable = VK_FALSE;
-		rasterizationState.rasterizerDiscardEnable = VK_FALSE;
-		rasterizationState.depthBiasEnable = VK_FALSE;
-		rasterizationState.lineWidth = 1.0f;
-
-		// Color blend state describes how blend factors are calculated (if used)
-		// We need one blend attachment state per color attachment (even if blending is not used
-		VkPipelineColorBlendAttachmentState blendAttachmentState[1] = {};
-		blendAttachmentState[0].colorWriteMask = 0xf;
-		blendAttachmentState[0].blendEnable = VK_FALSE;
-		VkPipelineColorBlendStateCreateInfo colorBlendState = {};
-		colorBlendState.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-		colorBlendState.attachmentCount = 1;
-		colorBlendState.pAttachments = blendAttachmentState;
-
-		// Viewport state sets the number of viewports and scissor used in this pipeline
-		// Note: This is actually overriden by the dynamic states (see below)
-		VkPipelineViewportStateCreateInfo viewportState = {};
-		viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-		viewportState.viewportCount = 1;
-		viewportState.scissorCount = 1;
-
-		// Enable dynamic states
-		// Most states are baked into the pipeline, but there are still a few dynamic states that can be changed within a command buffer
-		// To be able to change these we need do specify which dynamic states will be changed using this pipeline. Their actual states are set later on in the command buffer.
-		// For this example we will set the viewport and scissor using dynamic states
-		std::vector<VkDynamicState> dynamicStateEnables;
-		dynamicStateEnables.push_back(VK_DYNAMIC_STATE_VIEWPORT);
-		dynamicStateEnables.push_back(VK_DYNAMIC_STATE_SCISSOR);
-		VkPipelineDynamicStateCreateInfo dynamicState = {};
-		dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
-		dynamicState.pDynamicStates = dynamicStateEnables.data();
-		dynamicState.dynamicStateCount = static_cast<uint32_t>(dynamicStateEnables.size());
-
-		// Depth and stencil state containing depth and stencil compare and test operations
-		// We only use depth tests and want depth tests and writes to be enabled and compare with less or equal
-		VkPipelineDepthStencilStateCreateInfo depthStencilState = {};
-		depthStencilState.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
-		depthStencilState.depthTestEnable = VK_TRUE;
-		depthStencilState.depthWriteEnable = VK_TRUE;
-		depthStencilState.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
-		depthStencilState.depthBoundsTestEnable = VK_FALSE;
-		depthStencilState.back.failOp = VK_STENCIL_OP_KEEP;
-		depthStencilState.back.passOp = VK_STENCIL_OP_KEEP;
-		depthStencilState.back.compareOp = VK_COMPARE_OP_ALWAYS;
-		depthStencilState.stencilTestEnable = VK_FALSE;
-		depthStencilState.front = depthStencilState.back;
-
-		// Multi sampling state
-		// This example does not make use fo multi sampling (for anti-aliasing), the state must still be set and passed to the pipeline
-		VkPipelineMultisampleStateCreateInfo multisampleState = {};
-		multisampleState.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-		multisampleState.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
-		multisampleState.pSampleMask = nullptr;
-
-		// Vertex input descriptions 
-		// Specifies the vertex input parameters for a pipeline
-		auto bindingDesc = Vertex::getBindingDescriptions();
-		auto attribDesc = Vertex::getAttributeDescriptions();
-
-		// Vertex input state used for pipeline creation
-		VkPipelineVertexInputStateCreateInfo vertexInputState = {};
-		vertexInputState.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-		vertexInputState.vertexBindingDescriptionCount = static_cast<uint32_t>(bindingDesc.size());
-		vertexInputState.pVertexBindingDescriptions = bindingDesc.data();
-		vertexInputState.vertexAttributeDescriptionCount = static_cast<uint32_t>(attribDesc.size());
-		vertexInputState.pVertexAttributeDescriptions = attribDesc.data();
-
-		// Shaders
-		std::array<VkPipelineShaderStageCreateInfo, 2> shaderStages{};
-
-		// Vertex shader
-		shaderStages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-		// Set pipeline stage for this shader
-		shaderStages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
-		// Load binary SPIR-V shader
-		shaderStages[0].module = loadSPIRVShader(vertShaderFile);
-		// Main entry point for the shader
-		shaderStages[0].pName = "main";
-		assert(shaderStages[0].module != VK_NULL_HANDLE);
-
-		// Fragment shader
-		shaderStages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-		// Set pipeline stage for this shader
-		shaderStages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-		// Load binary SPIR-V shader
-		shaderStages[1].module = loadSPIRVShader(fragShaderFile);
-		// Main entry point for the shader
-		shaderStages[1].pName = "main";
-		assert(shaderStages[1].module != VK_NULL_HANDLE);
-
-		// Set pipeline shader stage info
-		pipelineCreateInfo.stageCount = static_cast<uint32_t>(shaderStages.size());
-		pipelineCreateInfo.pStages = shaderStages.data();
-
-		// Assign the pipeline states to the pipeline creation info structure
-		pipelineCreateInfo.pVertexInputState = &vertexInputState;
-		pipelineCreateInfo.pInputAssemblyState = &inputAssemblyState;
-		pipelineCreateInfo.pRasterizationState = &rasterizationState;
-		pipelineCreateInfo.pColorBlendState = &colorBlendState;
-		pipelineCreateInfo.pMultisampleState = &multisampleState;
-		pipelineCreateInfo.pViewportState = &viewportState;
-		pipelineCreateInfo.pDepthStencilState = &depthStencilState;
-		pipelineCreateInfo.renderPass = renderPass;
-		pipelineCreateInfo.pDynamicState = &dynamicState;
-
-		// Create rendering pipeline using the specified states
-		VK_CHECK_RESULT(vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineCreateInfo, nullptr, &scene->pipelines.solid));
-
-		// Alpha blended pipeline
-		rasterizationState.cullMode = VK_CULL_MODE_NONE;
-		blendAttachmentState[0].blendEnable = VK_TRUE;
-		blendAttachmentState[0].colorBlendOp = VK_BLEND_OP_ADD;
-		blendAttachmentState[0].srcColorBlendFactor = VK_BLEND_FACTOR_SRC_COLOR;
-		blendAttachmentState[0].dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_COLOR;
-
-		VK_CHECK_RESULT(vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineCreateInfo, nullptr, &scene->pipelines.blending));
-
-		// Shader modules are no longer needed once the graphics pipeline has been created
-		vkDestroyShaderModule(device, shaderStages[0].module, nullptr);
-		vkDestroyShaderModule(device, shaderStages[1].module, nullptr);
+		// Scene pipelines differ only in a few states, the pipeline manager creates them on job threads
+		// and the variant with all features stands in for the others until they are ready
+		PipelineDesc desc;
+		desc.vertShaderFile = vertShaderFile;
+		desc.fragShaderFile = fragShaderFile;
+		desc.layout = scene->pipelineLayout;
+		desc.renderPass = renderPass;
+
+		// Vertex input follows the layout the scene was imported with
+		scene->getVertexInputDescriptions(desc.vertexBindings, desc.vertexAttributes);
+
+		// The vertex shader decodes compact vertices when specialized for them
+		desc.vertConstants.push_back(scene->getVertexLayout() == VERTEX_LAYOUT_COMPACT);
+
+		// The fragment shader skips what a material does not use
+		auto requestVariant = [&](uint32_t features, PipelineHandle fallback) {
+			desc.fragConstants = {
+				(features & MATERIAL_FEATURE_DIFFUSE_MAP) != 0,
+				(features & MATERIAL_FEATURE_SPECULAR) != 0,
+				(features & MATERIAL_FEATURE_ALPHA_BLEND) != 0
+			};
+
+			bool isBlending = (features & MATERIAL_FEATURE_ALPHA_BLEND) != 0;
+			desc.cullMode = isBlending ? VK_CULL_MODE_NONE : VK_CULL_MODE_BACK_BIT;
+			desc.blendEnable = isBlending ? VK_TRUE : VK_FALSE;
+			desc.srcColorBlendFactor = isBlending ? VK_BLEND_FACTOR_SRC_COLOR : VK_BLEND_FACTOR_ONE;
+			desc.dstColorBlendFactor = isBlending ? VK_BLEND_FACTOR_ONE_MINUS_SRC_COLOR : VK_BLEND_FACTOR_ZERO;
+
+			return pipelineManager->request(desc, fallback);
+		};
+
+		// Every material draws correctly with all features, the placeholder texture is white
+		// and a material without specular has a black specular color
+		const uint32_t allFeatures = MATERIAL_FEATURE_DIFFUSE_MAP | MATERIAL_FEATURE_SPECULAR;
+		PipelineHandle solidFallback = requestVariant(allFeatures, PIPELINE_HANDLE_NONE);
+
+		pipelineHandles.fill(PIPELINE_HANDLE_NONE);
+		for (uint32_t features : scene->getMaterialFeatureSets())
+		{
+			PipelineHandle fallback = solidFallback;
+			if (features & MATERIAL_FEATURE_ALPHA_BLEND)
+				fallback = requestVariant(allFeatures | MATERIAL_FEATURE_ALPHA_BLEND, solidFallback);
+
+			pipelineHandles[features] = requestVariant(features, fallback);
+		}
+
+		// Nothing can be drawn before the fallback exists
+		pipelineManager->wait(solidFallback);
+		pipelineManager->poll();
 	}
 
 	void setupDescriptorPool()
@@ -411,8 +359,42 @@ private:
 		vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, nullptr);
 	}
 
-	void buildCommandBuffers()
+	void buildCommandBuffers(uint32_t threadCount = 0)
 	{
+		TRACE_ZONE("OutOfCore::buildCommandBuffers", "frame");
+
+		// Pending frames still execute the secondaries about to be reset
+		{
+			TRACE_ZONE("vkQueueWaitIdle", "wait");
+			vkQueueWaitIdle(stdQueues.graphic);
+		}
+
+		// Variants still being created are drawn with their fallback
+		for (uint32_t features = 0; features < MATERIAL_FEATURE_COUNT; features++)
+		{
+			if (pipelineHandles[features] != PIPELINE_HANDLE_NONE)
+				scene->pipelines[features] = pipelineManager->get(pipelineHandles[features]);
+		}
+
+		// Dynamic state is not inherited, every secondary sets its own
+		recorder->record(renderPass, swapChain.framebuffers, scene->getMeshCount(), [this](VkCommandBuffer cmdBuffer, uint32_t frame, uint32_t first, uint32_t count) {
+			VkViewport viewport = {};
+			viewport.height = (float)screenHeight;
+			viewport.width = (float)screenWidth;
+			viewport.minDepth = (float) 0.0f;
+			viewport.maxDepth = (float) 1.0f;
+			vkCmdSetViewport(cmdBuffer, 0, 1, &viewport);
+
+			VkRect2D scissor = {};
+			scissor.extent.width = screenWidth;
+			scissor.extent.height = screenHeight;
+			scissor.offset.x = 0;
+			scissor.offset.y = 0;
+			vkCmdSetScissor(cmdBuffer, 0, 1, &scissor);
+
+			scene->render(cmdBuffer, frame, first, count);
+		}, threadCount);
+
 		VkCommandBufferBeginInfo cmdBufInfo = {};
 		cmdBufInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
 		cmdBufInfo.pNext = nullptr;
@@ -443,25 +425,19 @@ private:
 
 			// Start the first sub pass specified in our default render pass setup by the base class
 			// This will clear the color and depth attachment
-			vkCmdBeginRenderPass(drawCmdBuffers[i], &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+			// The subpass contents come from the secondaries of the recorder threads
+			vkCmdBeginRenderPass(drawCmdBuffers[i], &renderPassBeginInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
 
-			// Update dynamic viewport state
-			VkViewport viewport = {};
-			viewport.height = (float)screenHeight;
-			viewport.width = (float)screenWidth;
-			viewport.minDepth = (float) 0.0f;
-			viewport.maxDepth = (float) 1.0f;
-			vkCmdSetViewport(drawCmdBuffers[i], 0, 1, &viewport);
+			const std::vector<VkCommandBuffer>& secondaries = recorder->getCommandBuffers(i);
+			vkCmdExecuteCommands(drawCmdBuffers[i], static_cast<uint32_t>(secondaries.size()), secondaries.data());
 
-			// Update dynamic scissor state
-			VkRect2D scissor = {};
-			scissor.extent.width = screenWidth;
-			scissor.extent.height = screenHeight;
-			scissor.offset.x = 0;
-			scissor.offset.y = 0;
-			vkCmdSetScissor(drawCmdBuffers[i], 0, 1, &scissor);
+			// The text goes on top of the scene in the same pass
+			if (textUI->isInline)
+			{
+				VkCommandBuffer overlayCmdBuffer = textUI->getInlineCommandBuffer(i);
+				vkCmdExecuteCommands(drawCmdBuffers[i], 1, &overlayCmdBuffer);
+			}
 
-			scene->render(drawCmdBuffers[i]);
 			vkCmdEndRenderPass(drawCmdBuffers[i]);
 
 			// Ending the render pass will add an implicit barrier transitioning the frame buffer color attachment to 
@@ -471,8 +447,39 @@ private:
 		}
 	}
 
+	virtual float getOverlayText(TextOverlay *textOverlay, float y, uint32_t frameCount)
+	{
+		// The first HUD update comes before the scene is loaded
+		if (!prepared)
+			return y;
+
+		std::stringstream ss;
+		ss << std::fixed << std::setprecision(3) << "Geometry : " << (scene->getStreamedBytes() - overlayStreamedBytes) / 1000.0 / frameCount << " KBs/frame, "
+			<< scene->getPendingPageCount() << " pending, " << scene->getEvictedPageCount() << " evicted pages";
+		textOverlay->addText(ss.str(), 5.0f, y, TextOverlay::alignLeft);
+		overlayStreamedBytes = scene->getStreamedBytes();
+		y += 20.0f;
+
+		ss.str("");
+		ss << "Clusters : " << scene->getVisibleClusterCount() << " of " << scene->getClusterCount() << " visible";
+		textOverlay->addText(ss.str(), 5.0f, y, TextOverlay::alignLeft);
+
+		return y + 20.0f;
+	}
+
+	// Switches the text overlay between the scene pass and its own submit, the frame times of both are printed
+	void toggleOverlayMode() {
+		printOverlayFrameTime();
+
+		textUI->isInline = !textUI->isInline;
+		rebuildCommandBuffer();
+	}
+
 	void rebuildCommandBuffer()
 	{
+		// No frame may still be pending on the primaries, the overlay no longer waits for the queue every frame
+		vkQueueWaitIdle(stdQueues.graphic);
+
 		for (short i = 0; i < static_cast<short>(drawCmdBuffers.size()); i++)
 			vkResetCommandBuffer(drawCmdBuffers[i], VK_COMMAND_BUFFER_RESET_RELEASE_RESOURCES_BIT);
 
@@ -482,8 +489,42 @@ private:
 	virtual void prepare()
 	{
 		VkBase::prepare();
+
+		if (JOB_SYSTEM_BENCHMARK)
+			JobSystem::benchmark();
+
 		loadAsset();
+
+		pipelineManager = new PipelineManager(device, pipelineCache, shaderCache, jobs);
+
+		// Startup time is dominated by the asset, so the pipelines are timed on their own as well
+		// Only the fallback is waited for, the other variants finish on the job threads
+		auto tStart = std::chrono::high_resolution_clock::now();
 		preparePipelines();
+		auto tEnd = std::chrono::high_resolution_clock::now();
+
+		std::cout << "Fallback pipeline with " << (isPipelineCacheWarm ? "warm" : "cold") << " cache took "
+			<< std::chrono::duration<double, std::milli>(tEnd - tStart).count() << " ms" << std::endl;
+
+		uint32_t threadCount = RECORDING_THREAD_COUNT > 0 ? RECORDING_THREAD_COUNT : jobs->getThreadCount();
+		recorder = new CommandRecorder(device, queueFamilyIndices.graphic, jobs, threadCount, static_cast<uint32_t>(drawCmdBuffers.size()));
+
+		if (RECORDING_BENCHMARK)
+		{
+			// The last pass is clamped to the full thread count
+			for (uint32_t t = 1; t < threadCount * 2; t *= 2)
+			{
+				uint32_t passThreadCount = std::min(t, threadCount);
+
+				tStart = std::chrono::high_resolution_clock::now();
+				buildCommandBuffers(passThreadCount);
+				tEnd = std::chrono::high_resolution_clock::now();
+
+				std::cout << "Recorded " << drawCmdBuffers.size() << " command buffers on " << passThreadCount << " threads in "
+					<< std::chrono::duration<double, std::milli>(tEnd - tStart).count() << " ms" << std::endl;
+			}
+		}
+
 		buildCommandBuffers();
 		prepared = true;
 	}
@@ -492,6 +533,10 @@ private:
 	{
 		prepareFrame();
 
+		// Record again once pipeline variants replace their fallbacks, after the frame's wait in prepareFrame
+		if (pipelineManager->poll())
+			rebuildCommandBuffer();
+
 		// Pipeline stage at which the queue submission will wait (via pWaitSemaphores)
 		VkPipelineStageFlags waitStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
 
@@ -506,8 +551,17 @@ private:
 		submitInfo.pCommandBuffers = &drawCmdBuffers[currentBuffer];					// Command buffers(s) to execute in this batch (submission)
 		submitInfo.commandBufferCount = 1;	// One command buffer
 
+		// LOD selection rewrites the indirect draws, before the frame is submitted
+		scene->update(static_cast<float>(screenHeight), false);
+		// Only this frame's slices are written, the slices of frames in flight stay untouched
+		scene->writeUniforms(currentBuffer);
+		scene->writeDraws(currentBuffer);
+
 		// Submit to the graphics queue passing no wait fence
-		VK_CHECK_RESULT(vkQueueSubmit(stdQueues.graphic, 1, &submitInfo, VK_NULL_HANDLE));
+		{
+			TRACE_ZONE("vkQueueSubmit", "frame");
+			VK_CHECK_RESULT(vkQueueSubmit(stdQueues.graphic, 1, &submitInfo, VK_NULL_HANDLE));
+		}
 
 		submitFrame();
 	}
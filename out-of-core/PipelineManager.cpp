@@ -0,0 +1,282 @@
+#include "PipelineManager.h"
+#include "Trace.h"
+#include "DataUtils.h"
+
+#include <chrono>
+
+template<typename T>
+static void hashVector(uint64_t& hash, const std::vector<T>& values)
+{
+	uint64_t count = values.size();
+	DataUtils::hashBytes(hash, &count, sizeof(count));
+	if (!values.empty())
+		DataUtils::hashBytes(hash, values.data(), values.size() * sizeof(T));
+}
+
+template<typename T>
+static bool isSameVector(const std::vector<T>& a, const std::vector<T>& b)
+{
+	return a.size() == b.size() && (a.empty() || memcmp(a.data(), b.data(), a.size() * sizeof(T)) == 0);
+}
+
+uint64_t PipelineDesc::hash() const
+{
+	// Fed field by field
+	uint64_t hash = DATA_HASH_SEED;
+
+	// The terminating zero separates the two file names
+	DataUtils::hashBytes(hash, vertShaderFile.c_str(), vertShaderFile.size() + 1);
+	DataUtils::hashBytes(hash, fragShaderFile.c_str(), fragShaderFile.size() + 1);
+	hashVector(hash, vertConstants);
+	hashVector(hash, fragConstants);
+	hashVector(hash, vertexBindings);
+	hashVector(hash, vertexAttributes);
+
+	DataUtils::hashBytes(hash, &cullMode, sizeof(cullMode));
+	DataUtils::hashBytes(hash, &blendEnable, sizeof(blendEnable));
+	DataUtils::hashBytes(hash, &srcColorBlendFactor, sizeof(srcColorBlendFactor));
+	DataUtils::hashBytes(hash, &dstColorBlendFactor, sizeof(dstColorBlendFactor));
+	DataUtils::hashBytes(hash, &depthWriteEnable, sizeof(depthWriteEnable));
+	DataUtils::hashBytes(hash, &layout, sizeof(layout));
+	DataUtils::hashBytes(hash, &renderPass, sizeof(renderPass));
+
+	return hash;
+}
+
+bool PipelineDesc::operator==(const PipelineDesc & other) const
+{
+	return vertShaderFile == other.vertShaderFile &&
+		fragShaderFile == other.fragShaderFile &&
+		vertConstants == other.vertConstants &&
+		fragConstants == other.fragConstants &&
+		isSameVector(vertexBindings, other.vertexBindings) &&
+		isSameVector(vertexAttributes, other.vertexAttributes) &&
+		cullMode == other.cullMode &&
+		blendEnable == other.blendEnable &&
+		srcColorBlendFactor == other.srcColorBlendFactor &&
+		dstColorBlendFactor == other.dstColorBlendFactor &&
+		depthWriteEnable == other.depthWriteEnable &&
+		layout == other.layout &&
+		renderPass == other.renderPass;
+}
+
+
+PipelineManager::PipelineManager(VkDevice device, VkPipelineCache pipelineCache, ShaderCache *shaderCache, JobSystem *jobs) : device(device), pipelineCache(pipelineCache), shaderCache(shaderCache), jobs(jobs)
+{
+}
+
+
+PipelineManager::~PipelineManager()
+{
+	// A failed variant has nothing to destroy, its error no longer matters
+	for (auto& slot : slots)
+	{
+		try {
+			jobs->wait(&slot.counter);
+		}
+		catch (...) {
+		}
+
+		if (slot.pipeline != VK_NULL_HANDLE)
+			vkDestroyPipeline(device, slot.pipeline, nullptr);
+		for (auto shaderModule : slot.shaderModules)
+			shaderCache->release(shaderModule);
+	}
+}
+
+PipelineHandle PipelineManager::request(const PipelineDesc & desc, PipelineHandle fallback)
+{
+	if (fallback != PIPELINE_HANDLE_NONE && fallback >= slots.size())
+		throw std::invalid_argument("f(x):request fallback is not a requested pipeline.");
+
+	uint64_t hash = desc.hash();
+
+	auto range = slotsByHash.equal_range(hash);
+	for (auto it = range.first; it != range.second; ++it)
+	{
+		if (slots[it->second].desc == desc)
+			return it->second;
+	}
+
+	PipelineHandle handle = static_cast<PipelineHandle>(slots.size());
+	slots.emplace_back();
+	slotsByHash.insert(std::make_pair(hash, handle));
+
+	Slot& slot = slots.back();
+	slot.desc = desc;
+	slot.fallback = fallback;
+
+	jobs->run([this, &slot]() { createPipeline(slot); }, &slot.counter);
+
+	return handle;
+}
+
+VkPipeline PipelineManager::get(PipelineHandle handle)
+{
+	while (handle != PIPELINE_HANDLE_NONE)
+	{
+		if (isReady(handle))
+			return slots[handle].pipeline;
+		handle = slots[handle].fallback;
+	}
+
+	return VK_NULL_HANDLE;
+}
+
+void PipelineManager::wait(PipelineHandle handle)
+{
+	TRACE_ZONE("PipelineManager::wait", "wait");
+
+	jobs->wait(&slots[handle].counter);
+}
+
+void PipelineManager::waitAll()
+{
+	for (auto& slot : slots)
+		jobs->wait(&slot.counter);
+}
+
+bool PipelineManager::poll()
+{
+	bool isChanged = false;
+
+	for (size_t i = 0; i < slots.size(); i++)
+	{
+		Slot& slot = slots[i];
+		if (slot.isReported || !slot.isReady.load(std::memory_order_acquire))
+			continue;
+
+		slot.isReported = true;
+		isChanged = true;
+
+		std::cout << "Pipeline variant " << i << " ready after " << slot.createMs << " ms" << std::endl;
+	}
+
+	return isChanged;
+}
+
+void PipelineManager::createPipeline(Slot & slot)
+{
+	TRACE_ZONE("PipelineManager::createPipeline", "pipeline");
+
+	auto tStart = std::chrono::high_resolution_clock::now();
+
+	const PipelineDesc& desc = slot.desc;
+
+	VkPipelineInputAssemblyStateCreateInfo inputAssemblyState = {};
+	inputAssemblyState.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+	inputAssemblyState.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+	VkPipelineRasterizationStateCreateInfo rasterizationState = {};
+	rasterizationState.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+	rasterizationState.polygonMode = VK_POLYGON_MODE_FILL;
+	rasterizationState.cullMode = desc.cullMode;
+	rasterizationState.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+	rasterizationState.lineWidth = 1.0f;
+
+	VkPipelineColorBlendAttachmentState blendAttachmentState = {};
+	blendAttachmentState.colorWriteMask = 0xf;
+	blendAttachmentState.blendEnable = desc.blendEnable;
+	blendAttachmentState.colorBlendOp = VK_BLEND_OP_ADD;
+	blendAttachmentState.srcColorBlendFactor = desc.srcColorBlendFactor;
+	blendAttachmentState.dstColorBlendFactor = desc.dstColorBlendFactor;
+
+	VkPipelineColorBlendStateCreateInfo colorBlendState = {};
+	colorBlendState.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+	colorBlendState.attachmentCount = 1;
+	colorBlendState.pAttachments = &blendAttachmentState;
+
+	// Viewport and scissor are set by the command buffers
+	VkPipelineViewportStateCreateInfo viewportState = {};
+	viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+	viewportState.viewportCount = 1;
+	viewportState.scissorCount = 1;
+
+	std::array<VkDynamicState, 2> dynamicStateEnables = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+	VkPipelineDynamicStateCreateInfo dynamicState = {};
+	dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+	dynamicState.pDynamicStates = dynamicStateEnables.data();
+	dynamicState.dynamicStateCount = static_cast<uint32_t>(dynamicStateEnables.size());
+
+	VkPipelineDepthStencilStateCreateInfo depthStencilState = {};
+	depthStencilState.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+	depthStencilState.depthTestEnable = VK_TRUE;
+	depthStencilState.depthWriteEnable = desc.depthWriteEnable;
+	depthStencilState.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+	depthStencilState.back.failOp = VK_STENCIL_OP_KEEP;
+	depthStencilState.back.passOp = VK_STENCIL_OP_KEEP;
+	depthStencilState.back.compareOp = VK_COMPARE_OP_ALWAYS;
+	depthStencilState.front = depthStencilState.back;
+
+	VkPipelineMultisampleStateCreateInfo multisampleState = {};
+	multisampleState.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+	multisampleState.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+	VkPipelineVertexInputStateCreateInfo vertexInputState = {};
+	vertexInputState.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+	vertexInputState.vertexBindingDescriptionCount = static_cast<uint32_t>(desc.vertexBindings.size());
+	vertexInputState.pVertexBindingDescriptions = desc.vertexBindings.data();
+	vertexInputState.vertexAttributeDescriptionCount = static_cast<uint32_t>(desc.vertexAttributes.size());
+	vertexInputState.pVertexAttributeDescriptions = desc.vertexAttributes.data();
+
+	// One 32 bit constant per entry, constant_id i at offset 4 * i
+	std::array<const std::vector<uint32_t>*, 2> constants = { &desc.vertConstants, &desc.fragConstants };
+	std::array<std::vector<VkSpecializationMapEntry>, 2> specializationEntries;
+	std::array<VkSpecializationInfo, 2> specializationInfos = {};
+
+	for (size_t s = 0; s < constants.size(); s++)
+	{
+		for (uint32_t c = 0; c < constants[s]->size(); c++)
+		{
+			VkSpecializationMapEntry entry = {};
+			entry.constantID = c;
+			entry.offset = c * sizeof(uint32_t);
+			entry.size = sizeof(uint32_t);
+			specializationEntries[s].push_back(entry);
+		}
+
+		specializationInfos[s].mapEntryCount = static_cast<uint32_t>(specializationEntries[s].size());
+		specializationInfos[s].pMapEntries = specializationEntries[s].data();
+		specializationInfos[s].dataSize = constants[s]->size() * sizeof(uint32_t);
+		specializationInfos[s].pData = constants[s]->data();
+	}
+
+	std::array<VkPipelineShaderStageCreateInfo, 2> shaderStages = {};
+
+	shaderStages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	shaderStages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+	slot.shaderModules[0] = shaderCache->acquire(desc.vertShaderFile);
+	shaderStages[0].module = slot.shaderModules[0];
+	shaderStages[0].pName = "main";
+	shaderStages[0].pSpecializationInfo = desc.vertConstants.empty() ? nullptr : &specializationInfos[0];
+
+	shaderStages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	shaderStages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+	slot.shaderModules[1] = shaderCache->acquire(desc.fragShaderFile);
+	shaderStages[1].module = slot.shaderModules[1];
+	shaderStages[1].pName = "main";
+	shaderStages[1].pSpecializationInfo = desc.fragConstants.empty() ? nullptr : &specializationInfos[1];
+
+	VkGraphicsPipelineCreateInfo pipelineCreateInfo = {};
+	pipelineCreateInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+	pipelineCreateInfo.layout = desc.layout;
+	pipelineCreateInfo.renderPass = desc.renderPass;
+	pipelineCreateInfo.stageCount = static_cast<uint32_t>(shaderStages.size());
+	pipelineCreateInfo.pStages = shaderStages.data();
+	pipelineCreateInfo.pVertexInputState = &vertexInputState;
+	pipelineCreateInfo.pInputAssemblyState = &inputAssemblyState;
+	pipelineCreateInfo.pRasterizationState = &rasterizationState;
+	pipelineCreateInfo.pColorBlendState = &colorBlendState;
+	pipelineCreateInfo.pMultisampleState = &multisampleState;
+	pipelineCreateInfo.pViewportState = &viewportState;
+	pipelineCreateInfo.pDepthStencilState = &depthStencilState;
+	pipelineCreateInfo.pDynamicState = &dynamicState;
+
+	// The cache is synchronized by the driver, so variants are created against it from any thread
+	VK_CHECK_RESULT(vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineCreateInfo, nullptr, &slot.pipeline));
+
+	auto tEnd = std::chrono::high_resolution_clock::now();
+	slot.createMs = std::chrono::duration<double, std::milli>(tEnd - tStart).count();
+
+	slot.isReady.store(true, std::memory_order_release);
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "VkUtils.h"
+#include "JobSystem.h"
+#include "ShaderCache.h"
+
+#include <atomic>
+#include <deque>
+#include <string>
+#include <unordered_map>
+
+// Index of a pipeline variant, stays valid for the lifetime of the manager
+typedef uint32_t PipelineHandle;
+#define PIPELINE_HANDLE_NONE (~0u)
+
+// The state that tells scene pipeline variants apart
+// Everything not listed here is the same for all variants, see PipelineManager::createPipeline
+struct PipelineDesc
+{
+	std::string vertShaderFile;
+	std::string fragShaderFile;
+	// Specialization constants, the i-th value is constant_id i of its stage
+	std::vector<uint32_t> vertConstants;
+	std::vector<uint32_t> fragConstants;
+
+	std::vector<VkVertexInputBindingDescription> vertexBindings;
+	std::vector<VkVertexInputAttributeDescription> vertexAttributes;
+
+	VkCullModeFlags cullMode = VK_CULL_MODE_BACK_BIT;
+	VkBool32 blendEnable = VK_FALSE;
+	VkBlendFactor srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
+	VkBlendFactor dstColorBlendFactor = VK_BLEND_FACTOR_ZERO;
+	VkBool32 depthWriteEnable = VK_TRUE;
+
+	VkPipelineLayout layout = VK_NULL_HANDLE;
+	VkRenderPass renderPass = VK_NULL_HANDLE;
+
+	uint64_t hash() const;
+	bool operator==(const PipelineDesc& other) const;
+};
+
+// Creates pipeline variants on job threads against one shared pipeline cache
+// Equal descriptions share a variant, and the shader modules come from the shader cache
+// request, get and poll belong to the thread that renders, only the creation runs on the job threads
+class PipelineManager
+{
+public:
+	PipelineManager(VkDevice device, VkPipelineCache pipelineCache, ShaderCache *shaderCache, JobSystem *jobs);
+	// Waits for pending variants, then destroys all pipelines and releases their shader modules
+	virtual ~PipelineManager();
+
+	// Starts creating the variant unless an equal one exists
+	// Until it is ready get returns the pipeline of the fallback variant
+	PipelineHandle request(const PipelineDesc& desc, PipelineHandle fallback = PIPELINE_HANDLE_NONE);
+
+	// The variant's pipeline, or the nearest ready fallback, VK_NULL_HANDLE if none is ready
+	VkPipeline get(PipelineHandle handle);
+	inline bool isReady(PipelineHandle handle) { return slots[handle].isReady.load(std::memory_order_acquire); }
+
+	// Blocks until the variant is created, rethrows its creation error
+	void wait(PipelineHandle handle);
+	void waitAll();
+
+	// True once per batch of variants that became ready since the last call,
+	// command buffers recorded with fallbacks should be recorded again
+	bool poll();
+
+	inline uint32_t getPipelineCount() { return static_cast<uint32_t>(slots.size()); }
+
+private:
+	struct Slot {
+		PipelineDesc desc;
+		PipelineHandle fallback;
+		VkPipeline pipeline = VK_NULL_HANDLE;
+		// Held until the manager is destroyed, so later variants of the same shaders find them
+		std::array<VkShaderModule, 2> shaderModules = { { VK_NULL_HANDLE, VK_NULL_HANDLE } };
+		// Set after pipeline is written
+		std::atomic<bool> isReady = { false };
+		// Whether poll has reported the variant
+		bool isReported = false;
+		double createMs = 0.0;
+		JobCounter counter;
+	};
+
+	VkDevice device;
+	VkPipelineCache pipelineCache;
+	ShaderCache *shaderCache;
+	JobSystem *jobs;
+
+	// A deque keeps the slots in place while job threads fill them
+	std::deque<Slot> slots;
+	std::unordered_multimap<uint64_t, PipelineHandle> slotsByHash;
+
+	// Runs on a job thread
+	void createPipeline(Slot& slot);
+};
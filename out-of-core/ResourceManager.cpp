@@ -1,12 +1,17 @@
 #define VMA_IMPLEMENTATION
 
 #include "ResourceManager.h"
+#include "LzCodec.h"
+#include "Trace.h"
 
 #include <limits.h>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
 
 
-ResourceManager::ResourceManager(VkPhysicalDevice physicalDevice, VkDevice device, VkCommandPool cmdPool, VkQueue cmdQueue)
+ResourceManager::ResourceManager(VkPhysicalDevice physicalDevice, const VkPhysicalDeviceFeatures& enabledFeatures, VkDevice device, VkCommandPool cmdPool, VkQueue cmdQueue, JobSystem *jobs) : jobs(jobs), deviceHeap(false), hostHeap(true)
 {
 	VmaAllocatorCreateInfo allocatorInfo = {};
 	allocatorInfo.physicalDevice = physicalDevice;
@@ -18,6 +23,7 @@ ResourceManager::ResourceManager(VkPhysicalDevice physicalDevice, VkDevice devic
 	this->device = device;
 	this->cmdPool = cmdPool;
 	this->cmdQueue = cmdQueue;
+	this->textureCompressionBC = (enabledFeatures.textureCompressionBC == VK_TRUE);
 
 	vkGetPhysicalDeviceMemoryProperties(physicalDevice, &deviceMemoryProperties);
 	createCmdBuffer();
@@ -27,6 +33,14 @@ ResourceManager::ResourceManager(VkPhysicalDevice physicalDevice, VkDevice devic
 
 ResourceManager::~ResourceManager()
 {
+	if (hasPlaceholder) {
+		vkDestroyImageView(device, placeholder.view, nullptr);
+		vmaDestroyImage(allocator, placeholder.image, placeholder.allocation);
+	}
+
+	if (hasStagingBuffer)
+		destroyBuffer(stagingBuffer);
+
 	vmaDestroyAllocator(allocator);
 }
 
@@ -74,28 +88,28 @@ void ResourceManager::createBuffer(VmaMemoryUsage memUsage, VkDeviceSize size, V
 	}
 }
 
-void ResourceManager::createBufferInDevice(VkDeviceSize size, VkBufferUsageFlags usage, Buffer *buffer, void * pData)
+void ResourceManager::createBufferInDevice(VkDeviceSize size, VkBufferUsageFlags usage, Buffer *buffer, const void * pData)
 {
 	if (pData == nullptr)
 		throw std::invalid_argument("f(x):createBufferInDevice needs data to initiate.");
 
-	Buffer stagingBuffer;
+	StagingSpan span;
+	beginUpload(size, &span);
+	memcpy(span.pData, pData, size);
 
-	void* pMappedData;
+	createBufferInDevice(usage, buffer, span);
+}
 
-	createBuffer(
-		VMA_MEMORY_USAGE_CPU_ONLY,
-		size,
-		VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-		&stagingBuffer,
-		&pMappedData
-	);
+void ResourceManager::createBufferInDevice(VkBufferUsageFlags usage, Buffer * buffer, StagingSpan & span)
+{
+	TRACE_ZONE("ResourceManager::createBufferInDevice", "upload");
 
-	memcpy(pMappedData, pData, size);
+	if (span.pData == nullptr)
+		throw std::invalid_argument("f(x):createBufferInDevice needs a reserved span.");
 
 	createBuffer(
 		VMA_MEMORY_USAGE_GPU_ONLY,
-		size,
+		span.size,
 		usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
 		buffer,
 		nullptr
@@ -104,12 +118,23 @@ void ResourceManager::createBufferInDevice(VkDeviceSize size, VkBufferUsageFlags
 	beginCmdBuffer();
 
 		VkBufferCopy copyRegionB = {};
-		copyRegionB.size = size;
-		vkCmdCopyBuffer(cmdBuffer, stagingBuffer.buffer, buffer->buffer, 1, &copyRegionB);
+		copyRegionB.size = span.size;
+		vkCmdCopyBuffer(cmdBuffer, span.buffer.buffer, buffer->buffer, 1, &copyRegionB);
 
 	flushCmdBuffer();
 
-	destroyBuffer(stagingBuffer);
+	cancelUpload(span);
+}
+
+void ResourceManager::createBufferInDevice(VkDeviceSize size, VkBufferUsageFlags usage, Buffer * buffer)
+{
+	createBuffer(
+		VMA_MEMORY_USAGE_GPU_ONLY,
+		size,
+		usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		buffer,
+		nullptr
+	);
 }
 
 void ResourceManager::createBufferInHost(VkDeviceSize size, VkBufferUsageFlags usage, Buffer *buffer, void * pData)
@@ -135,7 +160,7 @@ void ResourceManager::createImage(VmaMemoryUsage memUsage, uint32_t width, uint3
 	imageInfo.extent.width = width;
 	imageInfo.extent.height = height;
 	imageInfo.extent.depth = 1;
-	imageInfo.mipLevels = 1;
+	imageInfo.mipLevels = image->mipLevels;
 	imageInfo.arrayLayers = 1;
 	imageInfo.format = format;
 	imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
@@ -169,7 +194,7 @@ void ResourceManager::createImage(VmaMemoryUsage memUsage, uint32_t width, uint3
 		
 		while (devUsage > devLimit) {
 			pSmallestResource = deviceHeap.top();
-			smallestResourceSize = pSmallestResource->allocation->GetSize();
+			smallestResourceSize = pSmallestResource->getMemorySize();
 
 			if (smallestResourceSize >= resSize) {
 				devUsage -= resSize;
@@ -187,17 +212,16 @@ void ResourceManager::createImage(VmaMemoryUsage memUsage, uint32_t width, uint3
 			deviceHeap.push(res);
 
 		if (devLimit - devUsage < oldSpace) { // worthier
+			TRACE_ZONE("ResourceManager::makeRoomInDevice", "migration");
 			for (Resource* res : URNotTheFace) {
 				migrateResource(*res);
 			}
-			std::cout << "Still go for device" << std::endl;
 		}
 		else { // not worth
 			// new one go to host
 			memUsage = VMA_MEMORY_USAGE_CPU_TO_GPU;
-			imageInfo.tiling = VK_IMAGE_TILING_LINEAR;
+			imageInfo.tiling = getHostTiling(format, usage, image->mipLevels);
 			resSize = getRequiredImageSize(&imageInfo);
-			std::cout << "Image go for host instead" << std::endl;
 		}
 	}
 
@@ -233,27 +257,35 @@ void ResourceManager::createImage(VmaMemoryUsage memUsage, uint32_t width, uint3
 
 }
 
-void ResourceManager::createImageInDevice(uint32_t width, uint32_t height, VkFormat format, VkImageUsageFlags usage, Image *image, void * pData, VkDeviceSize imageSize)
+void ResourceManager::createImageInDevice(uint32_t width, uint32_t height, VkFormat format, VkImageUsageFlags usage, Image *image, const void * pData, VkDeviceSize imageSize)
+{
+	VkDeviceSize mipOffset = 0;
+	createImageInDevice(width, height, 1, format, usage, image, pData, imageSize, &mipOffset);
+}
+
+void ResourceManager::createImageInDevice(uint32_t width, uint32_t height, uint32_t mipLevels, VkFormat format, VkImageUsageFlags usage, Image *image, const void * pData, VkDeviceSize dataSize, const VkDeviceSize * pMipOffsets)
 {
 	if (pData == nullptr)
-		throw std::invalid_argument("f(x):createBufferInDevice needs data to initiate.");
+		throw std::invalid_argument("f(x):createImageInDevice needs data to initiate.");
 
-	if (usage & VK_IMAGE_USAGE_SAMPLED_BIT && format == VK_FORMAT_R8G8B8A8_UNORM)
-		usage = usage | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+	StagingSpan span;
+	beginUpload(dataSize, &span);
+	memcpy(span.pData, pData, dataSize);
 
-	Buffer stagingBuffer;
+	createImageInDevice(width, height, mipLevels, format, usage, image, span, pMipOffsets);
+}
 
-	void* pMappedData;
+void ResourceManager::createImageInDevice(uint32_t width, uint32_t height, uint32_t mipLevels, VkFormat format, VkImageUsageFlags usage, Image * image, StagingSpan & span, const VkDeviceSize * pMipOffsets)
+{
+	TRACE_ZONE("ResourceManager::createImageInDevice", "upload");
 
-	createBuffer(
-		VMA_MEMORY_USAGE_CPU_ONLY,
-		imageSize,
-		VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-		&stagingBuffer,
-		&pMappedData
-	);
+	if (span.pData == nullptr)
+		throw std::invalid_argument("f(x):createImageInDevice needs a reserved span.");
+
+	if (usage & VK_IMAGE_USAGE_SAMPLED_BIT && isMigratableFormat(format))
+		usage = usage | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
 
-	memcpy(pMappedData, pData, imageSize);
+	image->mipLevels = mipLevels;
 
 	createImage(
 		VMA_MEMORY_USAGE_GPU_ONLY,
@@ -269,28 +301,32 @@ void ResourceManager::createImageInDevice(uint32_t width, uint32_t height, VkFor
 	
 	transitionImageLayout(cmdBuffer, image->image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
 
-	VkBufferImageCopy copyRegionBI = {};
-	copyRegionBI.bufferOffset = 0;
-	copyRegionBI.bufferRowLength = 0;
-	copyRegionBI.bufferImageHeight = 0;
-	copyRegionBI.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-	copyRegionBI.imageSubresource.mipLevel = 0;
-	copyRegionBI.imageSubresource.baseArrayLayer = 0;
-	copyRegionBI.imageSubresource.layerCount = 1;
-	copyRegionBI.imageOffset = { 0, 0, 0 };
-	copyRegionBI.imageExtent = {
-		width,
-		height,
-		1
-	};
+	// One region per mip, all sourced from the same staging buffer
+	std::vector<VkBufferImageCopy> copyRegionsBI(mipLevels);
+	for (uint32_t i = 0; i < mipLevels; i++)
+	{
+		copyRegionsBI[i].bufferOffset = pMipOffsets[i];
+		copyRegionsBI[i].bufferRowLength = 0;
+		copyRegionsBI[i].bufferImageHeight = 0;
+		copyRegionsBI[i].imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		copyRegionsBI[i].imageSubresource.mipLevel = i;
+		copyRegionsBI[i].imageSubresource.baseArrayLayer = 0;
+		copyRegionsBI[i].imageSubresource.layerCount = 1;
+		copyRegionsBI[i].imageOffset = { 0, 0, 0 };
+		copyRegionsBI[i].imageExtent = {
+			std::max(width >> i, 1u),
+			std::max(height >> i, 1u),
+			1
+		};
+	}
 
-	vkCmdCopyBufferToImage(cmdBuffer, stagingBuffer.buffer, image->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegionBI);
+	vkCmdCopyBufferToImage(cmdBuffer, span.buffer.buffer, image->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mipLevels, copyRegionsBI.data());
 
 	transitionImageLayout(cmdBuffer, image->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
 
 	flushCmdBuffer();
 
-	destroyBuffer(stagingBuffer);
+	cancelUpload(span);
 }
 
 void ResourceManager::createImageInHost(uint32_t width, uint32_t height, VkFormat format, VkImageUsageFlags usage, Image *image, void * pData)
@@ -299,7 +335,7 @@ void ResourceManager::createImageInHost(uint32_t width, uint32_t height, VkForma
 		usage = usage | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
 
 	void* pMappedData;
-	VkDeviceSize imageSize = width * height * 4;
+	VkDeviceSize imageSize = getImageDataSize(format, width, height);
 
 	createImage(
 		VMA_MEMORY_USAGE_CPU_TO_GPU,
@@ -321,6 +357,51 @@ void ResourceManager::createImageInHost(uint32_t width, uint32_t height, VkForma
 	flushCmdBuffer();
 }
 
+void ResourceManager::updateImageMip(Image & image, uint32_t mipLevel, const void * pData, VkDeviceSize size)
+{
+	if (pData == nullptr || mipLevel >= image.mipLevels)
+		throw std::invalid_argument("f(x):updateImageMip needs data for an existing mip.");
+
+	StagingSpan span;
+	beginUpload(size, &span);
+	memcpy(span.pData, pData, size);
+
+	updateImageMip(image, mipLevel, span);
+}
+
+void ResourceManager::updateImageMip(Image & image, uint32_t mipLevel, StagingSpan & span)
+{
+	TRACE_ZONE("ResourceManager::updateImageMip", "upload");
+
+	if (span.pData == nullptr || mipLevel >= image.mipLevels)
+		throw std::invalid_argument("f(x):updateImageMip needs a reserved span for an existing mip.");
+
+	beginCmdBuffer();
+
+	// Only the target level leaves the shader read layout
+	transitionImageLayout(cmdBuffer, image.image, image.lastImgLayout, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mipLevel, 1);
+
+	VkBufferImageCopy copyRegionBI = {};
+	copyRegionBI.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	copyRegionBI.imageSubresource.mipLevel = mipLevel;
+	copyRegionBI.imageSubresource.baseArrayLayer = 0;
+	copyRegionBI.imageSubresource.layerCount = 1;
+	copyRegionBI.imageOffset = { 0, 0, 0 };
+	copyRegionBI.imageExtent = {
+		std::max(image.width >> mipLevel, 1u),
+		std::max(image.height >> mipLevel, 1u),
+		1
+	};
+
+	vkCmdCopyBufferToImage(cmdBuffer, span.buffer.buffer, image.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegionBI);
+
+	transitionImageLayout(cmdBuffer, image.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, image.lastImgLayout, mipLevel, 1);
+
+	flushCmdBuffer();
+
+	cancelUpload(span);
+}
+
 void ResourceManager::mapMemory(VmaAllocation allocation, void ** ppData)
 {
 	VK_CHECK_RESULT(vmaMapMemory(allocator,allocation,ppData));
@@ -331,6 +412,174 @@ void ResourceManager::unmapMemory(VmaAllocation allocation)
 	vmaUnmapMemory(allocator, allocation);
 }
 
+void ResourceManager::updateBuffer(Buffer & buffer, VkDeviceSize offset, const void * pData, VkDeviceSize size)
+{
+	if (pData == nullptr || offset + size > buffer.size)
+		throw std::invalid_argument("f(x):updateBuffer needs data within the buffer.");
+
+	StagingSpan span;
+	beginUpload(size, &span);
+	memcpy(span.pData, pData, size);
+
+	updateBuffer(buffer, offset, span);
+}
+
+void ResourceManager::updateBuffer(Buffer & buffer, VkDeviceSize offset, StagingSpan & span)
+{
+	TRACE_ZONE("ResourceManager::updateBuffer", "upload");
+
+	if (span.pData == nullptr || offset + span.size > buffer.size)
+		throw std::invalid_argument("f(x):updateBuffer needs a reserved span within the buffer.");
+
+	beginCmdBuffer();
+
+		VkBufferCopy copyRegionB = {};
+		copyRegionB.dstOffset = offset;
+		copyRegionB.size = span.size;
+		vkCmdCopyBuffer(cmdBuffer, span.buffer.buffer, buffer.buffer, 1, &copyRegionB);
+
+	flushCmdBuffer();
+
+	cancelUpload(span);
+}
+
+void ResourceManager::updateBuffers(const std::vector<BufferUpdate>& updates)
+{
+	TRACE_ZONE("ResourceManager::updateBuffers", "upload");
+
+	if (updates.empty())
+		return;
+
+	VkDeviceSize totalSize = 0;
+	for (auto& update : updates)
+	{
+		if (update.buffer == nullptr || update.pData == nullptr || update.offset + update.size > update.buffer->size)
+			throw std::invalid_argument("f(x):updateBuffers needs data within every buffer.");
+		totalSize += update.size;
+	}
+
+	StagingSpan span;
+	beginUpload(totalSize, &span);
+
+	beginCmdBuffer();
+
+	VkDeviceSize stagingOffset = 0;
+	for (auto& update : updates)
+	{
+		memcpy(static_cast<uint8_t*>(span.pData) + stagingOffset, update.pData, update.size);
+
+		VkBufferCopy copyRegion = {};
+		copyRegion.srcOffset = stagingOffset;
+		copyRegion.dstOffset = update.offset;
+		copyRegion.size = update.size;
+		vkCmdCopyBuffer(cmdBuffer, span.buffer.buffer, update.buffer->buffer, 1, &copyRegion);
+
+		stagingOffset += update.size;
+	}
+
+	flushCmdBuffer();
+
+	cancelUpload(span);
+}
+
+void ResourceManager::beginUpload(VkDeviceSize size, StagingSpan * span)
+{
+	span->size = size;
+
+	// Uploads wait for their copy, so the shared buffer is free again once the consuming call returns
+	if (size <= STAGING_BUFFER_SIZE && !isStagingInUse)
+	{
+		if (!hasStagingBuffer)
+		{
+			createBuffer(
+				VMA_MEMORY_USAGE_CPU_ONLY,
+				STAGING_BUFFER_SIZE,
+				VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+				&stagingBuffer,
+				&pStagingData
+			);
+			hasStagingBuffer = true;
+		}
+
+		span->buffer = stagingBuffer;
+		span->pData = pStagingData;
+		span->isShared = true;
+		isStagingInUse = true;
+		return;
+	}
+
+	createBuffer(
+		VMA_MEMORY_USAGE_CPU_ONLY,
+		size,
+		VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		&span->buffer,
+		&span->pData
+	);
+	span->isShared = false;
+}
+
+void ResourceManager::cancelUpload(StagingSpan & span)
+{
+	if (span.pData == nullptr)
+		return;
+
+	if (span.isShared)
+		isStagingInUse = false;
+	else
+		destroyBuffer(span.buffer);
+
+	span.pData = nullptr;
+	span.size = 0;
+	span.isShared = false;
+}
+
+void ResourceManager::createUniformRing(VkDeviceSize dataSize, uint32_t sliceCount, UniformRing * ring)
+{
+	if (dataSize == 0 || sliceCount == 0)
+		throw std::invalid_argument("f(x):createUniformRing needs a data size and at least one slice.");
+
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+	VkDeviceSize alignment = std::max<VkDeviceSize>(properties.limits.minUniformBufferOffsetAlignment, 1);
+	ring->sliceSize = (dataSize + alignment - 1) / alignment * alignment;
+	ring->sliceCount = sliceCount;
+
+	VkBufferCreateInfo bufferInfo = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+	bufferInfo.size = ring->sliceSize * sliceCount;
+	bufferInfo.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
+	bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+	// Coherent, so slices are written without flushing ranges every frame
+	VmaAllocationCreateInfo allocCreateInfo = {};
+	allocCreateInfo.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
+	allocCreateInfo.requiredFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+	allocCreateInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+
+	VmaAllocationInfo allocInfo = {};
+
+	VK_CHECK_RESULT(vmaCreateBuffer(allocator, &bufferInfo, &allocCreateInfo, &ring->buffer.buffer, &ring->buffer.allocation, &allocInfo));
+
+	ring->buffer.size = bufferInfo.size;
+	ring->buffer.isMigratable = false;
+	ring->buffer.usage = bufferInfo.usage;
+	ring->buffer.isInGPU = false;
+	ring->pMappedData = static_cast<uint8_t*>(allocInfo.pMappedData);
+
+	totalHostUsage += ring->buffer.allocation->GetSize();
+
+	// Dynamic offsets are added to the descriptor's offset, so it addresses slice 0
+	ring->buffer.descInfo.buffer = ring->buffer.buffer;
+	ring->buffer.descInfo.offset = 0;
+	ring->buffer.descInfo.range = dataSize;
+}
+
+void ResourceManager::destroyUniformRing(UniformRing & ring)
+{
+	destroyBuffer(ring.buffer);
+	ring.pMappedData = nullptr;
+}
+
 void ResourceManager::destroyBuffer(Buffer &buffer)
 {
 	if (buffer.isInGPU)
@@ -351,7 +600,7 @@ void ResourceManager::destroyImage(Image &image)
 		//Resource* pRes;
 		VkDeviceSize devLimit = static_cast<VkDeviceSize>(pseudoDeviceLimit * 0.9);
 		while (!hostHeap.empty()) {
-			if (hostHeap.top()->allocation->GetSize() + totalDeviceUsage > devLimit) break;
+			if (hostHeap.top()->getMemorySize() + totalDeviceUsage > devLimit) break;
 
 			//pRes = hostHeap.top();
 			//hostHeap.pop();
@@ -363,6 +612,16 @@ void ResourceManager::destroyImage(Image &image)
 		}
 		
 	}
+	else if (image.isPacked) {
+		totalHostUsage -= image.packed.data.size();
+		packedDataSize -= image.packed.dataSize;
+		packedSize -= image.packed.data.size();
+		hostHeap.remove(&image);
+
+		image.isPacked = false;
+		image.packed.data.clear();
+		image.packed.chunkSizes.clear();
+	}
 	else {
 		totalHostUsage -= image.allocation->GetSize();
 		hostHeap.remove(&image);
@@ -385,14 +644,14 @@ void ResourceManager::createImageView(VkImage image, VkFormat format, VkImageVie
 	viewInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
 	viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
 	viewInfo.subresourceRange.baseMipLevel = 0;
-	viewInfo.subresourceRange.levelCount = 1;
+	viewInfo.subresourceRange.levelCount = VK_REMAINING_MIP_LEVELS;
 	viewInfo.subresourceRange.baseArrayLayer = 0;
 	viewInfo.subresourceRange.layerCount = 1;
 
 	VK_CHECK_RESULT(vkCreateImageView(device, &viewInfo, nullptr, imageView));
 }
 
-void ResourceManager::transitionImageLayout(VkCommandBuffer cmdBuffer, VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout)
+void ResourceManager::transitionImageLayout(VkCommandBuffer cmdBuffer, VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout, uint32_t baseMipLevel, uint32_t levelCount)
 {
 	VkImageMemoryBarrier barrier = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
 	barrier.oldLayout = oldLayout;
@@ -401,8 +660,8 @@ void ResourceManager::transitionImageLayout(VkCommandBuffer cmdBuffer, VkImage i
 	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
 	barrier.image = image;
 	barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-	barrier.subresourceRange.baseMipLevel = 0;
-	barrier.subresourceRange.levelCount = 1;
+	barrier.subresourceRange.baseMipLevel = baseMipLevel;
+	barrier.subresourceRange.levelCount = levelCount;
 	barrier.subresourceRange.baseArrayLayer = 0;
 	barrier.subresourceRange.layerCount = 1;
 
@@ -423,6 +682,13 @@ void ResourceManager::transitionImageLayout(VkCommandBuffer cmdBuffer, VkImage i
 		sourceStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
 		destinationStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
 	}
+	else if (oldLayout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL && newLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL) {
+		barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+
+		sourceStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+		destinationStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+	}
 	else if (oldLayout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL && newLayout == VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL) {
 		barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
 		barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
@@ -446,8 +712,23 @@ void ResourceManager::transitionImageLayout(VkCommandBuffer cmdBuffer, VkImage i
 
 void ResourceManager::migrateTexture(Image& texture)
 {
+	TRACE_ZONE("ResourceManager::migrateTexture", "migration");
+
+	// Counted up front, the compressed tier returns early
+	countMigration(texture);
+
+	if (texture.isPacked) {
+		unpackTexture(texture);
+		return;
+	}
+
 	if (texture.image == NULL)
 		throw std::runtime_error("Destination texture param does not exist.");
+
+	if (texture.isInGPU && compressedHostTier) {
+		packTexture(texture);
+		return;
+	}
 	/*
 	if (texture.isInGPU) {
 		memUsage = VMA_MEMORY_USAGE_CPU_TO_GPU;
@@ -490,7 +771,7 @@ void ResourceManager::migrateTexture(Image& texture)
 	imageInfo.extent.width = texture.width;
 	imageInfo.extent.height = texture.height;
 	imageInfo.extent.depth = 1;
-	imageInfo.mipLevels = 1;
+	imageInfo.mipLevels = texture.mipLevels;
 	imageInfo.arrayLayers = 1;
 	imageInfo.format = texture.format;
 	imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
@@ -502,16 +783,11 @@ void ResourceManager::migrateTexture(Image& texture)
 
 	if (texture.isInGPU) {
 		allocCreateInfo.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
-		imageInfo.tiling = VK_IMAGE_TILING_LINEAR;
+		imageInfo.tiling = getHostTiling(texture.format, texture.usage, texture.mipLevels);
 		texture.isInGPU = false;
 
 		totalDeviceUsage -= texture.allocation->GetSize();
 		deviceHeap.remove(&texture);
-
-		VkFormatProperties formatProperties;
-		vkGetPhysicalDeviceFormatProperties(physicalDevice, texture.format, &formatProperties);
-		if (!(formatProperties.linearTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT))
-			throw std::runtime_error("Secondary Image doesn't support desired format.");
 	}
 	else {
 		allocCreateInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
@@ -531,22 +807,25 @@ void ResourceManager::migrateTexture(Image& texture)
 	transitionImageLayout(cmdBuffer, texture.image, texture.lastImgLayout, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
 	transitionImageLayout(cmdBuffer, dstImage, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
 
-	VkImageCopy copyRegionI = {};
-	copyRegionI.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-	copyRegionI.srcSubresource.mipLevel = 0;
-	copyRegionI.srcSubresource.baseArrayLayer = 0;
-	copyRegionI.srcSubresource.layerCount = 1;
-	copyRegionI.srcOffset = { 0, 0, 0 };
-	copyRegionI.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-	copyRegionI.dstSubresource.mipLevel = 0;
-	copyRegionI.dstSubresource.baseArrayLayer = 0;
-	copyRegionI.dstSubresource.layerCount = 1;
-	copyRegionI.dstOffset = { 0, 0, 0 };
-	copyRegionI.extent = {
-		texture.width,
-		texture.height,
-		1
-	};
+	std::vector<VkImageCopy> copyRegionsI(texture.mipLevels);
+	for (uint32_t i = 0; i < texture.mipLevels; i++)
+	{
+		copyRegionsI[i].srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		copyRegionsI[i].srcSubresource.mipLevel = i;
+		copyRegionsI[i].srcSubresource.baseArrayLayer = 0;
+		copyRegionsI[i].srcSubresource.layerCount = 1;
+		copyRegionsI[i].srcOffset = { 0, 0, 0 };
+		copyRegionsI[i].dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		copyRegionsI[i].dstSubresource.mipLevel = i;
+		copyRegionsI[i].dstSubresource.baseArrayLayer = 0;
+		copyRegionsI[i].dstSubresource.layerCount = 1;
+		copyRegionsI[i].dstOffset = { 0, 0, 0 };
+		copyRegionsI[i].extent = {
+			std::max(texture.width >> i, 1u),
+			std::max(texture.height >> i, 1u),
+			1
+		};
+	}
 
 	vkCmdCopyImage(
 		cmdBuffer,
@@ -554,8 +833,8 @@ void ResourceManager::migrateTexture(Image& texture)
 		VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
 		dstImage,
 		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-		1,
-		&copyRegionI
+		texture.mipLevels,
+		copyRegionsI.data()
 	);
 
 	transitionImageLayout(cmdBuffer, dstImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
@@ -584,12 +863,277 @@ void ResourceManager::migrateTexture(Image& texture)
 	}
 }
 
+void ResourceManager::packTexture(Image & texture)
+{
+	TRACE_ZONE("ResourceManager::packTexture", "migration");
+
+	std::vector<VkBufferImageCopy> copyRegionsBI;
+	VkDeviceSize dataSize = getMipCopyRegions(texture, copyRegionsBI);
+
+	// Read the texels back through a host coherent buffer
+	Buffer readbackBuffer;
+	void* pMappedData;
+
+	createBuffer(
+		VMA_MEMORY_USAGE_CPU_ONLY,
+		dataSize,
+		VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		&readbackBuffer,
+		&pMappedData
+	);
+
+	beginCmdBuffer();
+
+	transitionImageLayout(cmdBuffer, texture.image, texture.lastImgLayout, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+
+	vkCmdCopyImageToBuffer(
+		cmdBuffer,
+		texture.image,
+		VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+		readbackBuffer.buffer,
+		static_cast<uint32_t>(copyRegionsBI.size()),
+		copyRegionsBI.data()
+	);
+
+	flushCmdBuffer();
+
+	size_t chunkCount = static_cast<size_t>((dataSize + COMPRESSED_HOST_TIER_CHUNK_SIZE - 1) / COMPRESSED_HOST_TIER_CHUNK_SIZE);
+	std::vector<std::vector<uint8_t>> chunks(chunkCount);
+
+	auto tStart = std::chrono::high_resolution_clock::now();
+
+	jobs->parallelFor(chunkCount, 1, [&](size_t i, size_t) {
+		size_t offset = i * COMPRESSED_HOST_TIER_CHUNK_SIZE;
+		size_t size = std::min<size_t>(COMPRESSED_HOST_TIER_CHUNK_SIZE, static_cast<size_t>(dataSize) - offset);
+
+		// Copy out of the uncached mapping once instead of reading it during matching
+		const uint8_t* pSrc = static_cast<const uint8_t*>(pMappedData) + offset;
+		std::vector<uint8_t> source(pSrc, pSrc + size);
+
+		chunks[i].resize(LzCodec::getMaxCompressedSize(size));
+		size_t chunkSize = LzCodec::compress(source.data(), size, chunks[i].data(), chunks[i].size());
+
+		if (chunkSize == 0 || chunkSize >= size)
+			chunks[i] = std::move(source);
+		else
+			chunks[i].resize(chunkSize);
+	});
+
+	packSeconds += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - tStart).count();
+	packedTotalBytes += dataSize;
+
+	texture.packed.data.clear();
+	texture.packed.chunkSizes.resize(chunkCount);
+	for (size_t i = 0; i < chunkCount; i++)
+	{
+		texture.packed.chunkSizes[i] = static_cast<uint32_t>(chunks[i].size());
+		texture.packed.data.insert(texture.packed.data.end(), chunks[i].begin(), chunks[i].end());
+	}
+	texture.packed.data.shrink_to_fit();
+
+	destroyBuffer(readbackBuffer);
+
+	// The device copy goes away, the view now samples the placeholder
+	texture.packed.dataSize = dataSize;
+	texture.packed.allocationSize = texture.allocation->GetSize();
+
+	totalDeviceUsage -= texture.allocation->GetSize();
+	deviceHeap.remove(&texture);
+	vmaDestroyImage(allocator, texture.image, texture.allocation);
+
+	if (!hasPlaceholder)
+		createPlaceholder();
+
+	texture.image = VK_NULL_HANDLE;
+	texture.allocation = nullptr;
+	texture.isPacked = true;
+	texture.isInGPU = false;
+	texture.lastImgLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	texture.isBoundToDesc = false;
+
+	vkDestroyImageView(device, texture.view, nullptr);
+	createImageView(placeholder.image, placeholder.format, &texture.view);
+
+	texture.updateDescriptorInfo();
+
+	totalHostUsage += texture.packed.data.size();
+	packedDataSize += dataSize;
+	packedSize += texture.packed.data.size();
+	hostHeap.push(&texture);
+}
+
+void ResourceManager::unpackTexture(Image & texture)
+{
+	TRACE_ZONE("ResourceManager::unpackTexture", "migration");
+
+	std::vector<VkBufferImageCopy> copyRegionsBI;
+	VkDeviceSize dataSize = getMipCopyRegions(texture, copyRegionsBI);
+
+	// Chunks are restored straight into the staging span
+	StagingSpan span;
+	beginUpload(dataSize, &span);
+
+	size_t chunkCount = texture.packed.chunkSizes.size();
+	std::vector<size_t> chunkOffsets(chunkCount, 0);
+	for (size_t i = 1; i < chunkCount; i++)
+		chunkOffsets[i] = chunkOffsets[i - 1] + texture.packed.chunkSizes[i - 1];
+
+	std::atomic<bool> isCorrupt(false);
+
+	auto tStart = std::chrono::high_resolution_clock::now();
+
+	jobs->parallelFor(chunkCount, 1, [&](size_t i, size_t) {
+		size_t offset = i * COMPRESSED_HOST_TIER_CHUNK_SIZE;
+		size_t size = std::min<size_t>(COMPRESSED_HOST_TIER_CHUNK_SIZE, static_cast<size_t>(dataSize) - offset);
+
+		const uint8_t* pSrc = texture.packed.data.data() + chunkOffsets[i];
+		uint8_t* pDst = static_cast<uint8_t*>(span.pData) + offset;
+
+		if (texture.packed.chunkSizes[i] == size) {
+			memcpy(pDst, pSrc, size);
+			return;
+		}
+
+		// Matches read back earlier output, keep that out of the write combined mapping
+		std::vector<uint8_t> chunk(size);
+		if (LzCodec::decompress(pSrc, texture.packed.chunkSizes[i], chunk.data(), size))
+			memcpy(pDst, chunk.data(), size);
+		else
+			isCorrupt = true;
+	});
+
+	unpackSeconds += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - tStart).count();
+	unpackedTotalBytes += dataSize;
+
+	if (isCorrupt) {
+		cancelUpload(span);
+		throw std::runtime_error("Packed texture data is corrupt.");
+	}
+
+	VkImageCreateInfo imageInfo = { VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO };
+	imageInfo.imageType = VK_IMAGE_TYPE_2D;
+	imageInfo.extent.width = texture.width;
+	imageInfo.extent.height = texture.height;
+	imageInfo.extent.depth = 1;
+	imageInfo.mipLevels = texture.mipLevels;
+	imageInfo.arrayLayers = 1;
+	imageInfo.format = texture.format;
+	imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	imageInfo.usage = texture.usage;
+	imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+	imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+
+	VmaAllocationCreateInfo allocCreateInfo = {};
+	allocCreateInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+
+	VK_CHECK_RESULT(vmaCreateImage(allocator, &imageInfo, &allocCreateInfo, &texture.image, &texture.allocation, nullptr));
+
+	beginCmdBuffer();
+
+	transitionImageLayout(cmdBuffer, texture.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+
+	vkCmdCopyBufferToImage(
+		cmdBuffer,
+		span.buffer.buffer,
+		texture.image,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		static_cast<uint32_t>(copyRegionsBI.size()),
+		copyRegionsBI.data()
+	);
+
+	transitionImageLayout(cmdBuffer, texture.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+
+	flushCmdBuffer();
+
+	cancelUpload(span);
+
+	totalHostUsage -= texture.packed.data.size();
+	packedDataSize -= texture.packed.dataSize;
+	packedSize -= texture.packed.data.size();
+	hostHeap.remove(&texture);
+
+	texture.isPacked = false;
+	texture.packed.data.clear();
+	texture.packed.data.shrink_to_fit();
+	texture.packed.chunkSizes.clear();
+
+	texture.isInGPU = true;
+	texture.lastImgLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	texture.isBoundToDesc = false;
+
+	vkDestroyImageView(device, texture.view, nullptr);
+	createImageView(texture.image, texture.format, &texture.view);
+
+	texture.updateDescriptorInfo();
+
+	totalDeviceUsage += texture.allocation->GetSize();
+	deviceHeap.push(&texture);
+}
+
+void ResourceManager::createPlaceholder()
+{
+	createImage(
+		VMA_MEMORY_USAGE_GPU_ONLY,
+		1,
+		1,
+		VK_FORMAT_R8G8B8A8_UNORM,
+		VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+		&placeholder,
+		nullptr
+	);
+
+	beginCmdBuffer();
+
+	transitionImageLayout(cmdBuffer, placeholder.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+
+	VkClearColorValue grey = { { 0.5f, 0.5f, 0.5f, 1.0f } };
+	VkImageSubresourceRange range = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+	vkCmdClearColorImage(cmdBuffer, placeholder.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &grey, 1, &range);
+
+	transitionImageLayout(cmdBuffer, placeholder.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+
+	flushCmdBuffer();
+
+	createImageView(placeholder.image, placeholder.format, &placeholder.view);
+
+	hasPlaceholder = true;
+}
+
+VkDeviceSize ResourceManager::getMipCopyRegions(const Image & image, std::vector<VkBufferImageCopy>& regions)
+{
+	// Mips back to back, 16 byte aligned for any texel block size
+	VkDeviceSize offset = 0;
+
+	regions.resize(image.mipLevels);
+	for (uint32_t i = 0; i < image.mipLevels; i++)
+	{
+		uint32_t width = std::max(image.width >> i, 1u);
+		uint32_t height = std::max(image.height >> i, 1u);
+
+		regions[i] = {};
+		regions[i].bufferOffset = offset;
+		regions[i].imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		regions[i].imageSubresource.mipLevel = i;
+		regions[i].imageSubresource.baseArrayLayer = 0;
+		regions[i].imageSubresource.layerCount = 1;
+		regions[i].imageOffset = { 0, 0, 0 };
+		regions[i].imageExtent = { width, height, 1 };
+
+		offset += (getImageDataSize(image.format, width, height) + 15) & ~static_cast<VkDeviceSize>(15);
+	}
+
+	return offset;
+}
+
 void ResourceManager::migrateBuffer(Buffer & buffer)
 {
 	// deprecate and should not be used this entire f(x)
 	if (buffer.buffer == NULL)
 		throw std::runtime_error("Destination texture param does not exist.");
 
+	countMigration(buffer);
+
 	VmaMemoryUsage memUsage;
 	if (buffer.isInGPU) {
 		memUsage = VMA_MEMORY_USAGE_CPU_TO_GPU;
@@ -645,21 +1189,41 @@ void ResourceManager::migrateResource(Resource & resource)
 
 }
 
+void ResourceManager::countMigration(Resource & resource)
+{
+	migratedBytes += resource.getMemorySize();
+	migrationCount++;
+	if (resource.isInGPU)
+		evictionCount++;
+}
+
+void ResourceManager::updateResourceUsers(Resource & resource, uint32_t userCount)
+{
+	// Re-insert so the heap order reflects the combined usage
+	ResourceHeap& heap = resource.isInGPU ? deviceHeap : hostHeap;
+	bool isInHeap = heap.remove(&resource);
+
+	resource.userCount = userCount;
+
+	if (isInHeap)
+		heap.push(&resource);
+}
+
 void ResourceManager::reduceMemoryBound(VkDeviceSize amount)
 {
 	pseudoDeviceLimit -= amount;
 	std::cout << "Now Max Device Memory is " << pseudoDeviceLimit << std::endl;
 
-	VkDeviceSize devLimit = static_cast<VkDeviceSize>(pseudoDeviceLimit * 0.9);
+	VkDeviceSize devLimit = getDeviceBudget();
 	while (!deviceHeap.empty() && devLimit < totalDeviceUsage)
 	{
 		migrateResource(*deviceHeap.top());
-		std::cout << "Migrate one time" << std::endl;
 	}
 	std::cout << "Device Heap size : " << deviceHeap.size() << std::endl;
 	std::cout << "Host Heap size : " << hostHeap.size() << std::endl;
 	std::cout << "Now Total Device Usage is " << totalDeviceUsage << std::endl;
 	std::cout << "Now Total Host Usage is " << totalHostUsage << std::endl;
+	printPackStats();
 }
 
 void ResourceManager::extendMemoryBound(VkDeviceSize amount)
@@ -667,10 +1231,10 @@ void ResourceManager::extendMemoryBound(VkDeviceSize amount)
 	pseudoDeviceLimit += amount;
 	std::cout << "Now Max Device Memory is " << pseudoDeviceLimit << std::endl;
 
-	VkDeviceSize devLimit = static_cast<VkDeviceSize>(pseudoDeviceLimit * 0.9);
+	VkDeviceSize devLimit = getDeviceBudget();
 	while (!hostHeap.empty()) 
 	{
-		if (hostHeap.top()->allocation->GetSize() + totalDeviceUsage > devLimit) break;
+		if (hostHeap.top()->getMemorySize() + totalDeviceUsage > devLimit) break;
 
 		migrateResource(*hostHeap.top());
 	}
@@ -678,6 +1242,15 @@ void ResourceManager::extendMemoryBound(VkDeviceSize amount)
 	std::cout << "Host Heap size : " << hostHeap.size() << std::endl;
 	std::cout << "Now Total Device Usage is " << totalDeviceUsage << std::endl;
 	std::cout << "Now Total Host Usage is " << totalHostUsage << std::endl;
+	printPackStats();
+}
+
+void ResourceManager::printPackStats()
+{
+	// The ratio covers the textures packed right now, the throughput every pack and unpack so far
+	std::cout << std::fixed << std::setprecision(2) << "Compressed host tier " << (compressedHostTier ? "on" : "off") << ": "
+		<< packedSize << " of " << packedDataSize << " bytes, ratio " << (packedSize > 0 ? static_cast<double>(packedDataSize) / packedSize : 0.0)
+		<< ", pack " << getPackThroughput() / 1000000.0 << " MB/s, unpack " << getUnpackThroughput() / 1000000.0 << " MB/s" << std::endl;
 }
 
 void ResourceManager::inspectHeap()
@@ -699,6 +1272,70 @@ VkDeviceSize ResourceManager::getRequiredImageSize(VkImageCreateInfo* info)
 	return memReqs.size;
 }
 
+VkImageTiling ResourceManager::getHostTiling(VkFormat format, VkImageUsageFlags usage, uint32_t mipLevels)
+{
+	// Linear tiling is only guaranteed for single mip images, otherwise stay optimal in host memory
+	VkFormatProperties formatProperties;
+	vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &formatProperties);
+	if (!(formatProperties.linearTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT))
+		return VK_IMAGE_TILING_OPTIMAL;
+
+	VkImageFormatProperties imageFormatProperties;
+	VkResult result = vkGetPhysicalDeviceImageFormatProperties(physicalDevice, format, VK_IMAGE_TYPE_2D, VK_IMAGE_TILING_LINEAR, usage, 0, &imageFormatProperties);
+	if (result != VK_SUCCESS || imageFormatProperties.maxMipLevels < mipLevels)
+		return VK_IMAGE_TILING_OPTIMAL;
+
+	return VK_IMAGE_TILING_LINEAR;
+}
+
+bool ResourceManager::isMigratableFormat(VkFormat format)
+{
+	// Texture formats produced by the scene loader
+	switch (format)
+	{
+	case VK_FORMAT_R8G8B8A8_UNORM:
+	case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
+	case VK_FORMAT_BC3_UNORM_BLOCK:
+	case VK_FORMAT_BC7_UNORM_BLOCK:
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool ResourceManager::isFormatSampleable(VkFormat format)
+{
+	if (format >= VK_FORMAT_BC1_RGB_UNORM_BLOCK && format <= VK_FORMAT_BC7_SRGB_BLOCK && !textureCompressionBC)
+		return false;
+
+	VkFormatProperties formatProperties;
+	vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &formatProperties);
+
+	return (formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT) != 0;
+}
+
+VkDeviceSize ResourceManager::getImageDataSize(VkFormat format, uint32_t width, uint32_t height)
+{
+	VkDeviceSize blocks = static_cast<VkDeviceSize>((width + 3) / 4) * ((height + 3) / 4);
+
+	switch (format)
+	{
+	case VK_FORMAT_R8_UNORM:
+		return static_cast<VkDeviceSize>(width) * height;
+	case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
+	case VK_FORMAT_BC1_RGBA_UNORM_BLOCK:
+	case VK_FORMAT_BC4_UNORM_BLOCK:
+		return blocks * 8;
+	case VK_FORMAT_BC2_UNORM_BLOCK:
+	case VK_FORMAT_BC3_UNORM_BLOCK:
+	case VK_FORMAT_BC5_UNORM_BLOCK:
+	case VK_FORMAT_BC7_UNORM_BLOCK:
+		return blocks * 16;
+	default:
+		return static_cast<VkDeviceSize>(width) * height * 4;
+	}
+}
+
 void ResourceManager::createCmdBuffer()
 {
 	VkCommandBufferAllocateInfo cmdBufAllocateInfo = {};
@@ -721,6 +1358,8 @@ void ResourceManager::beginCmdBuffer()
 
 void ResourceManager::flushCmdBuffer()
 {
+	TRACE_ZONE("ResourceManager::flushCmdBuffer", "wait");
+
 	VK_CHECK_RESULT(vkEndCommandBuffer(cmdBuffer));
 
 	vkQueueWaitIdle(cmdQueue);
@@ -744,14 +1383,31 @@ void ResourceManager::flushCmdBuffer()
 
 }
 
+VkDeviceSize Resource::getMemorySize()
+{
+	return allocation->GetSize();
+}
+
+VkDeviceSize Image::getMemorySize()
+{
+	// A packed image still needs its old allocation once promoted
+	return isPacked ? packed.allocationSize : allocation->GetSize();
+}
+
 bool gtResource::operator()(Resource * const &lhs, Resource * const &rhs)
 {
-	return lhs->allocation->GetSize() > rhs->allocation->GetSize();
+	if (lhs->getMemorySize() != rhs->getMemorySize())
+		return lhs->getMemorySize() > rhs->getMemorySize();
+
+	return isSharedFirst ? lhs->userCount < rhs->userCount : lhs->userCount > rhs->userCount;
 }
 
 bool ResourceHeap::remove(const Resource * value)
 {
-	if (value == this->top()) {
+	if (this->empty()) {
+		return false;
+	}
+	else if (value == this->top()) {
 		this->pop();
 		return true;
 	}
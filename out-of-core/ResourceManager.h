@@ -1,6 +1,7 @@
 #pragma once
 
 #include "VkUtils.h"
+#include "JobSystem.h"
 
 #include <vk_mem_alloc.h>
 
@@ -11,6 +12,16 @@
 
 #define PSUEDO_DEVICE_LIMIT 20 // in MBs
 
+// Demoted textures are kept LZ compressed in system memory instead of a host visible image
+// and decompressed in chunks on worker threads when promoted again
+// Optional, a packed texture samples the placeholder until it is promoted
+// Initial state, the C key toggles the tier at runtime
+#define COMPRESSED_HOST_TIER 0
+#define COMPRESSED_HOST_TIER_CHUNK_SIZE (256 * 1024)
+
+// Uploads reuse one persistently mapped staging buffer of this size, larger or overlapping ones get their own
+#define STAGING_BUFFER_SIZE (16 * 1024 * 1024)
+
 enum ResourceType {
 	RESOURCE_TYPE_BUFFER = 0,
 	RESOURCE_TYPE_IMAGE = 1
@@ -22,17 +33,28 @@ struct Resource {
 	bool isInGPU;
 	bool isMigratable;
 	bool isBoundToDesc;
+	// Number of users sharing this resource, a shared resource is still a single resident
+	uint32_t userCount = 1;
 
+	// Device memory the resource takes while resident, orders the heaps
+	virtual VkDeviceSize getMemorySize();
 	virtual void updateDescriptorInfo() = 0;
 };
 
+// Smallest first, equal sizes are ordered by their user count in the direction of the heap
 struct gtResource {
+	// Evicting prefers the least shared resource, promoting the most shared one
+	bool isSharedFirst;
+
+	inline gtResource(bool isSharedFirst = false) : isSharedFirst(isSharedFirst) {}
 	bool operator() (Resource * const &lhs, Resource * const &rhs);
 };
 
 class ResourceHeap : public std::priority_queue<Resource*, std::vector<Resource*>, gtResource>
 {
 public:
+	inline explicit ResourceHeap(bool isSharedFirst) : std::priority_queue<Resource*, std::vector<Resource*>, gtResource>(gtResource(isSharedFirst)) {}
+
 	bool remove(const Resource* value);
 	void checkMember();
 };
@@ -63,6 +85,21 @@ struct Image : Resource {
 	uint32_t width, height;
 	VkFormat format;
 	VkImageUsageFlags usage;
+	// Number of mips, createImage allocates this many levels
+	uint32_t mipLevels = 1;
+
+	// Set while the texels sit compressed in system memory, the view then samples the placeholder image
+	bool isPacked = false;
+	struct {
+		std::vector<uint8_t> data;
+		// Stored size of every chunk, a chunk as large as its source is kept raw
+		std::vector<uint32_t> chunkSizes;
+		// Tightly packed mip chain and the device allocation it is restored into
+		VkDeviceSize dataSize = 0;
+		VkDeviceSize allocationSize = 0;
+	} packed;
+
+	virtual VkDeviceSize getMemorySize();
 
 	inline Image() {
 		type = RESOURCE_TYPE_IMAGE;
@@ -77,33 +114,93 @@ struct Image : Resource {
 	};
 };
 
+// Mapped staging memory reserved with beginUpload, the caller produces the data in place
+// and hands the span to one of the upload calls, which releases it
+struct StagingSpan {
+	void* pData = nullptr;
+	VkDeviceSize size = 0;
+
+	Buffer buffer;
+	// Set while the span holds the manager's reusable staging buffer
+	bool isShared = false;
+};
+
+// Copy into a range of a device buffer, gathered by the caller and submitted together with updateBuffers
+struct BufferUpdate {
+	Buffer *buffer;
+	VkDeviceSize offset;
+	const void *pData;
+	VkDeviceSize size;
+};
+
+// Host buffer split into one slice per frame in flight and mapped for its whole lifetime
+// Draws pick their frame's slice with a dynamic offset, so the CPU fills the next slice
+// while the GPU still reads the others and nothing is mapped or unmapped per update
+struct UniformRing {
+	Buffer buffer;
+	uint8_t* pMappedData = nullptr;
+	// Data size rounded up to minUniformBufferOffsetAlignment
+	VkDeviceSize sliceSize = 0;
+	uint32_t sliceCount = 0;
+
+	inline void* getSlice(uint32_t slice) { return pMappedData + slice * sliceSize; }
+	inline uint32_t getDynamicOffset(uint32_t slice) { return static_cast<uint32_t>(slice * sliceSize); }
+};
+
 class ResourceManager
 {
 public:
-	ResourceManager(VkPhysicalDevice physicalDevice, VkDevice device, VkCommandPool cmdPool, VkQueue cmdQueue);
+	ResourceManager(VkPhysicalDevice physicalDevice, const VkPhysicalDeviceFeatures& enabledFeatures, VkDevice device, VkCommandPool cmdPool, VkQueue cmdQueue, JobSystem *jobs);
 	virtual ~ResourceManager();
 
 	void createBuffer(VmaMemoryUsage memUsage, VkDeviceSize size, VkBufferUsageFlags usage, Buffer *buffer, void **pPersistentlyMappedData);
-	void createBufferInDevice(VkDeviceSize size, VkBufferUsageFlags usage, Buffer *buffer, void* pData);
+	void createBufferInDevice(VkDeviceSize size, VkBufferUsageFlags usage, Buffer *buffer, const void* pData);
+	// Uninitialized device buffer, filled later with updateBuffer
+	void createBufferInDevice(VkDeviceSize size, VkBufferUsageFlags usage, Buffer *buffer);
 	void createBufferInHost(VkDeviceSize size, VkBufferUsageFlags usage, Buffer *buffer, void* pData);
 
 	void createImage(VmaMemoryUsage memUsage, uint32_t width, uint32_t height, VkFormat format, VkImageUsageFlags usage, Image *image, void **pPersistentlyMappedData);
-	void createImageInDevice(uint32_t width, uint32_t height, VkFormat format, VkImageUsageFlags usage, Image *image, void* pData, VkDeviceSize imageSize);
+	void createImageInDevice(uint32_t width, uint32_t height, VkFormat format, VkImageUsageFlags usage, Image *image, const void* pData, VkDeviceSize imageSize);
+	// pData holds the whole mip chain, pMipOffsets gives the byte offset of every level in it
+	void createImageInDevice(uint32_t width, uint32_t height, uint32_t mipLevels, VkFormat format, VkImageUsageFlags usage, Image *image, const void* pData, VkDeviceSize dataSize, const VkDeviceSize* pMipOffsets);
 	void createImageInHost(uint32_t width, uint32_t height, VkFormat format, VkImageUsageFlags usage, Image *image, void* pData);
 
+	// Reservation style uploads, decode or convert straight into span.pData instead of passing a finished copy
+	// The pData variants above are a memcpy into a span, every upload is complete when the call returns
+	void beginUpload(VkDeviceSize size, StagingSpan *span);
+	void cancelUpload(StagingSpan &span);
+	void createBufferInDevice(VkBufferUsageFlags usage, Buffer *buffer, StagingSpan &span);
+	void createImageInDevice(uint32_t width, uint32_t height, uint32_t mipLevels, VkFormat format, VkImageUsageFlags usage, Image *image, StagingSpan &span, const VkDeviceSize* pMipOffsets);
+	void updateBuffer(Buffer &buffer, VkDeviceSize offset, StagingSpan &span);
+	void updateImageMip(Image &image, uint32_t mipLevel, StagingSpan &span);
+
+	// Replace the texels of a single mip, lets levels be streamed in independently
+	void updateImageMip(Image &image, uint32_t mipLevel, const void* pData, VkDeviceSize size);
+	// Copy into a range of a device buffer through staging
+	void updateBuffer(Buffer &buffer, VkDeviceSize offset, const void* pData, VkDeviceSize size);
+	// Every copy goes through one staging span and a single submit, complete when the call returns
+	void updateBuffers(const std::vector<BufferUpdate>& updates);
+
 	void mapMemory(VmaAllocation allocation, void** ppData);
 	void unmapMemory(VmaAllocation allocation);
 
+	// Coherent memory, writes through getSlice are visible to the next submit without a flush
+	// The descriptor info covers one slice of dataSize bytes, bind it as VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC
+	void createUniformRing(VkDeviceSize dataSize, uint32_t sliceCount, UniformRing *ring);
+	void destroyUniformRing(UniformRing &ring);
+
 	void destroyBuffer(Buffer &buffer);
 	void destroyImage(Image &image);
 
 	void createImageView(VkImage image, VkFormat format, VkImageView* imageView);
-	void transitionImageLayout(VkCommandBuffer cmdBuffer, VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout);
+	void transitionImageLayout(VkCommandBuffer cmdBuffer, VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout, uint32_t baseMipLevel = 0, uint32_t levelCount = VK_REMAINING_MIP_LEVELS);
 
 	void migrateTexture(Image& texture);
 	void migrateBuffer(Buffer& buffer);
 	void migrateResource(Resource& resource);
 
+	void updateResourceUsers(Resource& resource, uint32_t userCount);
+
 	// my work
 	void reduceMemoryBound(VkDeviceSize amount);
 	void extendMemoryBound(VkDeviceSize amount);
@@ -114,14 +211,42 @@ public:
 	inline size_t getHostHeapSize() { return hostHeap.size(); }
 	void inspectHeap();
 
+	// Sampling support in optimal tiling, block compressed formats also need the device feature
+	bool isFormatSampleable(VkFormat format);
+	// Bytes of tightly packed texel data, block compressed formats count whole 4x4 blocks
+	static VkDeviceSize getImageDataSize(VkFormat format, uint32_t width, uint32_t height);
+
 	inline VkDeviceSize getDeviceUsage() { return totalDeviceUsage; }
 	inline VkDeviceSize getHostUsage() { return totalHostUsage; }
+	// Device usage the bound allows before resources are migrated to the host
+	inline VkDeviceSize getDeviceBudget() { return static_cast<VkDeviceSize>(pseudoDeviceLimit * 0.9); }
+	inline VkDeviceSize getMemoryBound() { return pseudoDeviceLimit; }
+
+	// Totals since creation, an eviction is a migration from the device to the host
+	inline VkDeviceSize getMigratedBytes() { return migratedBytes; }
+	inline uint32_t getMigrationCount() { return migrationCount; }
+	inline uint32_t getEvictionCount() { return evictionCount; }
+
+	// Packed textures are still promoted after the tier is turned off, only new demotions change
+	inline void setCompressedHostTier(bool enable) { compressedHostTier = enable; }
+	inline bool isCompressedHostTier() { return compressedHostTier; }
+	// Texel bytes held by the compressed host tier, before and after compression
+	inline VkDeviceSize getPackedDataSize() { return packedDataSize; }
+	inline VkDeviceSize getPackedSize() { return packedSize; }
+	// Texel bytes through the codec per second since creation, 0 before the first pack or unpack
+	inline double getPackThroughput() { return packSeconds > 0.0 ? packedTotalBytes / packSeconds : 0.0; }
+	inline double getUnpackThroughput() { return unpackSeconds > 0.0 ? unpackedTotalBytes / unpackSeconds : 0.0; }
+	void printPackStats();
 
 private:
 	VmaAllocator allocator;
 
+	// Packs and unpacks the chunks of the compressed host tier in parallel
+	JobSystem *jobs;
+
 	VkPhysicalDevice physicalDevice;
 	VkPhysicalDeviceMemoryProperties deviceMemoryProperties;
+	bool textureCompressionBC;
 
 	VkDevice device;
 
@@ -133,8 +258,34 @@ private:
 	ResourceHeap deviceHeap, hostHeap;
 	VkDeviceSize totalDeviceUsage = 0, totalHostUsage = 0, pseudoDeviceLimit = PSUEDO_DEVICE_LIMIT * 1000000;
 
+	VkDeviceSize migratedBytes = 0;
+	uint32_t migrationCount = 0, evictionCount = 0;
+	void countMigration(Resource& resource);
+
+	bool compressedHostTier = (COMPRESSED_HOST_TIER != 0);
+	VkDeviceSize packedDataSize = 0, packedSize = 0;
+	// Totals of the parallel compress and decompress passes, for the throughput
+	VkDeviceSize packedTotalBytes = 0, unpackedTotalBytes = 0;
+	double packSeconds = 0.0, unpackSeconds = 0.0;
+	// Bound in place of packed textures
+	Image placeholder;
+	bool hasPlaceholder = false;
+
+	// Reusable staging memory, created on first use and handed to one span at a time
+	Buffer stagingBuffer;
+	void* pStagingData = nullptr;
+	bool hasStagingBuffer = false;
+	bool isStagingInUse = false;
+
+	void packTexture(Image& texture);
+	void unpackTexture(Image& texture);
+	void createPlaceholder();
+	VkDeviceSize getMipCopyRegions(const Image& image, std::vector<VkBufferImageCopy>& regions);
+
 	bool checkAndMoveToGPU(VkMemoryRequirements& memReqs, VmaMemoryUsage& memUsage);
 	VkDeviceSize getRequiredImageSize(VkImageCreateInfo* info);
+	VkImageTiling getHostTiling(VkFormat format, VkImageUsageFlags usage, uint32_t mipLevels);
+	bool isMigratableFormat(VkFormat format);
 
 	void createCmdBuffer();
 	void beginCmdBuffer();
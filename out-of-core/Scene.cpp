@@ -1,190 +1,1500 @@
 #include "Scene.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+#include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/packing.hpp>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
 
-Scene::Scene(VkDevice device, VkQueue queue, ResourceManager *resMan) : device(device), queue(queue), resMan(resMan)
-{
-	createSampler(&defaultSampler);
-	resMan->createBufferInHost(sizeof(uniformData), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, &uniformBuffer, nullptr);
-	uniformBuffer.updateDescriptorInfo();
+// Texture cache helpers
+
+// Unify separators and resolve "." and ".." so that every spelling of a path maps to one cache entry
+static std::string canonicalPath(const std::string & path)
+{
+	std::string unified = path;
+	std::replace(unified.begin(), unified.end(), '\\', '/');
+
+	std::vector<std::string> parts;
+	size_t start = 0;
+	while (start <= unified.size())
+	{
+		size_t end = unified.find('/', start);
+		if (end == std::string::npos) end = unified.size();
+
+		std::string part = unified.substr(start, end - start);
+		if (part == "..")
+		{
+			if (!parts.empty() && parts.back() != "..")
+				parts.pop_back();
+			else
+				parts.push_back(part);
+		}
+		else if (!part.empty() && part != ".")
+		{
+			parts.push_back(part);
+		}
+
+		start = end + 1;
+	}
+
+	std::string result = (!unified.empty() && unified[0] == '/') ? "/" : "";
+	for (size_t i = 0; i < parts.size(); i++)
+	{
+		if (i > 0) result.append("/");
+		result.append(parts[i]);
+	}
+
+#ifdef _WIN32
+	// Windows paths are case insensitive
+	std::transform(result.begin(), result.end(), result.begin(), ::tolower);
+#endif
+
+	return result;
+}
+
+// Compact vertex helpers
+
+// Fold the unit sphere onto the [-1, 1] square, the lower hemisphere is mirrored over the diagonals
+static glm::vec2 encodeOctahedral(const glm::vec3& normal)
+{
+	float sum = std::abs(normal.x) + std::abs(normal.y) + std::abs(normal.z);
+	if (sum == 0.0f)
+		return glm::vec2(0.0f);
+
+	glm::vec2 p = glm::vec2(normal.x, normal.y) / sum;
+	if (normal.z < 0.0f)
+	{
+		glm::vec2 signs = glm::vec2(p.x >= 0.0f ? 1.0f : -1.0f, p.y >= 0.0f ? 1.0f : -1.0f);
+		p = (glm::vec2(1.0f) - glm::abs(glm::vec2(p.y, p.x))) * signs;
+	}
+
+	return p;
+}
+
+static uint16_t quantizeUnorm16(float value)
+{
+	return static_cast<uint16_t>(glm::round(glm::clamp(value, 0.0f, 1.0f) * 65535.0f));
+}
+
+// Part of the scene cache key next to the vertex layout
+static SceneCacheImportOptions getImportOptions()
+{
+	SceneCacheImportOptions options = {};
+	if (MESH_OPTIMIZATION_ENABLED)
+		options.flags |= SCENE_CACHE_OPTION_MESH_OPTIMIZATION;
+	if (MESH_OVERDRAW_OPTIMIZATION_ENABLED)
+		options.flags |= SCENE_CACHE_OPTION_OVERDRAW_OPTIMIZATION;
+	if (LOD_ENABLED)
+	{
+		options.flags |= SCENE_CACHE_OPTION_LOD;
+		options.lodMaxLevels = LOD_MAX_LEVELS;
+		options.lodMinTriangles = LOD_MIN_TRIANGLES;
+		options.lodReduction = LOD_REDUCTION;
+	}
+	return options;
+}
+
+// Meshes with fewer than 65536 vertices fit their local indices in 16 bits
+static VkIndexType getIndexType(uint32_t vertexCount)
+{
+	return vertexCount < 65536 ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32;
+}
+
+static uint32_t getIndexSize(VkIndexType indexType)
+{
+	return indexType == VK_INDEX_TYPE_UINT16 ? sizeof(uint16_t) : sizeof(uint32_t);
+}
+
+// Append 32 bit indices in the given type
+static void appendIndices(const uint32_t* pIndices, uint32_t indexCount, VkIndexType indexType, std::vector<uint8_t>& indexData)
+{
+	size_t offset = indexData.size();
+	indexData.resize(offset + static_cast<size_t>(indexCount) * getIndexSize(indexType));
+
+	if (indexType == VK_INDEX_TYPE_UINT16)
+	{
+		uint16_t* pDst = reinterpret_cast<uint16_t*>(indexData.data() + offset);
+		for (uint32_t i = 0; i < indexCount; i++)
+			pDst[i] = static_cast<uint16_t>(pIndices[i]);
+	}
+	else
+	{
+		memcpy(indexData.data() + offset, pIndices, static_cast<size_t>(indexCount) * sizeof(uint32_t));
+	}
+}
+
+Scene::Scene(VkDevice device, VkQueue queue, ResourceManager *resMan, JobSystem *jobs, uint32_t frameCount, const VkPhysicalDeviceFeatures& enabledFeatures) : device(device), queue(queue), resMan(resMan), jobs(jobs)
+{
+	createSampler(&defaultSampler);
+	pipelines.fill(VK_NULL_HANDLE);
+	constantColorBuffer.buffer = VK_NULL_HANDLE;
+	indirectBuffer.buffer = VK_NULL_HANDLE;
+	instanceBuffer.buffer = VK_NULL_HANDLE;
+	visibleInstanceBuffer.buffer = VK_NULL_HANDLE;
+	materialBuffer.buffer = VK_NULL_HANDLE;
+	pInstanceData = nullptr;
+	pVisibleInstanceData = nullptr;
+	isInstancesChanged = false;
+
+	useMultiDrawIndirect = (enabledFeatures.multiDrawIndirect == VK_TRUE);
+
+	useTextureCompression = TEXTURE_COMPRESSION_ENABLED &&
+		resMan->isFormatSampleable(VK_FORMAT_BC1_RGB_UNORM_BLOCK) &&
+		resMan->isFormatSampleable(VK_FORMAT_BC3_UNORM_BLOCK) &&
+		resMan->isFormatSampleable(VK_FORMAT_BC7_UNORM_BLOCK);
+
+	resMan->createUniformRing(sizeof(uniformData), frameCount, &uniformRing);
+
+	this->frameCount = frameCount;
+	drawSliceVersions.assign(frameCount, 0);
+
+}
+
+
+Scene::~Scene()
+{
+	delete vertexPool;
+	delete indexPool;
+	if (constantColorBuffer.buffer != VK_NULL_HANDLE)
+		resMan->destroyBuffer(constantColorBuffer);
+	if (indirectBuffer.buffer != VK_NULL_HANDLE)
+		resMan->destroyBuffer(indirectBuffer);
+	if (instanceBuffer.buffer != VK_NULL_HANDLE)
+		resMan->destroyBuffer(instanceBuffer);
+	if (visibleInstanceBuffer.buffer != VK_NULL_HANDLE)
+		resMan->destroyBuffer(visibleInstanceBuffer);
+	if (materialBuffer.buffer != VK_NULL_HANDLE)
+		resMan->destroyBuffer(materialBuffer);
+	for (auto& material : materials)
+	{
+		releaseTexture(material.diffuse);
+	}
+	vkDestroySampler(device, defaultSampler, nullptr);
+	vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+	vkDestroyDescriptorSetLayout(device, descriptorSetLayouts.material, nullptr);
+	vkDestroyDescriptorSetLayout(device, descriptorSetLayouts.scene, nullptr);
+	vkDestroyDescriptorPool(device, descriptorPool, nullptr);
+	resMan->destroyUniformRing(uniformRing);
+
+}
+
+void Scene::import(const std::string & filePath, VertexLayout layout)
+{
+	TRACE_ZONE("Scene::import", "load");
+
+	vertexLayout = layout;
+
+	auto tStart = std::chrono::high_resolution_clock::now();
+
+	assetPath = filePath.substr(0, filePath.find_last_of('/'));
+	assetPath.append("/");
+	std::cout << "Asset Path is : " << assetPath << std::endl;
+
+	// Warm load, skip Assimp entirely if the precompiled scene is still valid
+	std::string cachePath = filePath + SCENE_CACHE_EXTENSION;
+	bool isWarm = importFromCache(cachePath, filePath);
+
+	if (!isWarm)
+	{
+		Assimp::Importer importer;
+		const aiScene *scene = importer.ReadFile(filePath, aiProcess_Triangulate | aiProcess_GenNormals | aiProcess_FlipUVs);
+
+		if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode)
+		{
+			throw std::runtime_error("Cannot load input model!");
+		}
+
+		//processNode(scene->mRootNode);
+		std::vector<Vertex> vertices;
+		std::vector<uint32_t> indices;
+
+		extractMaterials(scene);
+		prepareMaterials();
+		if (MESH_EXTRACTION_BENCHMARK)
+			benchmarkExtraction(scene);
+		extractMeshes(scene, vertices, indices, MESH_EXTRACTION_THREADS);
+		if (MESH_OPTIMIZATION_ENABLED)
+			optimizeMeshes(vertices, indices);
+		buildMeshlets(vertices, indices);
+		if (LOD_ENABLED)
+			generateLods(vertices, indices);
+
+		uint32_t vertexCount = static_cast<uint32_t>(vertices.size());
+		const void* vertexData = vertices.data();
+
+		std::vector<uint8_t> compactData;
+		if (vertexLayout == VERTEX_LAYOUT_COMPACT)
+		{
+			compactVertices(vertices, compactData);
+			vertexData = compactData.data();
+		}
+		else
+		{
+			vertexStride = sizeof(Vertex);
+		}
+
+		std::cout << "Vertex data: " << static_cast<size_t>(vertexCount) * sizeof(Vertex) << " -> "
+			<< static_cast<size_t>(vertexCount) * vertexStride << " bytes (" << vertexStride << " byte stride)" << std::endl;
+
+		std::vector<uint8_t> indexData;
+		packIndices(indices, indexData);
+
+		std::cout << "Index data: " << indices.size() * sizeof(uint32_t) << " -> " << indexData.size() << " bytes" << std::endl;
+
+		writeCache(cachePath, filePath, vertexData, vertexCount, indexData.data(), static_cast<uint32_t>(indexData.size()));
+
+		// Pages are read from the mapped cache, the import result is kept only when the cache could not be written
+		if (geometryCache.open(cachePath, filePath, vertexLayout, getImportOptions()))
+		{
+			pVertexData = static_cast<const uint8_t*>(geometryCache.getVertexData());
+			pIndexData = static_cast<const uint8_t*>(geometryCache.getIndexData());
+			pLodIndexData = static_cast<const uint8_t*>(geometryCache.getLodIndexData());
+			std::vector<uint8_t>().swap(lodIndexData);
+		}
+		else
+		{
+			pLodIndexData = lodIndexData.data();
+			const uint8_t* pVertexBytes = static_cast<const uint8_t*>(vertexData);
+			hostVertexData.assign(pVertexBytes, pVertexBytes + static_cast<size_t>(vertexCount) * vertexStride);
+			hostIndexData = std::move(indexData);
+			pVertexData = hostVertexData.data();
+			pIndexData = hostIndexData.data();
+		}
+	}
+
+	createGeometryPools();
+
+	if (!meshlets.empty())
+		createIndirectBuffer();
+
+	createInstanceBuffers();
+
+	auto tEnd = std::chrono::high_resolution_clock::now();
+	auto tDiff = std::chrono::duration<double, std::milli>(tEnd - tStart).count();
+
+	std::cout << (isWarm ? "Warm" : "Cold") << " load of \"" << filePath << "\" took " << tDiff << " ms" << std::endl;
+}
+
+void Scene::render(VkCommandBuffer cmdBuffer, uint32_t frame)
+{
+	render(cmdBuffer, frame, 0, getMeshCount());
+}
+
+void Scene::render(VkCommandBuffer cmdBuffer, uint32_t frame, uint32_t firstMesh, uint32_t meshCount)
+{
+	// Nothing to draw without meshlets
+	if (indirectBuffer.buffer == VK_NULL_HANDLE)
+		return;
+
+	VkDeviceSize offsets[1] = { 0 };
+
+	// Every mesh reads from the geometry pools, the indirect draws carry the page offsets
+	// so pages can move without recording the command buffers again
+	VkBuffer vertexPoolBuffer = vertexPool->getBuffer();
+	vkCmdBindVertexBuffers(cmdBuffer, 0, 1, &vertexPoolBuffer, offsets);
+	if (constantColorBuffer.buffer != VK_NULL_HANDLE)
+		vkCmdBindVertexBuffers(cmdBuffer, 1, 1, &constantColorBuffer.buffer, offsets);
+
+	// The index pool is rebound only when the index type changes between meshes
+	VkIndexType boundIndexType = VK_INDEX_TYPE_MAX_ENUM;
+
+	uint32_t uniformOffset = uniformRing.getDynamicOffset(frame);
+
+	// Slices of the frame in the indirect and visible instance buffers
+	VkDeviceSize indirectBase = static_cast<VkDeviceSize>(frame) * drawCommands.size() * sizeof(VkDrawIndexedIndirectCommand);
+	uint32_t instanceSliceBase = frame * static_cast<uint32_t>(meshes.size()) * SCENE_MAX_INSTANCES;
+
+	for (size_t i = firstMesh; i < firstMesh + meshCount; i++)
+	{
+		// We will be using multiple descriptor sets for rendering
+		// In GLSL the selection is done via the set and binding keywords
+		// VS: layout (set = 0, binding = 0) uniform UBO;
+		// FS: layout (set = 1, binding = 0) uniform sampler2D samplerColorMap;
+
+		std::array<VkDescriptorSet, 2> descriptorSets;
+		// Set 0: Scene descriptor set containing global matrices
+		descriptorSets[0] = descriptorSetScene;
+		// Set 1: Per-Material descriptor set containing bound images
+		descriptorSets[1] = meshes[i].material->descriptorSet;
+
+		vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, *meshes[i].material->pipeline);
+		vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, static_cast<uint32_t>(descriptorSets.size()), descriptorSets.data(), 1, &uniformOffset);
+
+		if (meshes[i].indexType != boundIndexType)
+		{
+			vkCmdBindIndexBuffer(cmdBuffer, indexPool->getBuffer(), 0, meshes[i].indexType);
+			boundIndexType = meshes[i].indexType;
+		}
+
+		// Pass material properies via push constants
+		vkCmdPushConstants(
+			cmdBuffer,
+			pipelineLayout,
+			VK_SHADER_STAGE_FRAGMENT_BIT,
+			0,
+			sizeof(MaterialProperties),
+			&meshes[i].material->properties);
+
+		// Pass the position dequantization of the mesh
+		vkCmdPushConstants(
+			cmdBuffer,
+			pipelineLayout,
+			VK_SHADER_STAGE_VERTEX_BIT,
+			MESH_BOUNDS_PUSH_OFFSET,
+			sizeof(meshes[i].bounds),
+			&meshes[i].bounds);
+
+		// The visible instance ids of a mesh start at a fixed slot per mesh
+		uint32_t instanceBase = instanceSliceBase + static_cast<uint32_t>(i) * SCENE_MAX_INSTANCES;
+		vkCmdPushConstants(
+			cmdBuffer,
+			pipelineLayout,
+			VK_SHADER_STAGE_VERTEX_BIT,
+			MESH_INSTANCE_PUSH_OFFSET,
+			sizeof(instanceBase),
+			&instanceBase);
+
+		// Meshlets of the mesh, culled slots are empty draws
+		VkDeviceSize offset = indirectBase + static_cast<VkDeviceSize>(meshes[i].meshletBase) * sizeof(VkDrawIndexedIndirectCommand);
+		if (useMultiDrawIndirect)
+		{
+			vkCmdDrawIndexedIndirect(cmdBuffer, indirectBuffer.buffer, offset, meshes[i].meshletCount, sizeof(VkDrawIndexedIndirectCommand));
+		}
+		else
+		{
+			for (uint32_t m = 0; m < meshes[i].meshletCount; m++)
+				vkCmdDrawIndexedIndirect(cmdBuffer, indirectBuffer.buffer, offset + m * sizeof(VkDrawIndexedIndirectCommand), 1, sizeof(VkDrawIndexedIndirectCommand));
+		}
+
+		// Coarse level of the mesh, an empty draw while the meshlets are drawn
+		if (meshes[i].lodCount > 0)
+		{
+			VkDeviceSize lodOffset = indirectBase + static_cast<VkDeviceSize>(meshlets.size() + i) * sizeof(VkDrawIndexedIndirectCommand);
+			vkCmdDrawIndexedIndirect(cmdBuffer, indirectBuffer.buffer, lodOffset, 1, sizeof(VkDrawIndexedIndirectCommand));
+		}
+	}
+
+}
+
+bool Scene::rebindTexture()
+{
+	bool needRebind = false;
+	// Material descriptor sets
+	// Textures are shared, so only mark them as bound once every material using them has been updated
+	for (size_t i = 0; i < materials.size(); i++)
+	{
+		if (materials[i].diffuse->image.isBoundToDesc) continue;
+
+		needRebind = true;
+
+		std::vector<VkWriteDescriptorSet> descriptorWrites;
+		descriptorWrites.resize(1);
+
+		// Binding 0: Diffuse texture // this will be executed again when migration process complete
+		descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		descriptorWrites[0].dstSet = materials[i].descriptorSet;
+		descriptorWrites[0].dstBinding = 0;
+		descriptorWrites[0].dstArrayElement = 0;
+		descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		descriptorWrites[0].descriptorCount = 1;
+		descriptorWrites[0].pImageInfo = &materials[i].diffuse->image.descInfo;
+
+		vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, NULL);
+	}
+
+	for (size_t i = 0; i < materials.size(); i++)
+		materials[i].diffuse->image.isBoundToDesc = true;
+
+	return needRebind;
+}
+
+void Scene::writeUniforms(uint32_t frame)
+{
+	memcpy(uniformRing.getSlice(frame), &uniformData, sizeof(uniformData));
+}
+
+void Scene::writeDraws(uint32_t frame)
+{
+	if (indirectBuffer.buffer == VK_NULL_HANDLE || drawSliceVersions[frame] == drawVersion)
+		return;
+
+	TRACE_ZONE("Scene::writeDraws", "frame");
+
+	memcpy(pIndirectData + frame * drawCommands.size(), drawCommands.data(), drawCommands.size() * sizeof(VkDrawIndexedIndirectCommand));
+
+	// Only the ids the draws reach, every mesh starts at a fixed slot
+	uint32_t *pSlice = pVisibleInstanceData + static_cast<size_t>(frame) * meshes.size() * SCENE_MAX_INSTANCES;
+	for (size_t i = 0; i < meshes.size(); i++)
+		memcpy(pSlice + i * SCENE_MAX_INSTANCES, visibleInstanceIds.data() + i * SCENE_MAX_INSTANCES, meshes[i].visibleInstanceCount * sizeof(uint32_t));
+
+	drawSliceVersions[frame] = drawVersion;
+}
+
+void Scene::update(float viewportHeight, bool isViewChanged)
+{
+	TRACE_ZONE("Scene::update", "frame");
+
+	frameIndex++;
+	isQueueIdle = false;
+
+	if (isViewChanged)
+		updateFrustum();
+	if (isViewChanged || isInstancesChanged)
+		cullInstances();
+
+	bool isLodChanged = selectLods(viewportHeight);
+	streamGeometry();
+
+	// Page uploads and evictions move draws even when the selection stays
+	if (!isLodChanged && !isViewChanged && !isResidencyChanged && !isInstancesChanged)
+		return;
+	isResidencyChanged = false;
+
+	// Frames in flight read the draws from their own slices, only the shared instance transforms need the queue drained
+	if (isInstancesChanged)
+	{
+		waitQueueIdle();
+		memcpy(pInstanceData, instances.data(), instances.size() * sizeof(InstanceData));
+		isInstancesChanged = false;
+	}
+
+	cullClusters();
+}
+
+std::vector<uint32_t> Scene::getMaterialFeatureSets()
+{
+	std::vector<uint32_t> featureSets;
+	for (auto& material : materials)
+	{
+		if (std::find(featureSets.begin(), featureSets.end(), material.features) == featureSets.end())
+			featureSets.push_back(material.features);
+	}
+	return featureSets;
+}
+
+uint32_t Scene::addInstance(const glm::mat4 & model, uint32_t materialIndex)
+{
+	if (instances.size() >= SCENE_MAX_INSTANCES)
+		throw std::runtime_error("Scene instance limit reached.");
+	if (materialIndex != SCENE_INSTANCE_MATERIAL_NONE && materialIndex >= materials.size())
+		throw std::invalid_argument("f(x):addInstance material index out of range.");
+
+	InstanceData instance = {};
+	instance.model = model;
+	instance.materialIndex = materialIndex;
+	instances.push_back(instance);
+
+	isInstancesChanged = true;
+	return static_cast<uint32_t>(instances.size() - 1);
+}
+
+void Scene::setInstanceTransform(uint32_t instance, const glm::mat4 & model)
+{
+	instances[instance].model = model;
+	isInstancesChanged = true;
+}
+
+void Scene::updateFrustum()
+{
+	// Bounds are in model space, every instance moves its copy of them into world space
+	glm::mat4 viewProjection = uniformData.projection * uniformData.view;
+	cameraPosition = glm::vec3(glm::inverse(uniformData.view)[3]);
+
+	// Gribb-Hartmann planes, the near plane is taken from -w <= z which also holds for a [0, 1] depth range
+	glm::mat4 rows = glm::transpose(viewProjection);
+	frustumPlanes = {
+		rows[3] + rows[0],
+		rows[3] - rows[0],
+		rows[3] + rows[1],
+		rows[3] - rows[1],
+		rows[3] + rows[2],
+		rows[3] - rows[2]
+	};
+	for (auto& plane : frustumPlanes)
+		plane /= glm::length(glm::vec3(plane));
+}
+
+bool Scene::isSphereVisible(const std::array<glm::vec4, 6>& planes, const glm::vec3 & center, float radius)
+{
+	if (!CLUSTER_CULLING_ENABLED)
+		return true;
+
+	for (auto& plane : planes)
+		if (glm::dot(glm::vec3(plane), center) + plane.w < -radius)
+			return false;
+
+	return true;
+}
+
+void Scene::cullInstances()
+{
+	// The scale bounds how far a transformed sphere can grow
+	std::vector<float> scales(instances.size());
+	for (size_t j = 0; j < instances.size(); j++)
+	{
+		const glm::mat4& model = instances[j].model;
+		scales[j] = std::sqrt(std::max(std::max(glm::dot(glm::vec3(model[0]), glm::vec3(model[0])),
+			glm::dot(glm::vec3(model[1]), glm::vec3(model[1]))),
+			glm::dot(glm::vec3(model[2]), glm::vec3(model[2]))));
+	}
+
+	jobs->parallelFor(meshes.size(), SCENE_JOB_GRAIN_SIZE, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+		{
+			Mesh& mesh = meshes[i];
+			uint32_t* pIds = visibleInstanceIds.data() + i * SCENE_MAX_INSTANCES;
+
+			mesh.visibleInstanceCount = 0;
+			mesh.detailFactor = 0.0f;
+
+			for (uint32_t j = 0; j < instances.size(); j++)
+			{
+				glm::vec3 center = glm::vec3(instances[j].model * glm::vec4(glm::vec3(mesh.boundingSphere), 1.0f));
+				float radius = mesh.boundingSphere.w * scales[j];
+
+				if (!isSphereVisible(frustumPlanes, center, radius))
+					continue;
+
+				pIds[mesh.visibleInstanceCount++] = j;
+
+				// Distance to the nearest point of the sphere, errors grow with the instance scale
+				float distance = glm::length(center - cameraPosition) - radius;
+				mesh.detailFactor = std::max(mesh.detailFactor, scales[j] / std::max(distance, 1e-4f));
+			}
+
+			mesh.isVisible = mesh.visibleInstanceCount > 0;
+		}
+	});
+}
+
+bool Scene::selectLods(float viewportHeight)
+{
+	// Pixels per unit at distance 1, the clip correction flips the sign of the y scale
+	float projectionScale = std::abs(uniformData.projection[1][1]) * 0.5f * viewportHeight;
+
+	std::atomic<bool> isChanged(false);
+
+	jobs->parallelFor(meshes.size(), SCENE_JOB_GRAIN_SIZE, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+		{
+			Mesh& mesh = meshes[i];
+			if (mesh.lodCount == 0)
+				continue;
+
+			// The instance needing the most detail decides for all copies of the mesh
+			float pixelsPerUnit = projectionScale * mesh.detailFactor;
+
+			uint32_t level = 0;
+			while (level < mesh.lodCount && lods[mesh.lodBase + level].error * pixelsPerUnit <= LOD_ERROR_THRESHOLD)
+				level++;
+
+			if (level != mesh.selectedLod)
+			{
+				mesh.selectedLod = level;
+				isChanged = true;
+			}
+		}
+	});
+
+	return isChanged;
+}
+
+void Scene::streamGeometry()
+{
+	TRACE_ZONE("Scene::streamGeometry", "upload");
+
+	// Meshes whose nearest visible instance appears largest first
+	std::vector<std::pair<float, Mesh*>> candidates;
+	for (auto& mesh : meshes)
+	{
+		if (!mesh.isVisible || mesh.indexCount == 0)
+			continue;
+
+		candidates.push_back(std::make_pair(mesh.detailFactor, &mesh));
+	}
+
+	std::sort(candidates.begin(), candidates.end(), [](const std::pair<float, Mesh*>& a, const std::pair<float, Mesh*>& b) {
+		return a.first > b.first;
+	});
+
+	VkDeviceSize uploadedSize = 0;
+	pendingPageCount = 0;
+	auto request = [&](GeometryPage& page, GeometryPool* pool, const uint8_t* pSource, VkDeviceSize alignment) {
+		page.lastUsedFrame = frameIndex;
+		if (page.isResident())
+			return true;
+
+		// The first page of a frame always goes through, so pages larger than the budget still land
+		if ((uploadedSize > 0 && uploadedSize + page.dataSize > GEOMETRY_STREAMING_BUDGET) || !makeResident(page, pool, pSource, alignment))
+		{
+			pendingPageCount++;
+			return false;
+		}
+
+		uploadedSize += page.dataSize;
+		return true;
+	};
+
+	for (auto& candidate : candidates)
+	{
+		Mesh& mesh = *candidate.second;
+
+		// Nothing of the mesh can be drawn without its vertices, their offset has to be a whole vertex
+		if (!request(mesh.vertexPage, vertexPool, pVertexData, vertexStride))
+			continue;
+
+		// The coarsest level is small and stands in while the selected one is missing
+		// Index offsets are multiples of the index size, 4 covers both types
+		if (mesh.lodCount > 0)
+			request(lods[mesh.lodBase + mesh.lodCount - 1].page, indexPool, pLodIndexData, sizeof(uint32_t));
+
+		if (mesh.selectedLod == 0)
+			request(mesh.indexPage, indexPool, pIndexData, sizeof(uint32_t));
+		else
+			request(lods[mesh.lodBase + mesh.selectedLod - 1].page, indexPool, pLodIndexData, sizeof(uint32_t));
+	}
+
+	// Pages not drawn for a while give their pool memory back
+	auto evictStale = [&](GeometryPage& page, GeometryPool* pool) {
+		if (page.isResident() && frameIndex - page.lastUsedFrame > GEOMETRY_EVICT_FRAMES)
+			evict(page, pool);
+	};
+
+	for (auto& mesh : meshes)
+	{
+		evictStale(mesh.vertexPage, vertexPool);
+		evictStale(mesh.indexPage, indexPool);
+	}
+	for (auto& lod : lods)
+		evictStale(lod.page, indexPool);
+
+	streamedBytes += uploadedSize;
+
+	// Reused ranges may have been freed by pages that frames in flight still read
+	if (!pageUploads.empty())
+	{
+		waitQueueIdle();
+		resMan->updateBuffers(pageUploads);
+		pageUploads.clear();
+	}
+}
+
+bool Scene::makeResident(GeometryPage & page, GeometryPool * pool, const uint8_t * pSource, VkDeviceSize alignment)
+{
+	if (page.isResident())
+		return true;
+
+	VkDeviceSize offset = pool->allocate(page.dataSize, alignment);
+
+	// Make room by evicting the least recently used pages of the pool not drawn this frame
+	while (offset == GEOMETRY_POOL_INVALID_OFFSET)
+	{
+		GeometryPage* victim = nullptr;
+		auto consider = [&](GeometryPage& candidate) {
+			if (!candidate.isResident() || candidate.lastUsedFrame == frameIndex)
+				return;
+			if (victim == nullptr || candidate.lastUsedFrame < victim->lastUsedFrame)
+				victim = &candidate;
+		};
+
+		for (auto& mesh : meshes)
+			consider(pool == vertexPool ? mesh.vertexPage : mesh.indexPage);
+		if (pool == indexPool)
+		{
+			for (auto& lod : lods)
+				consider(lod.page);
+		}
+
+		if (victim == nullptr)
+			return false;
+
+		evict(*victim, pool);
+		offset = pool->allocate(page.dataSize, alignment);
+	}
+
+	pool->upload(offset, pSource + page.dataOffset, page.dataSize, pageUploads);
+	page.poolOffset = offset;
+	isResidencyChanged = true;
+
+	return true;
+}
+
+void Scene::evict(GeometryPage & page, GeometryPool * pool)
+{
+	// The stale draws keep reading valid memory until they are rewritten, the range is only reused after a queue wait
+	pool->free(page.poolOffset, page.dataSize);
+	page.poolOffset = GEOMETRY_POOL_INVALID_OFFSET;
+	isResidencyChanged = true;
+	evictedPageCount++;
+}
+
+void Scene::waitQueueIdle()
+{
+	if (isQueueIdle)
+		return;
+
+	TRACE_ZONE("Scene::waitQueueIdle", "wait");
+
+	// Frames in flight may still read the pools and the instance transforms
+	vkQueueWaitIdle(queue);
+	isQueueIdle = true;
+}
+
+bool Scene::findDrawableLod(const Mesh & mesh, uint32_t & level) const
+{
+	if (!mesh.vertexPage.isResident())
+		return false;
+
+	auto isLevelResident = [&](uint32_t l) {
+		return l == 0 ? mesh.indexPage.isResident() : lods[mesh.lodBase + l - 1].page.isResident();
+	};
+
+	// The selected level, else the nearest resident one with coarser levels first
+	for (uint32_t d = 0; d <= mesh.lodCount; d++)
+	{
+		if (mesh.selectedLod + d <= mesh.lodCount && isLevelResident(mesh.selectedLod + d))
+		{
+			level = mesh.selectedLod + d;
+			return true;
+		}
+		if (d > 0 && d <= mesh.selectedLod && isLevelResident(mesh.selectedLod - d))
+		{
+			level = mesh.selectedLod - d;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void Scene::cullClusters()
+{
+	if (indirectBuffer.buffer == VK_NULL_HANDLE)
+		return;
+
+	VkDrawIndexedIndirectCommand* pCommands = drawCommands.data();
+
+	// Every mesh writes only its own slots, so ranges of meshes are culled in parallel
+	std::atomic<uint32_t> visibleClusters(0);
+
+	jobs->parallelFor(meshes.size(), SCENE_JOB_GRAIN_SIZE, [&](size_t begin, size_t end) {
+		uint32_t visibleCount = 0;
+
+		for (size_t i = begin; i < end; i++)
+		{
+			const Mesh& mesh = meshes[i];
+
+			// Visible meshlets are packed to the front of the mesh's slots
+			uint32_t slot = mesh.meshletBase;
+
+			// Meshes whose pages have not landed yet are skipped or drawn from another resident level
+			uint32_t level = 0;
+			bool isDrawable = mesh.isVisible && findDrawableLod(mesh, level);
+			int32_t vertexOffset = isDrawable ? static_cast<int32_t>(mesh.vertexPage.poolOffset / vertexStride) : 0;
+			VkDeviceSize indexSize = getIndexSize(mesh.indexType);
+
+			// Meshlet bounds are in model space, with a single visible instance the frustum and camera move into
+			// its space and meshlets are culled, copies seen from several places draw all meshlets
+			bool isMeshletCulling = isDrawable && mesh.visibleInstanceCount == 1;
+			std::array<glm::vec4, 6> localPlanes;
+			glm::vec3 localCamera;
+			if (isMeshletCulling)
+			{
+				const glm::mat4& model = instances[visibleInstanceIds[i * SCENE_MAX_INSTANCES]].model;
+				glm::mat4 transposed = glm::transpose(model);
+				for (size_t p = 0; p < frustumPlanes.size(); p++)
+				{
+					localPlanes[p] = transposed * frustumPlanes[p];
+					localPlanes[p] /= glm::length(glm::vec3(localPlanes[p]));
+				}
+				localCamera = glm::vec3(glm::inverse(model) * glm::vec4(cameraPosition, 1.0f));
+			}
+
+			// A coarse level replaces all meshlets of the mesh with one draw
+			VkDrawIndexedIndirectCommand lodCommand = {};
+			if (isDrawable && level > 0)
+			{
+				const MeshLod& lod = lods[mesh.lodBase + level - 1];
+				lodCommand.indexCount = lod.indexCount;
+				lodCommand.instanceCount = mesh.visibleInstanceCount;
+				lodCommand.firstIndex = static_cast<uint32_t>(lod.page.poolOffset / indexSize);
+				lodCommand.vertexOffset = vertexOffset;
+			}
+
+			if (mesh.lodCount > 0)
+				pCommands[meshlets.size() + i] = lodCommand;
+
+			for (uint32_t m = mesh.meshletBase; m < mesh.meshletBase + mesh.meshletCount && isDrawable && level == 0; m++)
+			{
+				const Meshlet& meshlet = meshlets[m];
+				glm::vec3 center = glm::make_vec3(meshlet.center);
+
+				bool isVisible = true;
+				if (isMeshletCulling)
+				{
+					isVisible = isSphereVisible(localPlanes, center, meshlet.radius);
+
+					// Every triangle of the meshlet faces away from the camera
+					glm::vec3 toCenter = center - localCamera;
+					if (CLUSTER_CULLING_ENABLED && isVisible && glm::dot(toCenter, glm::make_vec3(meshlet.coneAxis)) >= meshlet.coneCutoff * glm::length(toCenter) + meshlet.radius)
+						isVisible = false;
+				}
+
+				if (!isVisible)
+					continue;
+
+				VkDrawIndexedIndirectCommand& command = pCommands[slot++];
+				command.indexCount = meshlet.triangleCount * 3;
+				command.instanceCount = mesh.visibleInstanceCount;
+				command.firstIndex = static_cast<uint32_t>(mesh.indexPage.poolOffset / indexSize) + meshlet.indexOffset;
+				command.vertexOffset = vertexOffset;
+				command.firstInstance = 0;
+			}
+
+			visibleCount += slot - mesh.meshletBase;
+
+			for (; slot < mesh.meshletBase + mesh.meshletCount; slot++)
+				pCommands[slot] = {};
+		}
+
+		visibleClusters += visibleCount;
+	});
+
+	visibleClusterCount = visibleClusters;
+
+	// Every slice picks the new draws up in writeDraws before its frame is submitted
+	drawVersion++;
+}
+
+void Scene::getVertexInputDescriptions(std::vector<VkVertexInputBindingDescription>& bindings, std::vector<VkVertexInputAttributeDescription>& attributes)
+{
+	if (vertexLayout == VERTEX_LAYOUT_COMPACT)
+	{
+		auto bindingDesc = CompactVertex::getBindingDescriptions(hasVertexColor);
+		auto attribDesc = CompactVertex::getAttributeDescriptions(hasVertexColor);
+		// The constant color binding is only needed when the color is cut from the stride
+		bindings.assign(bindingDesc.begin(), hasVertexColor ? bindingDesc.begin() + 1 : bindingDesc.end());
+		attributes.assign(attribDesc.begin(), attribDesc.end());
+	}
+	else
+	{
+		auto bindingDesc = Vertex::getBindingDescriptions();
+		auto attribDesc = Vertex::getAttributeDescriptions();
+		bindings.assign(bindingDesc.begin(), bindingDesc.end());
+		attributes.assign(attribDesc.begin(), attribDesc.end());
+	}
+}
+
+void Scene::extractMeshes(const aiScene *scene, std::vector<Vertex>& vertices, std::vector<uint32_t>& indices, uint32_t threadCount)
+{
+	auto tStart = std::chrono::high_resolution_clock::now();
+
+	// First pass, the ranges of the meshes are a prefix sum over their counts
+	meshes.resize(scene->mNumMeshes);
+	hasVertexColor = false;
+
+	uint32_t vertexCount = 0;
+	uint32_t indexCount = 0;
+
+	for (uint32_t i = 0; i < meshes.size(); i++)
+	{
+		aiMesh *aMesh = scene->mMeshes[i];
+
+		meshes[i].material = &materials[aMesh->mMaterialIndex];
+		meshes[i].indexBase = indexCount;
+		meshes[i].indexCount = aMesh->mNumFaces * 3;
+		meshes[i].vertexBase = vertexCount;
+		meshes[i].vertexCount = aMesh->mNumVertices;
+
+		hasVertexColor = hasVertexColor || aMesh->HasVertexColors(0);
+
+		vertexCount += meshes[i].vertexCount;
+		indexCount += meshes[i].indexCount;
+	}
+
+	vertices.resize(vertexCount);
+	indices.resize(indexCount);
+
+	// Second pass, chunks of vertices and faces are converted in parallel straight into their final place
+	// Chunks keep a single large mesh from running on one thread
+	struct ExtractionChunk {
+		uint32_t meshIndex;
+		uint32_t first;
+		uint32_t count;
+		bool isFaces;
+	};
+
+	std::vector<ExtractionChunk> chunks;
+	for (uint32_t i = 0; i < meshes.size(); i++)
+	{
+		aiMesh *aMesh = scene->mMeshes[i];
+		for (uint32_t v = 0; v < aMesh->mNumVertices; v += MESH_EXTRACTION_CHUNK_SIZE)
+			chunks.push_back({ i, v, std::min<uint32_t>(MESH_EXTRACTION_CHUNK_SIZE, aMesh->mNumVertices - v), false });
+		for (uint32_t f = 0; f < aMesh->mNumFaces; f += MESH_EXTRACTION_CHUNK_SIZE)
+			chunks.push_back({ i, f, std::min<uint32_t>(MESH_EXTRACTION_CHUNK_SIZE, aMesh->mNumFaces - f), true });
+	}
+
+	auto extractChunk = [&](const ExtractionChunk& chunk) {
+		const aiMesh *aMesh = scene->mMeshes[chunk.meshIndex];
+		const Mesh& mesh = meshes[chunk.meshIndex];
+
+		if (chunk.isFaces)
+		{
+			// Indices
+			uint32_t* pIndices = indices.data() + mesh.indexBase + chunk.first * 3;
+			for (uint32_t f = chunk.first; f < chunk.first + chunk.count; f++)
+			{
+				for (uint32_t j = 0; j < 3; j++)
+				{
+					*pIndices++ = aMesh->mFaces[f].mIndices[j];
+				}
+			}
+			return;
+		}
+
+		// Vertices
+		bool hasUV = aMesh->HasTextureCoords(0);
+		bool hasColor = aMesh->HasVertexColors(0);
+		bool hasNormals = aMesh->HasNormals();
+
+		Vertex* pVertices = vertices.data() + mesh.vertexBase;
+		for (uint32_t v = chunk.first; v < chunk.first + chunk.count; v++)
+		{
+			Vertex& vertex = pVertices[v];
+			vertex.pos = glm::vec3(aMesh->mVertices[v].x, aMesh->mVertices[v].y, aMesh->mVertices[v].z);
+			//vertex.pos.y = -vertex.pos.y;
+			vertex.uv = hasUV ? glm::vec2(aMesh->mTextureCoords[0][v].x, aMesh->mTextureCoords[0][v].y) : glm::vec2(0.0f);
+			vertex.normal = hasNormals ? glm::vec3(aMesh->mNormals[v].x, aMesh->mNormals[v].y, aMesh->mNormals[v].z) : glm::vec3(0.0f);
+			//vertex.normal.y = -vertex.normal.y;
+			vertex.color = hasColor ? glm::vec3(aMesh->mColors[0][v].r, aMesh->mColors[0][v].g, aMesh->mColors[0][v].b) : glm::vec3(1.0f);
+		}
+	};
+
+	uint32_t workerCount = jobs->parallelFor(chunks.size(), 1, [&](size_t c, size_t) {
+		extractChunk(chunks[c]);
+	}, threadCount);
+
+	auto tEnd = std::chrono::high_resolution_clock::now();
+
+	std::cout << "Extracted " << meshes.size() << " meshes, " << vertexCount << " vertices, " << indexCount / 3 << " faces in "
+		<< std::chrono::duration<double, std::milli>(tEnd - tStart).count() << " ms on " << workerCount << " threads" << std::endl;
+}
+
+void Scene::benchmarkExtraction(const aiScene * scene)
+{
+	uint32_t maxThreadCount = jobs->getThreadCount();
+
+	// Each run prints its own time, the scratch arrays are thrown away
+	for (uint32_t threadCount = 1; ; threadCount = std::min(threadCount * 2, maxThreadCount))
+	{
+		std::vector<Vertex> vertices;
+		std::vector<uint32_t> indices;
+		extractMeshes(scene, vertices, indices, threadCount);
+
+		if (threadCount == maxThreadCount)
+			break;
+	}
+}
+
+void Scene::optimizeMeshes(std::vector<Vertex>& vertices, std::vector<uint32_t>& indices)
+{
+	auto tStart = std::chrono::high_resolution_clock::now();
+
+	struct MeshStatistics {
+		VertexCacheStatistics before;
+		VertexCacheStatistics after;
+	};
+
+	std::vector<MeshStatistics> meshStatistics(meshes.size());
+	jobs->parallelFor(meshes.size(), 1, [&](size_t i, size_t) {
+		const Mesh& mesh = meshes[i];
+		uint32_t* pIndices = indices.data() + mesh.indexBase;
+		Vertex* pVertices = vertices.data() + mesh.vertexBase;
+
+		MeshStatistics statistics;
+		statistics.before = MeshOptimizer::analyzeVertexCache(pIndices, mesh.indexCount, mesh.vertexCount);
+
+		MeshOptimizer::optimizeVertexCache(pIndices, mesh.indexCount, mesh.vertexCount);
+		if (MESH_OVERDRAW_OPTIMIZATION_ENABLED)
+			MeshOptimizer::optimizeOverdraw(pIndices, mesh.indexCount, &pVertices[0].pos.x, sizeof(Vertex), mesh.vertexCount);
+
+		std::vector<uint32_t> remap;
+		MeshOptimizer::optimizeVertexFetch(pIndices, mesh.indexCount, mesh.vertexCount, remap);
+
+		std::vector<Vertex> reordered(mesh.vertexCount);
+		for (uint32_t v = 0; v < mesh.vertexCount; v++)
+			reordered[remap[v]] = pVertices[v];
+		std::copy(reordered.begin(), reordered.end(), pVertices);
+
+		statistics.after = MeshOptimizer::analyzeVertexCache(pIndices, mesh.indexCount, mesh.vertexCount);
+		meshStatistics[i] = statistics;
+	});
+
+	VertexCacheStatistics before, after;
+	for (auto& statistics : meshStatistics)
+	{
+		before.accumulate(statistics.before);
+		after.accumulate(statistics.after);
+	}
+
+	auto tEnd = std::chrono::high_resolution_clock::now();
+
+	std::cout << "Optimized " << meshes.size() << " meshes in " << std::chrono::duration<double, std::milli>(tEnd - tStart).count() << " ms" << std::endl;
+	std::cout << "	ACMR: " << before.getAcmr() << " -> " << after.getAcmr() << std::endl;
+	std::cout << "	ATVR: " << before.getAtvr() << " -> " << after.getAtvr() << std::endl;
+}
+
+void Scene::buildMeshlets(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices)
+{
+	// Built per mesh in parallel and concatenated in mesh order
+	std::vector<std::vector<Meshlet>> meshMeshlets(meshes.size());
+	jobs->parallelFor(meshes.size(), 1, [&](size_t i, size_t) {
+		Mesh& mesh = meshes[i];
+		if (mesh.vertexCount == 0)
+			return;
+
+		MeshOptimizer::buildMeshlets(
+			indices.data() + mesh.indexBase,
+			mesh.indexCount,
+			&vertices[mesh.vertexBase].pos.x,
+			sizeof(Vertex),
+			mesh.vertexCount,
+			meshMeshlets[i]);
+
+		// Whole mesh sphere, for the LOD distance and for culling coarse levels
+		glm::vec3 boundsMin = vertices[mesh.vertexBase].pos;
+		glm::vec3 boundsMax = boundsMin;
+		for (uint32_t v = mesh.vertexBase; v < mesh.vertexBase + mesh.vertexCount; v++)
+		{
+			boundsMin = glm::min(boundsMin, vertices[v].pos);
+			boundsMax = glm::max(boundsMax, vertices[v].pos);
+		}
+
+		glm::vec3 center = (boundsMin + boundsMax) * 0.5f;
+		float radius = 0.0f;
+		for (uint32_t v = mesh.vertexBase; v < mesh.vertexBase + mesh.vertexCount; v++)
+			radius = std::max(radius, glm::length(vertices[v].pos - center));
+		mesh.boundingSphere = glm::vec4(center, radius);
+	});
 
-}
+	meshlets.clear();
+	for (size_t i = 0; i < meshes.size(); i++)
+	{
+		meshes[i].meshletBase = static_cast<uint32_t>(meshlets.size());
+		meshes[i].meshletCount = static_cast<uint32_t>(meshMeshlets[i].size());
+		meshlets.insert(meshlets.end(), meshMeshlets[i].begin(), meshMeshlets[i].end());
+	}
 
+	std::cout << "Split " << meshes.size() << " meshes into " << meshlets.size() << " meshlets" << std::endl;
+}
 
-Scene::~Scene()
+void Scene::generateLods(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices)
 {
-	resMan->destroyBuffer(vertexBuffer);
-	resMan->destroyBuffer(indexBuffer);
-	for (auto material : materials)
+	auto tStart = std::chrono::high_resolution_clock::now();
+
+	struct LevelChain {
+		std::vector<std::vector<uint32_t>> levels;
+		std::vector<float> errors;
+	};
+
+	// Every level is simplified from the previous one, the error keeps the largest deviation so far
+	std::vector<LevelChain> chains(meshes.size());
+	jobs->parallelFor(meshes.size(), 1, [&](size_t i, size_t) {
+		const Mesh& mesh = meshes[i];
+		LevelChain& chain = chains[i];
+		std::vector<uint32_t> previous(indices.begin() + mesh.indexBase, indices.begin() + mesh.indexBase + mesh.indexCount);
+		float error = 0.0f;
+
+		while (chain.levels.size() < LOD_MAX_LEVELS && previous.size() / 3 > LOD_MIN_TRIANGLES)
+		{
+			size_t targetIndexCount = static_cast<size_t>(previous.size() / 3 * LOD_REDUCTION) * 3;
+
+			std::vector<uint32_t> level;
+			float levelError = MeshOptimizer::simplify(
+				previous.data(),
+				previous.size(),
+				&vertices[mesh.vertexBase].pos.x,
+				sizeof(Vertex),
+				mesh.vertexCount,
+				targetIndexCount,
+				level);
+
+			// Locked borders stop the reduction early, such a level is not worth its memory
+			if (level.empty() || level.size() > previous.size() * 3 / 4)
+				break;
+
+			MeshOptimizer::optimizeVertexCache(level.data(), level.size(), mesh.vertexCount);
+
+			error = std::max(error, levelError);
+			chain.errors.push_back(error);
+			chain.levels.push_back(level);
+			previous = std::move(level);
+		}
+	});
+
+	lods.clear();
+	lodIndexData.clear();
+
+	for (size_t i = 0; i < meshes.size(); i++)
 	{
-		vkDestroyImageView(device, material.diffuse.image.view, nullptr);
-		resMan->destroyImage(material.diffuse.image);
+		const LevelChain& chain = chains[i];
+		Mesh& mesh = meshes[i];
+
+		mesh.indexType = getIndexType(mesh.vertexCount);
+		mesh.lodBase = static_cast<uint32_t>(lods.size());
+		mesh.lodCount = static_cast<uint32_t>(chain.levels.size());
+
+		for (size_t l = 0; l < chain.levels.size(); l++)
+		{
+			MeshLod lod;
+			lod.indexCount = static_cast<uint32_t>(chain.levels[l].size());
+			lod.page.dataOffset = lodIndexData.size();
+			appendIndices(chain.levels[l].data(), lod.indexCount, mesh.indexType, lodIndexData);
+			lod.page.dataSize = lodIndexData.size() - lod.page.dataOffset;
+			lod.error = chain.errors[l];
+			lods.push_back(lod);
+
+			// Keep every level 4 byte aligned in the host copy
+			lodIndexData.resize((lodIndexData.size() + 3) & ~static_cast<size_t>(3));
+		}
 	}
-	vkDestroySampler(device, defaultSampler, nullptr);
-	vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
-	vkDestroyDescriptorSetLayout(device, descriptorSetLayouts.material, nullptr);
-	vkDestroyDescriptorSetLayout(device, descriptorSetLayouts.scene, nullptr);
-	vkDestroyDescriptorPool(device, descriptorPool, nullptr);
-	vkDestroyPipeline(device, pipelines.solid, nullptr);
-	vkDestroyPipeline(device, pipelines.blending, nullptr);
-	resMan->destroyBuffer(uniformBuffer);
 
+	auto tEnd = std::chrono::high_resolution_clock::now();
+
+	std::cout << "Generated " << lods.size() << " LODs, " << lodIndexData.size() << " index bytes in "
+		<< std::chrono::duration<double, std::milli>(tEnd - tStart).count() << " ms" << std::endl;
 }
 
-void Scene::import(const std::string & filePath)
+void Scene::createInstanceBuffers()
 {
-	Assimp::Importer importer;
-	const aiScene *scene = importer.ReadFile(filePath, aiProcess_Triangulate | aiProcess_GenNormals | aiProcess_FlipUVs);
+	// Host visible storage buffers, writeDraws copies the visible ids into the slice of the frame
+	resMan->createBuffer(
+		VMA_MEMORY_USAGE_CPU_TO_GPU,
+		SCENE_MAX_INSTANCES * sizeof(InstanceData),
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		&instanceBuffer,
+		reinterpret_cast<void**>(&pInstanceData)
+	);
+	memcpy(pInstanceData, instances.data(), instances.size() * sizeof(InstanceData));
+
+	visibleInstanceIds.resize(meshes.size() * SCENE_MAX_INSTANCES);
+	resMan->createBuffer(
+		VMA_MEMORY_USAGE_CPU_TO_GPU,
+		std::max<size_t>(meshes.size(), 1) * SCENE_MAX_INSTANCES * sizeof(uint32_t) * frameCount,
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		&visibleInstanceBuffer,
+		reinterpret_cast<void**>(&pVisibleInstanceData)
+	);
 
-	if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode)
+	MaterialData *pMaterialData = nullptr;
+	resMan->createBuffer(
+		VMA_MEMORY_USAGE_CPU_TO_GPU,
+		std::max<size_t>(materials.size(), 1) * sizeof(MaterialData),
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		&materialBuffer,
+		reinterpret_cast<void**>(&pMaterialData)
+	);
+	for (size_t i = 0; i < materials.size(); i++)
 	{
-		throw std::runtime_error("Cannot load input model!");
+		MaterialData material = {};
+		material.properties = materials[i].properties;
+		pMaterialData[i] = material;
 	}
-	assetPath = filePath.substr(0, filePath.find_last_of('/'));
-	assetPath.append("/");
-	std::cout << "Asset Path is : " << assetPath << std::endl;
 
-	//processNode(scene->mRootNode);
-	extractMaterials(scene);
-	extractMeshes(scene);
+	instanceBuffer.updateDescriptorInfo();
+	visibleInstanceBuffer.updateDescriptorInfo();
+	materialBuffer.updateDescriptorInfo();
+
+	std::array<VkWriteDescriptorSet, 3> descriptorWrites = {};
+	std::array<VkDescriptorBufferInfo*, 3> bufferInfos = { &instanceBuffer.descInfo, &visibleInstanceBuffer.descInfo, &materialBuffer.descInfo };
+
+	// Bindings 1 to 3 of the scene set
+	for (uint32_t i = 0; i < descriptorWrites.size(); i++)
+	{
+		descriptorWrites[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		descriptorWrites[i].dstSet = descriptorSetScene;
+		descriptorWrites[i].dstBinding = i + 1;
+		descriptorWrites[i].dstArrayElement = 0;
+		descriptorWrites[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		descriptorWrites[i].descriptorCount = 1;
+		descriptorWrites[i].pBufferInfo = bufferInfos[i];
+	}
 
+	vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, NULL);
 }
 
-void Scene::render(VkCommandBuffer cmdBuffer)
+void Scene::createIndirectBuffer()
 {
-	VkDeviceSize offsets[1] = { 0 };
+	// Meshlet slots followed by one coarse level slot per mesh, once per frame in flight
+	drawCommands.assign(meshlets.size() + meshes.size(), VkDrawIndexedIndirectCommand());
+	VkDeviceSize sliceSize = drawCommands.size() * sizeof(VkDrawIndexedIndirectCommand);
+
+	resMan->createBuffer(
+		VMA_MEMORY_USAGE_CPU_TO_GPU,
+		sliceSize * frameCount,
+		VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+		&indirectBuffer,
+		reinterpret_cast<void**>(&pIndirectData)
+	);
 
-	// Bind scene vertex and index buffers
-	vkCmdBindVertexBuffers(cmdBuffer, 0, 1, &vertexBuffer.buffer, offsets);
-	vkCmdBindIndexBuffer(cmdBuffer, indexBuffer.buffer, 0, VK_INDEX_TYPE_UINT32);
+	// Frames submitted before the first cull draw nothing
+	memset(pIndirectData, 0, static_cast<size_t>(sliceSize * frameCount));
+}
 
-	for (size_t i = 0; i < meshes.size(); i++)
+void Scene::compactVertices(const std::vector<Vertex>& vertices, std::vector<uint8_t>& vertexData)
+{
+	vertexStride = CompactVertex::getStride(hasVertexColor);
+	vertexData.resize(vertices.size() * vertexStride);
+
+	for (auto& mesh : meshes)
 	{
-		// We will be using multiple descriptor sets for rendering
-		// In GLSL the selection is done via the set and binding keywords
-		// VS: layout (set = 0, binding = 0) uniform UBO;
-		// FS: layout (set = 1, binding = 0) uniform sampler2D samplerColorMap;
+		if (mesh.vertexCount == 0) continue;
 
-		std::array<VkDescriptorSet, 2> descriptorSets;
-		// Set 0: Scene descriptor set containing global matrices
-		descriptorSets[0] = descriptorSetScene;
-		// Set 1: Per-Material descriptor set containing bound images
-		descriptorSets[1] = meshes[i].material->descriptorSet;
+		// Quantize positions against the bounds of their own mesh
+		glm::vec3 boundsMin = vertices[mesh.vertexBase].pos;
+		glm::vec3 boundsMax = boundsMin;
+		for (uint32_t v = mesh.vertexBase; v < mesh.vertexBase + mesh.vertexCount; v++)
+		{
+			boundsMin = glm::min(boundsMin, vertices[v].pos);
+			boundsMax = glm::max(boundsMax, vertices[v].pos);
+		}
 
-		vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, *meshes[i].material->pipeline);
-		vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, static_cast<uint32_t>(descriptorSets.size()), descriptorSets.data(), 0, NULL);
+		glm::vec3 extent = boundsMax - boundsMin;
+		mesh.bounds.scale = glm::vec4(extent, 1.0f);
+		mesh.bounds.offset = glm::vec4(boundsMin, 0.0f);
 
-		// Pass material properies via push constants
-		vkCmdPushConstants(
-			cmdBuffer,
-			pipelineLayout,
-			VK_SHADER_STAGE_FRAGMENT_BIT,
-			0,
-			sizeof(MaterialProperties),
-			&meshes[i].material->properties);
+		// Flat axes keep every position on the offset
+		glm::vec3 invExtent = glm::vec3(
+			extent.x > 0.0f ? 1.0f / extent.x : 0.0f,
+			extent.y > 0.0f ? 1.0f / extent.y : 0.0f,
+			extent.z > 0.0f ? 1.0f / extent.z : 0.0f);
 
-		// Render from the global scene vertex buffer using the mesh index offset
-		vkCmdDrawIndexed(cmdBuffer, meshes[i].indexCount, 1, 0, meshes[i].indexBase, 0);
-	}
+		for (uint32_t v = mesh.vertexBase; v < mesh.vertexBase + mesh.vertexCount; v++)
+		{
+			const Vertex& vertex = vertices[v];
+
+			CompactVertex compact = {};
+			glm::vec3 pos = (vertex.pos - boundsMin) * invExtent;
+			compact.pos[0] = quantizeUnorm16(pos.x);
+			compact.pos[1] = quantizeUnorm16(pos.y);
+			compact.pos[2] = quantizeUnorm16(pos.z);
+			compact.pos[3] = 65535;
 
+			glm::vec2 normal = encodeOctahedral(vertex.normal);
+			compact.normal[0] = static_cast<int16_t>(glm::packSnorm1x16(normal.x));
+			compact.normal[1] = static_cast<int16_t>(glm::packSnorm1x16(normal.y));
+
+			compact.uv[0] = glm::packHalf1x16(vertex.uv.x);
+			compact.uv[1] = glm::packHalf1x16(vertex.uv.y);
+
+			compact.color[0] = glm::packUnorm1x8(vertex.color.r);
+			compact.color[1] = glm::packUnorm1x8(vertex.color.g);
+			compact.color[2] = glm::packUnorm1x8(vertex.color.b);
+			compact.color[3] = 255;
+
+			memcpy(vertexData.data() + static_cast<size_t>(v) * vertexStride, &compact, vertexStride);
+		}
+	}
 }
 
-bool Scene::rebindTexture()
+void Scene::packIndices(const std::vector<uint32_t>& indices, std::vector<uint8_t>& indexData)
 {
-	bool needRebind = false;
-	// Material descriptor sets
-	for (size_t i = 0; i < materials.size(); i++)
-	{
-		if (materials[i].diffuse.image.isBoundToDesc) continue;
+	indexData.clear();
 
-		needRebind = true;
+	for (auto& mesh : meshes)
+	{
+		// Extraction leaves indexBase as the first index in the 32 bit array
+		const uint32_t* pIndices = indices.data() + mesh.indexBase;
 
-		std::vector<VkWriteDescriptorSet> descriptorWrites;
-		descriptorWrites.resize(1);
+		mesh.indexType = getIndexType(mesh.vertexCount);
+		size_t indexSize = getIndexSize(mesh.indexType);
 
-		// Binding 0: Diffuse texture // this will be executed again when migration process complete
-		descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-		descriptorWrites[0].dstSet = materials[i].descriptorSet;
-		descriptorWrites[0].dstBinding = 0;
-		descriptorWrites[0].dstArrayElement = 0;
-		descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-		descriptorWrites[0].descriptorCount = 1;
-		descriptorWrites[0].pImageInfo = &materials[i].diffuse.image.descInfo;
+		// Both index types are drawn from offset 0, so every range has to start on a multiple of its index size
+		size_t offset = (indexData.size() + indexSize - 1) & ~(indexSize - 1);
+		indexData.resize(offset);
+		mesh.indexBase = static_cast<uint32_t>(offset / indexSize);
 
-		vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, NULL);
+		appendIndices(pIndices, mesh.indexCount, mesh.indexType, indexData);
+	}
+}
 
-		materials[i].diffuse.image.isBoundToDesc = true;
+void Scene::createGeometryPools()
+{
+	// Pages are the full resolution vertex and index ranges of every mesh
+	for (auto& mesh : meshes)
+	{
+		VkDeviceSize indexSize = getIndexSize(mesh.indexType);
+		mesh.vertexPage.dataOffset = static_cast<VkDeviceSize>(mesh.vertexBase) * vertexStride;
+		mesh.vertexPage.dataSize = static_cast<VkDeviceSize>(mesh.vertexCount) * vertexStride;
+		mesh.indexPage.dataOffset = static_cast<VkDeviceSize>(mesh.indexBase) * indexSize;
+		mesh.indexPage.dataSize = static_cast<VkDeviceSize>(mesh.indexCount) * indexSize;
 	}
 
-	return needRebind;
+	vertexPool = new GeometryPool(resMan, GEOMETRY_VERTEX_POOL_SIZE, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+	indexPool = new GeometryPool(resMan, GEOMETRY_INDEX_POOL_SIZE, VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
+
+	// Compact vertices without color read constant white from a zero stride binding
+	if (vertexLayout == VERTEX_LAYOUT_COMPACT && !hasVertexColor)
+	{
+		const uint8_t white[4] = { 255, 255, 255, 255 };
+		resMan->createBufferInDevice(
+			sizeof(white),
+			VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+			&constantColorBuffer,
+			white
+		);
+	}
 }
 
-void Scene::extractMeshes(const aiScene *scene)
+bool Scene::importFromCache(const std::string & cachePath, const std::string & sourcePath)
 {
-	std::vector<Vertex> vertices;
-	std::vector<uint32_t> indices;
-	uint32_t indexBase = 0;
+	// The cache stays mapped as the backing store of the geometry pages
+	SceneCache& cache = geometryCache;
+	if (!cache.open(cachePath, sourcePath, vertexLayout, getImportOptions()))
+		return false;
 
-	meshes.resize(scene->mNumMeshes);
+	const SceneCacheHeader& header = cache.getHeader();
 
-	for (uint32_t i = 0; i < meshes.size(); i++)
+	// The stride has to match the vertex structs of this build
+	if (vertexLayout == VERTEX_LAYOUT_COMPACT)
 	{
-		aiMesh *aMesh = scene->mMeshes[i];
+		if (header.vertexStride != CompactVertex::getStride(true) && header.vertexStride != CompactVertex::getStride(false))
+			return false;
+		hasVertexColor = header.vertexStride == CompactVertex::getStride(true);
+	}
+	else if (header.vertexStride != sizeof(Vertex))
+	{
+		return false;
+	}
+	vertexStride = header.vertexStride;
 
-		std::cout << "Mesh \"" << aMesh->mName.C_Str() << "\"" << std::endl;
-		std::cout << "	Material: \"" << materials[aMesh->mMaterialIndex].name << "\"" << std::endl;
-		std::cout << "	Faces: " << aMesh->mNumFaces << std::endl;
+	// Material table
+	const SceneCacheMaterial* cachedMaterials = cache.getMaterials();
+	materials.resize(header.materialCount);
 
-		meshes[i].material = &materials[aMesh->mMaterialIndex];
-		meshes[i].indexBase = indexBase;
-		meshes[i].indexCount = aMesh->mNumFaces * 3;
+	for (size_t i = 0; i < materials.size(); i++)
+	{
+		materials[i] = {};
+		materials[i].name = std::string(cachedMaterials[i].name);
+		materials[i].diffuseFile = std::string(cachedMaterials[i].diffuseFile);
+		materials[i].properties.ambient = glm::make_vec4(cachedMaterials[i].ambient);
+		materials[i].properties.diffuse = glm::make_vec4(cachedMaterials[i].diffuse);
+		materials[i].properties.specular = glm::make_vec4(cachedMaterials[i].specular);
+		materials[i].properties.opacity = cachedMaterials[i].opacity;
+	}
 
-		// Vertices
-		bool hasUV = aMesh->HasTextureCoords(0);
-		bool hasColor = aMesh->HasVertexColors(0);
-		bool hasNormals = aMesh->HasNormals();
+	prepareMaterials();
 
-		for (uint32_t v = 0; v < aMesh->mNumVertices; v++)
-		{
-			Vertex vertex;
-			vertex.pos = glm::vec3(aMesh->mVertices[v].x, aMesh->mVertices[v].y, aMesh->mVertices[v].z);
-			//vertex.pos.y = -vertex.pos.y;
-			vertex.uv = hasUV ? glm::vec2(aMesh->mTextureCoords[0][v].x, aMesh->mTextureCoords[0][v].y) : glm::vec2(0.0f);
-			vertex.normal = hasNormals ? glm::vec3(aMesh->mNormals[v].x, aMesh->mNormals[v].y, aMesh->mNormals[v].z) : glm::vec3(0.0f);
-			//vertex.normal.y = -vertex.normal.y;
-			vertex.color = hasColor ? glm::vec3(aMesh->mColors[0][v].r, aMesh->mColors[0][v].g, aMesh->mColors[0][v].b) : glm::vec3(1.0f);
-			vertices.push_back(vertex);
-		}
+	// Mesh table
+	const SceneCacheMesh* cachedMeshes = cache.getMeshes();
+	meshes.resize(header.meshCount);
 
-		// Indices
-		for (uint32_t f = 0; f < aMesh->mNumFaces; f++)
-		{
-			for (uint32_t j = 0; j < 3; j++)
-			{
-				indices.push_back(aMesh->mFaces[f].mIndices[j]);
-			}
-		}
+	for (size_t i = 0; i < meshes.size(); i++)
+	{
+		meshes[i].indexBase = cachedMeshes[i].indexBase;
+		meshes[i].indexCount = cachedMeshes[i].indexCount;
+		meshes[i].indexType = static_cast<VkIndexType>(cachedMeshes[i].indexType);
+		meshes[i].meshletBase = cachedMeshes[i].meshletBase;
+		meshes[i].meshletCount = cachedMeshes[i].meshletCount;
+		meshes[i].vertexBase = cachedMeshes[i].vertexBase;
+		meshes[i].vertexCount = cachedMeshes[i].vertexCount;
+		meshes[i].material = &materials[cachedMeshes[i].materialIndex];
+		meshes[i].bounds.scale = glm::make_vec4(cachedMeshes[i].boundsScale);
+		meshes[i].bounds.offset = glm::make_vec4(cachedMeshes[i].boundsOffset);
+		meshes[i].lodBase = cachedMeshes[i].lodBase;
+		meshes[i].lodCount = cachedMeshes[i].lodCount;
+		meshes[i].boundingSphere = glm::make_vec4(cachedMeshes[i].boundingSphere);
+	}
+
+	const Meshlet* cachedMeshlets = cache.getMeshlets();
+	meshlets.assign(cachedMeshlets, cachedMeshlets + header.meshletCount);
 
-		indexBase += aMesh->mNumFaces * 3;
+	const SceneCacheLod* cachedLods = cache.getLods();
+	lods.resize(header.lodCount);
+	for (size_t i = 0; i < lods.size(); i++)
+	{
+		lods[i] = {};
+		lods[i].indexCount = cachedLods[i].indexCount;
+		lods[i].page.dataOffset = cachedLods[i].dataOffset;
+		lods[i].page.dataSize = cachedLods[i].dataSize;
+		lods[i].error = cachedLods[i].error;
 	}
 
-	uint32_t vertexDataSize = static_cast<uint32_t>(vertices.size() * sizeof(Vertex));
-	uint32_t indexDataSize = static_cast<uint32_t>(indices.size() * sizeof(uint32_t));
+	// Vertex, index and LOD pages go from the mapping straight into the staging buffers
+	pVertexData = static_cast<const uint8_t*>(cache.getVertexData());
+	pIndexData = static_cast<const uint8_t*>(cache.getIndexData());
+	pLodIndexData = static_cast<const uint8_t*>(cache.getLodIndexData());
 
-	resMan->createBufferInDevice(
-		vertexDataSize,
-		VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-		&vertexBuffer,
-		vertices.data()
-	);
+	return true;
+}
+
+void Scene::writeCache(const std::string & cachePath, const std::string & sourcePath, const void * vertexData, uint32_t vertexCount, const void * indexData, uint32_t indexDataSize)
+{
+	std::vector<SceneCacheMaterial> cachedMaterials(materials.size());
+	for (size_t i = 0; i < materials.size(); i++)
+	{
+		SceneCacheMaterial& cached = cachedMaterials[i];
+		cached = {};
+		strncpy(cached.name, materials[i].name.c_str(), SCENE_CACHE_NAME_LENGTH - 1);
+		strncpy(cached.diffuseFile, materials[i].diffuseFile.c_str(), SCENE_CACHE_PATH_LENGTH - 1);
+		memcpy(cached.ambient, glm::value_ptr(materials[i].properties.ambient), sizeof(cached.ambient));
+		memcpy(cached.diffuse, glm::value_ptr(materials[i].properties.diffuse), sizeof(cached.diffuse));
+		memcpy(cached.specular, glm::value_ptr(materials[i].properties.specular), sizeof(cached.specular));
+		cached.opacity = materials[i].properties.opacity;
+	}
+
+	std::vector<SceneCacheMesh> cachedMeshes(meshes.size());
+	for (size_t i = 0; i < meshes.size(); i++)
+	{
+		cachedMeshes[i] = {};
+		cachedMeshes[i].indexBase = meshes[i].indexBase;
+		cachedMeshes[i].indexCount = meshes[i].indexCount;
+		cachedMeshes[i].indexType = static_cast<uint32_t>(meshes[i].indexType);
+		cachedMeshes[i].meshletBase = meshes[i].meshletBase;
+		cachedMeshes[i].meshletCount = meshes[i].meshletCount;
+		cachedMeshes[i].vertexBase = meshes[i].vertexBase;
+		cachedMeshes[i].vertexCount = meshes[i].vertexCount;
+		cachedMeshes[i].materialIndex = static_cast<uint32_t>(meshes[i].material - materials.data());
+		memcpy(cachedMeshes[i].boundsScale, glm::value_ptr(meshes[i].bounds.scale), sizeof(cachedMeshes[i].boundsScale));
+		memcpy(cachedMeshes[i].boundsOffset, glm::value_ptr(meshes[i].bounds.offset), sizeof(cachedMeshes[i].boundsOffset));
+		cachedMeshes[i].lodBase = meshes[i].lodBase;
+		cachedMeshes[i].lodCount = meshes[i].lodCount;
+		memcpy(cachedMeshes[i].boundingSphere, glm::value_ptr(meshes[i].boundingSphere), sizeof(cachedMeshes[i].boundingSphere));
+	}
+
+	std::vector<SceneCacheLod> cachedLods(lods.size());
+	for (size_t i = 0; i < lods.size(); i++)
+	{
+		cachedLods[i].indexCount = lods[i].indexCount;
+		cachedLods[i].dataOffset = static_cast<uint32_t>(lods[i].page.dataOffset);
+		cachedLods[i].dataSize = static_cast<uint32_t>(lods[i].page.dataSize);
+		cachedLods[i].error = lods[i].error;
+	}
 
-	resMan->createBufferInDevice(
-		indexDataSize,
-		VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-		&indexBuffer,
-		indices.data()
+	bool isWritten = SceneCache::write(
+		cachePath,
+		sourcePath,
+		vertexLayout,
+		getImportOptions(),
+		vertexStride,
+		cachedMeshes,
+		cachedMaterials,
+		meshlets,
+		cachedLods,
+		lodIndexData,
+		vertexData,
+		vertexCount,
+		indexData,
+		indexDataSize
 	);
+
+	if (!isWritten)
+		std::cout << "Cannot write scene cache \"" << cachePath << "\"" << std::endl;
 }
 
 void Scene::extractMaterials(const aiScene * scene)
@@ -214,10 +1524,6 @@ void Scene::extractMaterials(const aiScene * scene)
 		materials[i].name = name.C_Str();
 		std::cout << "Material \"" << materials[i].name << "\" with index " << i << std::endl;
 
-		// Textures
-		// Determine texture format
-		VkFormat texFormat = VK_FORMAT_R8G8B8A8_UNORM;
-
 		aiString texturefile;
 		// Diffuse
 		scene->mMaterials[i]->GetTexture(aiTextureType_DIFFUSE, 0, &texturefile);
@@ -226,41 +1532,59 @@ void Scene::extractMaterials(const aiScene * scene)
 			std::cout << "  Diffuse: \"" << texturefile.C_Str() << "\"" << std::endl;
 			std::string fileName = std::string(texturefile.C_Str());
 			std::replace(fileName.begin(), fileName.end(), '\\', '/');
-			if (!loadTextureFromFile(assetPath + fileName, texFormat, &materials[i].diffuse)) {
-				std::cout << "Cannot load required texture, using dummy texture!" << std::endl;
-				loadTextureFromFile("models/dummy_texture.png", VK_FORMAT_R8G8B8A8_UNORM, &materials[i].diffuse);
-				materials[i].diffuse.name = std::string("dummy_texture_" + i);
-				materials[i].diffuse.type = TEXTURE_TYPE_DIFFUSE;
-			}
-			else {
-				materials[i].diffuse.name = fileName;
-				materials[i].diffuse.type = TEXTURE_TYPE_DIFFUSE;
-			}
-		}
-		else
-		{
-			std::cout << "  Material has no diffuse, using dummy texture!" << std::endl;
-			loadTextureFromFile("models/dummy_texture.png", VK_FORMAT_R8G8B8A8_UNORM, &materials[i].diffuse);
-			materials[i].diffuse.name = std::string("dummy_texture_" + i);
-			materials[i].diffuse.type = TEXTURE_TYPE_DIFFUSE;
+			materials[i].diffuseFile = fileName;
 		}
 
 		// For scenes with multiple textures per material we would need to check for additional texture types, e.g.:
 		// aiTextureType_HEIGHT, aiTextureType_OPACITY, aiTextureType_SPECULAR, etc.
+	}
+}
+
+void Scene::prepareMaterials()
+{
+	bakeTextures();
+
+	for (size_t i = 0; i < materials.size(); i++)
+	{
+		// Textures
+		// Determine texture format
+		VkFormat texFormat = VK_FORMAT_R8G8B8A8_UNORM;
+
+		materials[i].features = 0;
+
+		// Diffuse
+		if (!materials[i].diffuseFile.empty())
+		{
+			materials[i].diffuse = acquireTexture(assetPath + materials[i].diffuseFile, texFormat);
+			if (materials[i].diffuse == nullptr)
+				std::cout << "Cannot load required texture, material \"" << materials[i].name << "\" is drawn untextured!" << std::endl;
+			else
+				materials[i].features |= MATERIAL_FEATURE_DIFFUSE_MAP;
+		}
+
+		// The shader never samples the placeholder, it only fills the binding
+		if (materials[i].diffuse == nullptr)
+			materials[i].diffuse = acquirePlaceholderTexture();
+
+		if (glm::vec3(materials[i].properties.specular) != glm::vec3(0.0f))
+			materials[i].features |= MATERIAL_FEATURE_SPECULAR;
+		if (materials[i].properties.opacity == 0.0f)
+			materials[i].features |= MATERIAL_FEATURE_ALPHA_BLEND;
 
 		// Assign pipeline
-		materials[i].pipeline = (materials[i].properties.opacity != 0.0f) ? &pipelines.solid : &pipelines.blending;
-		//materials[i].pipeline = &pipelines.solid;
+		materials[i].pipeline = &pipelines[materials[i].features];
 	}
 
 	// Generate descriptor sets for the materials
 
 	// Descriptor pool
-	std::array<VkDescriptorPoolSize, 2> poolSizes = {};
-	poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	std::array<VkDescriptorPoolSize, 3> poolSizes = {};
+	poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 	poolSizes[0].descriptorCount = 1;
 	poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
 	poolSizes[1].descriptorCount = static_cast<uint32_t>(materials.size());
+	poolSizes[2].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	poolSizes[2].descriptorCount = 3;
 
 	VkDescriptorPoolCreateInfo descriptorPoolInfo = {};
 	descriptorPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
@@ -273,13 +1597,28 @@ void Scene::extractMaterials(const aiScene * scene)
 	// Descriptor set and pipeline layouts
 	std::vector<VkDescriptorSetLayoutBinding> setLayoutBindings;
 	VkDescriptorSetLayoutCreateInfo descriptorLayout = {};
-	setLayoutBindings.resize(1);
+	setLayoutBindings.resize(4);
 
-	// Set 0: Scene matrices
-	setLayoutBindings[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	// Set 0: Scene matrices, the dynamic offset selects the frame's slice
+	setLayoutBindings[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 	setLayoutBindings[0].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
 	setLayoutBindings[0].binding = 0;
 	setLayoutBindings[0].descriptorCount = 1;
+	// Instance transforms and material indices
+	setLayoutBindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	setLayoutBindings[1].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+	setLayoutBindings[1].binding = 1;
+	setLayoutBindings[1].descriptorCount = 1;
+	// Ids of the instances that passed culling, SCENE_MAX_INSTANCES per mesh
+	setLayoutBindings[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	setLayoutBindings[2].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+	setLayoutBindings[2].binding = 2;
+	setLayoutBindings[2].descriptorCount = 1;
+	// Material properties selected by an instance's material index
+	setLayoutBindings[3].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	setLayoutBindings[3].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+	setLayoutBindings[3].binding = 3;
+	setLayoutBindings[3].descriptorCount = 1;
 
 	descriptorLayout.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
 	descriptorLayout.bindingCount = static_cast<uint32_t>(setLayoutBindings.size());
@@ -288,6 +1627,8 @@ void Scene::extractMaterials(const aiScene * scene)
 	VK_CHECK_RESULT(vkCreateDescriptorSetLayout(device, &descriptorLayout, nullptr, &descriptorSetLayouts.scene));
 
 	// Set 1: Material data
+	setLayoutBindings.resize(1);
+	descriptorLayout.bindingCount = static_cast<uint32_t>(setLayoutBindings.size());
 	setLayoutBindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
 	setLayoutBindings[0].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
 	setLayoutBindings[0].binding = 0;
@@ -303,13 +1644,17 @@ void Scene::extractMaterials(const aiScene * scene)
 	pipelineLayoutCreateInfo.pSetLayouts = setLayouts.data();
 
 	// We will be using a push constant block to pass material properties to the fragment shaders
-	VkPushConstantRange pushConstantRange = {};
-	pushConstantRange.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
-	pushConstantRange.size = sizeof(MaterialProperties);
-	pushConstantRange.offset = 0;
-
-	pipelineLayoutCreateInfo.pushConstantRangeCount = 1;
-	pipelineLayoutCreateInfo.pPushConstantRanges = &pushConstantRange;
+	// and the mesh bounds and instance base to the vertex shader
+	std::array<VkPushConstantRange, 2> pushConstantRanges = {};
+	pushConstantRanges[0].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+	pushConstantRanges[0].size = sizeof(MaterialProperties);
+	pushConstantRanges[0].offset = 0;
+	pushConstantRanges[1].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+	pushConstantRanges[1].size = sizeof(Mesh::bounds) + sizeof(uint32_t);
+	pushConstantRanges[1].offset = MESH_BOUNDS_PUSH_OFFSET;
+
+	pipelineLayoutCreateInfo.pushConstantRangeCount = static_cast<uint32_t>(pushConstantRanges.size());
+	pipelineLayoutCreateInfo.pPushConstantRanges = pushConstantRanges.data();
 
 	VK_CHECK_RESULT(vkCreatePipelineLayout(device, &pipelineLayoutCreateInfo, nullptr, &pipelineLayout));
 
@@ -335,13 +1680,15 @@ void Scene::extractMaterials(const aiScene * scene)
 		descriptorWrites[0].dstArrayElement = 0;
 		descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
 		descriptorWrites[0].descriptorCount = 1;
-		descriptorWrites[0].pImageInfo = &materials[i].diffuse.image.descInfo;
+		descriptorWrites[0].pImageInfo = &materials[i].diffuse->image.descInfo;
 
 		vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, NULL);
 
-		materials[i].diffuse.image.isBoundToDesc = true;
+		materials[i].diffuse->image.isBoundToDesc = true;
 	}
 
+	std::cout << textures.size() << " unique textures shared by " << materials.size() << " materials" << std::endl;
+
 	// Scene descriptor set
 	VkDescriptorSetAllocateInfo allocInfo = {};
 	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
@@ -359,50 +1706,234 @@ void Scene::extractMaterials(const aiScene * scene)
 	descriptorWrites[0].dstSet = descriptorSetScene;
 	descriptorWrites[0].dstBinding = 0;
 	descriptorWrites[0].dstArrayElement = 0;
-	descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 	descriptorWrites[0].descriptorCount = 1;
-	descriptorWrites[0].pBufferInfo = &uniformBuffer.descInfo;
+	descriptorWrites[0].pBufferInfo = &uniformRing.buffer.descInfo;
 
 	vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, NULL);
 
 }
 
-bool Scene::loadTextureFromFile(const std::string & fileName, VkFormat format, Texture * texture)
+Texture * Scene::acquireTexture(const std::string & fileName, VkFormat format)
 {
-	/*
-	for (std::string textureName : loadedTexture) {
-		if (std::strcmp(textureName.data(), fileName.c_str()) == 0)
-		{
-			return;
-		}
+	TRACE_ZONE("Scene::acquireTexture", "texture");
+
+	std::string path = canonicalPath(fileName);
+
+	// Same file already loaded by another material
+	auto pathIt = texturePaths.find(path);
+	if (pathIt != texturePaths.end())
+	{
+		Texture *texture = pathIt->second;
+		texture->refCount++;
+		resMan->updateResourceUsers(texture->image, texture->refCount);
+		return texture;
 	}
-	*/
-	int texWidth, texHeight, texChannels;
 
-	stbi_uc* pixels = stbi_load(fileName.c_str(), &texWidth, &texHeight, &texChannels, STBI_rgb_alpha);
-	if (!pixels) {
-		return false;
+	std::string containerPath = path + TEXTURE_CONTAINER_EXTENSION;
+
+	// Decode and bake the mip chain only on first use, later loads map the container
+	TextureContainer container;
+	if (!container.open(containerPath, path) || !isContainerUpToDate(container.getHeader(), format))
+	{
+		std::vector<uint8_t> blob;
+		if (!bakeTexture(path, format, blob))
+			return nullptr;
+
+		if (!container.open(std::move(blob)))
+			return nullptr;
+	}
+
+	const TextureContainerHeader& header = container.getHeader();
+
+	// Same content under a different path (copies of one file, differently spelled references)
+	auto hashIt = textureHashes.find(header.contentHash);
+	if (hashIt != textureHashes.end() && 
+		hashIt->second->image.width == header.width &&
+		hashIt->second->image.height == header.height)
+	{
+		Texture *texture = hashIt->second;
+		texture->refCount++;
+		resMan->updateResourceUsers(texture->image, texture->refCount);
+		texturePaths[path] = texture;
+		return texture;
 	}
-	VkDeviceSize textSize = texWidth * texHeight * 4;
+
+	textures.emplace_back();
+	Texture *texture = &textures.back();
+
+	// Mip offsets relative to the top level, the chain is uploaded as one range
+	std::vector<VkDeviceSize> mipOffsets(header.mipCount);
+	for (uint32_t i = 0; i < header.mipCount; i++)
+		mipOffsets[i] = container.getMip(i).offset - container.getMip(0).offset;
 
 	resMan->createImageInDevice(
-		texWidth,
-		texHeight,
-		format,
+		header.width,
+		header.height,
+		header.mipCount,
+		static_cast<VkFormat>(header.format),
 		VK_IMAGE_USAGE_SAMPLED_BIT,
 		&texture->image,
-		pixels,
-		textSize
+		container.getData(),
+		container.getDataSize(),
+		mipOffsets.data()
 	);
 
+	resMan->createImageView(texture->image.image, texture->image.format, &texture->image.view);
+	texture->image.sampler = defaultSampler;
+	texture->image.updateDescriptorInfo();
+
+	texture->name = path;
+	texture->type = TEXTURE_TYPE_DIFFUSE;
+	texture->refCount = 1;
+	texture->contentHash = header.contentHash;
+
+	texturePaths[path] = texture;
+	textureHashes[header.contentHash] = texture;
+
+	return texture;
+}
+
+bool Scene::isContainerUpToDate(const TextureContainerHeader & header, VkFormat format)
+{
+	// A container baked with other compression settings is rebaked
+	if (useTextureCompression && format == VK_FORMAT_R8G8B8A8_UNORM)
+		return header.blockFormat != BLOCK_FORMAT_NONE && header.quality == TEXTURE_COMPRESSION_QUALITY;
+	return header.blockFormat == BLOCK_FORMAT_NONE && header.format == static_cast<uint32_t>(format);
+}
+
+bool Scene::bakeTexture(const std::string & path, VkFormat format, std::vector<uint8_t>& blob)
+{
+	TRACE_ZONE("Scene::bakeTexture", "texture");
+
+	auto tStart = std::chrono::high_resolution_clock::now();
+
+	int texWidth, texHeight, texChannels;
+
+	stbi_uc* pixels;
+	{
+		TRACE_ZONE("stbi_load", "texture");
+		pixels = stbi_load(path.c_str(), &texWidth, &texHeight, &texChannels, STBI_rgb_alpha);
+	}
+	if (!pixels) {
+		return false;
+	}
+
+	BlockFormat blockFormat = BLOCK_FORMAT_NONE;
+	VkFormat storedFormat = format;
+	if (useTextureCompression && format == VK_FORMAT_R8G8B8A8_UNORM)
+	{
+		if (!BlockCompressor::hasAlpha(pixels, texWidth, texHeight)) {
+			blockFormat = BLOCK_FORMAT_BC1;
+			storedFormat = VK_FORMAT_BC1_RGB_UNORM_BLOCK;
+		}
+		else if (TEXTURE_COMPRESSION_QUALITY == BLOCK_QUALITY_HIGH) {
+			blockFormat = BLOCK_FORMAT_BC7;
+			storedFormat = VK_FORMAT_BC7_UNORM_BLOCK;
+		}
+		else {
+			blockFormat = BLOCK_FORMAT_BC3;
+			storedFormat = VK_FORMAT_BC3_UNORM_BLOCK;
+		}
+	}
+
+	TextureContainer::bake(path, static_cast<uint32_t>(storedFormat), blockFormat, TEXTURE_COMPRESSION_QUALITY, texWidth, texHeight, pixels, blob);
+
 	stbi_image_free(pixels);
 
+	auto tEnd = std::chrono::high_resolution_clock::now();
+
+	// One write per line, bakes run on several threads
+	std::ostringstream message;
+	message << "Baked " << path << " : " << static_cast<size_t>(texWidth) * texHeight * 4 << " -> "
+		<< ResourceManager::getImageDataSize(storedFormat, texWidth, texHeight) << " bytes in "
+		<< std::chrono::duration<double, std::milli>(tEnd - tStart).count() << " ms" << std::endl;
+
+	std::string containerPath = path + TEXTURE_CONTAINER_EXTENSION;
+	if (!TextureContainer::write(containerPath, blob))
+		message << "Could not write texture container " << containerPath << std::endl;
+
+	std::cout << message.str();
+	return true;
+}
+
+void Scene::bakeTextures()
+{
+	// Every diffuse file once, however many materials share it
+	std::vector<std::string> paths;
+	for (auto& material : materials)
+	{
+		if (!material.diffuseFile.empty())
+			paths.push_back(canonicalPath(assetPath + material.diffuseFile));
+	}
+	std::sort(paths.begin(), paths.end());
+	paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+
+	// Decoding and block compression dominate a cold load, acquireTexture then only maps the containers
+	jobs->parallelFor(paths.size(), 1, [&](size_t i, size_t) {
+		TextureContainer container;
+		if (container.open(paths[i] + TEXTURE_CONTAINER_EXTENSION, paths[i]) && isContainerUpToDate(container.getHeader(), VK_FORMAT_R8G8B8A8_UNORM))
+			return;
+
+		std::vector<uint8_t> blob;
+		bakeTexture(paths[i], VK_FORMAT_R8G8B8A8_UNORM, blob);
+	});
+}
+
+Texture * Scene::acquirePlaceholderTexture()
+{
+	auto pathIt = texturePaths.find(SCENE_PLACEHOLDER_TEXTURE);
+	if (pathIt != texturePaths.end())
+	{
+		Texture *texture = pathIt->second;
+		texture->refCount++;
+		resMan->updateResourceUsers(texture->image, texture->refCount);
+		return texture;
+	}
+
+	textures.emplace_back();
+	Texture *texture = &textures.back();
+
+	const uint8_t white[4] = { 255, 255, 255, 255 };
+	resMan->createImageInDevice(1, 1, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_USAGE_SAMPLED_BIT, &texture->image, white, sizeof(white));
 	resMan->createImageView(texture->image.image, texture->image.format, &texture->image.view);
 	texture->image.sampler = defaultSampler;
 	texture->image.updateDescriptorInfo();
 
-	return true;
+	texture->name = SCENE_PLACEHOLDER_TEXTURE;
+	texture->type = TEXTURE_TYPE_DIFFUSE;
+	texture->refCount = 1;
+
+	// Kept out of textureHashes, no file can share its content
+	texturePaths[SCENE_PLACEHOLDER_TEXTURE] = texture;
+
+	return texture;
+}
+
+void Scene::releaseTexture(Texture * texture)
+{
+	if (texture == nullptr) return;
+
+	if (--texture->refCount > 0)
+	{
+		resMan->updateResourceUsers(texture->image, texture->refCount);
+		return;
+	}
+
+	vkDestroyImageView(device, texture->image.view, nullptr);
+	resMan->destroyImage(texture->image);
+
+	for (auto it = texturePaths.begin(); it != texturePaths.end();)
+	{
+		if (it->second == texture)
+			it = texturePaths.erase(it);
+		else
+			++it;
+	}
+	if (texture->name != SCENE_PLACEHOLDER_TEXTURE)
+		textureHashes.erase(texture->contentHash);
 
+	textures.remove_if([texture](const Texture& t) { return &t == texture; });
 }
 
 void Scene::createSampler(VkSampler * sampler)
@@ -422,7 +1953,7 @@ void Scene::createSampler(VkSampler * sampler)
 	samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
 	samplerInfo.mipLodBias = 0.0f;
 	samplerInfo.minLod = 0.0f;
-	samplerInfo.maxLod = 0.0f;
+	samplerInfo.maxLod = VK_LOD_CLAMP_NONE;
 
 	VK_CHECK_RESULT(vkCreateSampler(device, &samplerInfo, nullptr, sampler));
 }
@@ -2,11 +2,72 @@
 
 #include"VkUtils.h"
 #include"ResourceManager.h"
+#include"SceneCache.h"
+#include"TextureContainer.h"
+#include"MeshOptimizer.h"
+#include"GeometryPool.h"
 
 #include<assimp\Importer.hpp>
 #include<assimp\scene.h>
 #include<assimp\postprocess.h>
 
+#include<list>
+#include<map>
+
+// Block compress RGBA8 textures when baking, the quality trades bake time against fidelity
+// Opaque textures become BC1, others BC3 on fast and BC7 on high quality
+#define TEXTURE_COMPRESSION_ENABLED 1
+#define TEXTURE_COMPRESSION_QUALITY BLOCK_QUALITY_FAST
+
+// Imported meshes are converted in chunks of MESH_EXTRACTION_CHUNK_SIZE vertices or faces on
+// MESH_EXTRACTION_THREADS threads of the job system, 0 uses all of them
+// The benchmark extracts every imported model once per thread count before the real import
+#define MESH_EXTRACTION_THREADS 0
+#define MESH_EXTRACTION_CHUNK_SIZE 65536
+#define MESH_EXTRACTION_BENCHMARK 0
+
+// Meshes per job of LOD selection and culling
+#define SCENE_JOB_GRAIN_SIZE 64
+
+// Reorder imported triangles for the post-transform cache and vertices for fetch locality,
+// the overdraw pass additionally draws outward facing clusters first
+// Optimized geometry goes into the scene cache, which is imported again after changing these
+#define MESH_OPTIMIZATION_ENABLED 1
+#define MESH_OVERDRAW_OPTIMIZATION_ENABLED 1
+
+// Meshes are drawn as meshlets from an indirect buffer the CPU fills each time the view changes,
+// this enables the frustum and normal cone tests that leave culled meshlets out of it
+#define CLUSTER_CULLING_ENABLED 1
+
+// Chain of simplified levels per mesh, each targets LOD_REDUCTION of the previous triangle count
+// The coarsest level whose error projects to at most LOD_ERROR_THRESHOLD pixels is drawn
+#define LOD_ENABLED 1
+#define LOD_MAX_LEVELS 4
+#define LOD_REDUCTION 0.5f
+#define LOD_MIN_TRIANGLES 128
+#define LOD_ERROR_THRESHOLD 1.0f
+
+// Vertex and index data is paged per mesh into fixed size device pools, the mapped scene cache is the backing store
+// Pages of visible meshes are uploaded nearest first, GEOMETRY_STREAMING_BUDGET bytes per frame unless a single page is larger,
+// and evicted after GEOMETRY_EVICT_FRAMES frames without being drawn
+// Until its pages land a mesh is drawn from another resident level, or skipped
+#define GEOMETRY_VERTEX_POOL_SIZE (64 * 1024 * 1024)
+#define GEOMETRY_INDEX_POOL_SIZE (32 * 1024 * 1024)
+#define GEOMETRY_STREAMING_BUDGET (4 * 1024 * 1024)
+#define GEOMETRY_EVICT_FRAMES 120
+
+// Copies of the imported model, each mesh keeps a range of SCENE_MAX_INSTANCES visible instance ids
+#define SCENE_MAX_INSTANCES 1024
+#define SCENE_INSTANCE_MATERIAL_NONE (~0u)
+
+// Material features scene.frag is specialized for, a combination of them indexes the material's pipeline
+#define MATERIAL_FEATURE_DIFFUSE_MAP 0x1
+#define MATERIAL_FEATURE_SPECULAR 0x2
+#define MATERIAL_FEATURE_ALPHA_BLEND 0x4
+#define MATERIAL_FEATURE_COUNT 8
+// Key of the 1x1 white texture bound for materials without a diffuse map
+#define SCENE_PLACEHOLDER_TEXTURE "<placeholder>"
+
 struct Vertex {
 	glm::vec3 pos;
 	glm::vec3 color;
@@ -49,6 +110,67 @@ struct Vertex {
 	}
 };
 
+// Vertex layouts a scene can be imported with
+enum VertexLayout
+{
+	VERTEX_LAYOUT_FULL = 0,		// Vertex, 44 bytes of floats
+	VERTEX_LAYOUT_COMPACT = 1	// CompactVertex, 16 bytes or 20 with vertex colors
+};
+
+// Quantized vertex
+// The position is UNORM16 within the bounds of its mesh, the normal is octahedral SNORM16
+// and the uv is half float. Color is cut from the stride when the scene has no vertex colors,
+// binding 1 then feeds constant white with a zero stride
+struct CompactVertex {
+	uint16_t pos[4];
+	int16_t normal[2];
+	uint16_t uv[2];
+	uint8_t color[4];
+
+	static uint32_t getStride(bool hasColor) {
+		return static_cast<uint32_t>(hasColor ? sizeof(CompactVertex) : offsetof(CompactVertex, color));
+	}
+
+	static std::array<VkVertexInputBindingDescription, 2> getBindingDescriptions(bool hasColor) {
+		std::array<VkVertexInputBindingDescription, 2> bindingDescriptions = {};
+		bindingDescriptions[0].binding = 0;
+		bindingDescriptions[0].stride = getStride(hasColor);
+		bindingDescriptions[0].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+
+		bindingDescriptions[1].binding = 1;
+		bindingDescriptions[1].stride = 0;
+		bindingDescriptions[1].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+
+		return bindingDescriptions;
+	}
+
+	static std::array<VkVertexInputAttributeDescription, 4> getAttributeDescriptions(bool hasColor) {
+		std::array<VkVertexInputAttributeDescription, 4> attributeDescriptions = {};
+
+		attributeDescriptions[0].binding = 0;
+		attributeDescriptions[0].location = 0;
+		attributeDescriptions[0].format = VK_FORMAT_R16G16B16A16_UNORM;
+		attributeDescriptions[0].offset = offsetof(CompactVertex, pos);
+
+		attributeDescriptions[1].binding = hasColor ? 0 : 1;
+		attributeDescriptions[1].location = 1;
+		attributeDescriptions[1].format = VK_FORMAT_R8G8B8A8_UNORM;
+		attributeDescriptions[1].offset = hasColor ? offsetof(CompactVertex, color) : 0;
+
+		attributeDescriptions[2].binding = 0;
+		attributeDescriptions[2].location = 2;
+		attributeDescriptions[2].format = VK_FORMAT_R16G16_SFLOAT;
+		attributeDescriptions[2].offset = offsetof(CompactVertex, uv);
+
+		attributeDescriptions[3].binding = 0;
+		attributeDescriptions[3].location = 3;
+		attributeDescriptions[3].format = VK_FORMAT_R16G16_SNORM;
+		attributeDescriptions[3].offset = offsetof(CompactVertex, normal);
+
+		return attributeDescriptions;
+	}
+};
+
 enum TextureType
 {
 	TEXTURE_TYPE_AMBIENT = 0,
@@ -63,6 +185,10 @@ struct Texture
 	Image image;
 	std::string name;
 	TextureType type;
+	// Number of materials sharing this texture through the scene's texture cache
+	uint32_t refCount = 0;
+	// Hash of the decoded texels, catches the same image stored under different paths
+	uint64_t contentHash = 0;
 };
 
 // Shader properites for a material
@@ -81,52 +207,163 @@ struct Material
 	std::string name;
 	// Material properties
 	MaterialProperties properties;
+	// Diffuse texture file relative to the asset path, empty if the material has none
+	std::string diffuseFile;
 	// The example only uses a diffuse channel
-	Texture diffuse;
+	// Owned by the scene's texture cache and shared between materials
+	Texture *diffuse;
 	// The material's descriptor contains the material descriptors
 	VkDescriptorSet descriptorSet;
+	// MATERIAL_FEATURE_* bits, instances overriding the material keep the features of the mesh's material
+	uint32_t features;
 	// Pointer to the pipeline used by this material
 	VkPipeline *pipeline;
 };
 
+// Material properties as laid out in the fragment shader's storage buffer, padded to the std430 stride
+struct MaterialData
+{
+	MaterialProperties properties;
+	float padding[3];
+};
+
+// Placement of one copy of the imported model, read by the vertex shader from a storage buffer
+struct InstanceData
+{
+	glm::mat4 model;
+	// Material whose properties replace those of every mesh of the copy, SCENE_INSTANCE_MATERIAL_NONE keeps the meshes' own
+	uint32_t materialIndex;
+	uint32_t padding[3];
+};
+
+// Range of the scene's host geometry that is streamed into a device pool on demand
+struct GeometryPage
+{
+	// Byte range in the backing store
+	VkDeviceSize dataOffset = 0;
+	VkDeviceSize dataSize = 0;
+
+	// Offset in the pool while resident
+	VkDeviceSize poolOffset = GEOMETRY_POOL_INVALID_OFFSET;
+	uint64_t lastUsedFrame = 0;
+
+	inline bool isResident() const { return poolOffset != GEOMETRY_POOL_INVALID_OFFSET; }
+};
+
+// Simplified level of a mesh, indexing the mesh's full resolution vertices
+struct MeshLod
+{
+	uint32_t indexCount;
+	// Largest deviation from the full mesh, in model space units
+	float error;
+
+	// Indices in the mesh's index type, paged from the scene's host copy of the level indices
+	GeometryPage page;
+};
+
 // Stores per-mesh Vulkan resources
 struct Mesh
 {
-	// Index of first index in the scene buffer
+	// Index of first index in the scene index data, counted in the mesh's index type
 	uint32_t indexBase;
 	uint32_t indexCount;
+	// Meshes with fewer than 65536 vertices store 16 bit indices
+	VkIndexType indexType;
+	// Range of the mesh's meshlets in the scene, also the mesh's slots in the indirect buffer
+	uint32_t meshletBase;
+	uint32_t meshletCount;
+	// Coarse levels of the mesh in the scene, selectedLod 0 is the full mesh and n is lods[lodBase + n - 1]
+	uint32_t lodBase = 0;
+	uint32_t lodCount = 0;
+	uint32_t selectedLod = 0;
+	// Model space bounding sphere, xyz center and w radius
+	glm::vec4 boundingSphere;
+	// Range of the mesh's vertices in the scene vertex data
+	uint32_t vertexBase;
+	uint32_t vertexCount;
+	// Full resolution pages, drawn from wherever they landed in the pools
+	GeometryPage vertexPage;
+	GeometryPage indexPage;
+	// Instances whose copy of the bounding sphere intersects the frustum, their ids are written at
+	// mesh index * SCENE_MAX_INSTANCES in the visible instance buffer and every draw of the mesh is instanced over them
+	uint32_t visibleInstanceCount = 0;
+	bool isVisible = false;
+	// Largest instance scale over distance among the visible instances, the LOD error of a model space unit at distance 1
+	float detailFactor = 0.0f;
 
 	// Pointer to the material used by this mesh
 	Material *material;
+
+	// Dequantization of compact positions, pos = decoded * scale + offset
+	// Passed to the vertex shader using push constant after the material properties
+	struct {
+		glm::vec4 scale = glm::vec4(1.0f);
+		glm::vec4 offset = glm::vec4(0.0f);
+	} bounds;
 };
 
+#define MESH_BOUNDS_PUSH_OFFSET 64
+// First visible instance id of the mesh, follows the bounds
+#define MESH_INSTANCE_PUSH_OFFSET (MESH_BOUNDS_PUSH_OFFSET + 32)
+
 class Scene
 {
 public:
-	Scene(VkDevice device, VkQueue queue, ResourceManager *resMan);
+	Scene(VkDevice device, VkQueue queue, ResourceManager *resMan, JobSystem *jobs, uint32_t frameCount, const VkPhysicalDeviceFeatures& enabledFeatures);
 	virtual ~Scene();
 
-	void import(const std::string& filePath);
-	void render(VkCommandBuffer cmdBuffer);
+	void import(const std::string& filePath, VertexLayout layout);
+	void render(VkCommandBuffer cmdBuffer, uint32_t frame);
+	// Records the draws of meshes [firstMesh, firstMesh + meshCount) with all state they need,
+	// slices can go into separate secondary command buffers recorded on different threads
+	// frame selects the uniform slice
+	void render(VkCommandBuffer cmdBuffer, uint32_t frame, uint32_t firstMesh, uint32_t meshCount);
+	inline uint32_t getMeshCount() { return static_cast<uint32_t>(meshes.size()); }
 
 	// my work
 	bool rebindTexture();
 
-	Buffer uniformBuffer;
+	// Per frame LOD selection and geometry streaming, rewrites the indirect draws when the view, the selection or the residency changed
+	// The command buffers stay valid, culled slots are written as empty draws
+	void update(float viewportHeight, bool isViewChanged);
+	inline uint32_t getClusterCount() { return static_cast<uint32_t>(meshlets.size()); }
+	inline uint32_t getVisibleClusterCount() { return visibleClusterCount; }
+	inline VkDeviceSize getVertexPoolUsage() { return vertexPool ? vertexPool->getUsedSize() : 0; }
+	inline VkDeviceSize getIndexPoolUsage() { return indexPool ? indexPool->getUsedSize() : 0; }
+	// Streaming totals since import, and the pages the last update left waiting for budget or pool space
+	inline VkDeviceSize getStreamedBytes() { return streamedBytes; }
+	inline uint32_t getEvictedPageCount() { return evictedPageCount; }
+	inline uint32_t getPendingPageCount() { return pendingPageCount; }
+
+	// Vertex input and shader variant matching the layout the scene was imported with
+	inline VertexLayout getVertexLayout() { return vertexLayout; }
+	void getVertexInputDescriptions(std::vector<VkVertexInputBindingDescription>& bindings, std::vector<VkVertexInputAttributeDescription>& attributes);
+
+	// One slice of uniformData per frame, written by writeUniforms before the frame is submitted
+	UniformRing uniformRing;
 	struct UniformData {
 		glm::mat4 projection;
 		glm::mat4 view;
-		glm::mat4 model;
 		glm::vec4 lightPos = glm::vec4(0.0f, 20.0f, 10.0f, 0.0f);
 	} uniformData;
 
+	// Copies uniformData into the slice the frame's command buffer reads
+	void writeUniforms(uint32_t frame);
+	// Copies the culled draws and visible instance ids into the frame's slices, only if they changed since the frame last used them
+	void writeDraws(uint32_t frame);
+
+	// Places another copy of the model, returns its index
+	// Instances are culled per mesh and take effect with the next update
+	uint32_t addInstance(const glm::mat4& model, uint32_t materialIndex = SCENE_INSTANCE_MATERIAL_NONE);
+	void setInstanceTransform(uint32_t instance, const glm::mat4& model);
+	inline uint32_t getInstanceCount() { return static_cast<uint32_t>(instances.size()); }
+
 	VkPipelineLayout pipelineLayout;
 
-	// Scene uses multiple pipelines
-	struct {
-		VkPipeline solid;
-		VkPipeline blending;
-	} pipelines;
+	// One pipeline per combination of material features, owned by the application and set before recording
+	// Only the combinations returned by getMaterialFeatureSets are used
+	std::array<VkPipeline, MATERIAL_FEATURE_COUNT> pipelines;
+	std::vector<uint32_t> getMaterialFeatureSets();
 
 private:
 	std::string assetPath = "";
@@ -134,17 +371,82 @@ private:
 	std::vector<Mesh> meshes;
 	std::vector<Material> materials;
 
-	//std::set<std::string> loadedTexture;
+	std::vector<Meshlet> meshlets;
+	uint32_t visibleClusterCount = 0;
+
+	std::vector<MeshLod> lods;
+	// Import result of the coarse levels, only kept when no cache could be written
+	std::vector<uint8_t> lodIndexData;
+
+	std::vector<InstanceData> instances;
+	// Culled instance ids, SCENE_MAX_INSTANCES per mesh, copied to the device with the draws
+	std::vector<uint32_t> visibleInstanceIds;
+	bool isInstancesChanged = false;
+	// Host storage buffers, mapped while they live
+	// The visible instance ids have one slice per frame in flight, the draws of a frame add its slice to instanceBase
+	Buffer instanceBuffer;
+	Buffer visibleInstanceBuffer;
+	Buffer materialBuffer;
+	InstanceData *pInstanceData = nullptr;
+	uint32_t *pVisibleInstanceData = nullptr;
+
+	// Device pools the pages are streamed into, every mesh draws from them
+	GeometryPool *vertexPool = nullptr;
+	GeometryPool *indexPool = nullptr;
+	// Backing store of the pages, the mapped scene cache or the import result when no cache could be written
+	SceneCache geometryCache;
+	std::vector<uint8_t> hostVertexData;
+	std::vector<uint8_t> hostIndexData;
+	const uint8_t *pVertexData = nullptr;
+	const uint8_t *pIndexData = nullptr;
+	const uint8_t *pLodIndexData = nullptr;
+	// Set when pages moved in the pools and the draws have to be rewritten
+	bool isResidencyChanged = false;
+	// Page copies of this frame, submitted together at the end of streamGeometry
+	std::vector<BufferUpdate> pageUploads;
+	VkDeviceSize streamedBytes = 0;
+	uint32_t evictedPageCount = 0;
+	uint32_t pendingPageCount = 0;
+	// Set once the queue was drained this frame
+	bool isQueueIdle = false;
+	uint64_t frameIndex = 0;
+
+	// World space frustum and camera of the last view change
+	std::array<glm::vec4, 6> frustumPlanes = {};
+	glm::vec3 cameraPosition = glm::vec3(0.0f);
+
+	VertexLayout vertexLayout = VERTEX_LAYOUT_FULL;
+	uint32_t vertexStride = sizeof(Vertex);
+	bool hasVertexColor = false;
+
+	// Texture cache, every texture is decoded, uploaded and resident only once
+	// std::list keeps the addresses stable since the resource heaps hold pointers to the images
+	std::list<Texture> textures;
+	// Lookup by canonical file path and by content hash
+	std::map<std::string, Texture*> texturePaths;
+	std::map<uint64_t, Texture*> textureHashes;
+	// Set when the device samples every block format the baker may pick
+	bool useTextureCompression = false;
 
 	VkDevice device;
 	VkQueue queue;
 	ResourceManager *resMan;
-
-	// We will be using one single index and vertex buffer
-	// containing vertices and indices for all meshes in the scene
-	// This allows us to keep memory allocations down
-	Buffer vertexBuffer;
-	Buffer indexBuffer;
+	// Import, LOD selection and culling are split over its threads
+	JobSystem *jobs;
+
+	// Constant white for compact vertices without color
+	Buffer constantColorBuffer;
+	// One VkDrawIndexedIndirectCommand per meshlet followed by one per mesh for its coarse level
+	// Culling writes drawCommands, writeDraws copies them into the indirect buffer's slice of the frame
+	std::vector<VkDrawIndexedIndirectCommand> drawCommands;
+	Buffer indirectBuffer;
+	VkDrawIndexedIndirectCommand *pIndirectData = nullptr;
+	// Bumped by every cull, a slice is stale while its version differs
+	uint64_t drawVersion = 0;
+	std::vector<uint64_t> drawSliceVersions;
+	uint32_t frameCount;
+	// Without the feature every meshlet slot is drawn by its own indirect call
+	bool useMultiDrawIndirect = false;
 
 	VkSampler defaultSampler;
 
@@ -159,10 +461,55 @@ private:
 
 	VkDescriptorSet descriptorSetScene;
 
-	void extractMeshes(const aiScene *scene);
+	// Sizes the arrays up front from the mesh counts, then converts the meshes on threadCount threads
+	void extractMeshes(const aiScene *scene, std::vector<Vertex>& vertices, std::vector<uint32_t>& indices, uint32_t threadCount);
+	// Extract the scene on 1, 2, 4, ... hardware threads, every run prints its time
+	void benchmarkExtraction(const aiScene *scene);
 	void extractMaterials(const aiScene *scene);
-
-	bool loadTextureFromFile(const std::string & fileName, VkFormat format, Texture *texture);
+	void prepareMaterials();
+	// Runs the mesh optimizer on every mesh in parallel, the meshes own disjoint vertex and index ranges
+	void optimizeMeshes(std::vector<Vertex>& vertices, std::vector<uint32_t>& indices);
+	void buildMeshlets(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices);
+	void generateLods(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices);
+	void createIndirectBuffer();
+	// Storage buffers of the instances, the visible instance ids and the material properties
+	void createInstanceBuffers();
+	void updateFrustum();
+	static bool isSphereVisible(const std::array<glm::vec4, 6>& planes, const glm::vec3& center, float radius);
+	// Sets the visible instances and the detail factor of every mesh
+	void cullInstances();
+	void cullClusters();
+
+	// Returns true when the level of any mesh changed
+	bool selectLods(float viewportHeight);
+	// Upload missing pages of visible meshes within the budget and evict stale ones
+	void streamGeometry();
+	bool makeResident(GeometryPage& page, GeometryPool* pool, const uint8_t* pSource, VkDeviceSize alignment);
+	void evict(GeometryPage& page, GeometryPool* pool);
+	// Drain the queue at most once per frame before pool memory is reused or draws are rewritten
+	void waitQueueIdle();
+	// Level the mesh can be drawn with right now, false while its vertices are not resident
+	bool findDrawableLod(const Mesh& mesh, uint32_t& level) const;
+	// Quantize the extracted vertices into the compact layout, per mesh bounds
+	void compactVertices(const std::vector<Vertex>& vertices, std::vector<uint8_t>& vertexData);
+	// Narrow the mesh local indices to 16 bit where the vertex count allows, sets the mesh index bases
+	void packIndices(const std::vector<uint32_t>& indices, std::vector<uint8_t>& indexData);
+	// Sets the page ranges of the meshes and creates the pools, call once the backing store is set
+	void createGeometryPools();
+
+	// Precompiled scene cache
+	bool importFromCache(const std::string& cachePath, const std::string& sourcePath);
+	void writeCache(const std::string& cachePath, const std::string& sourcePath, const void* vertexData, uint32_t vertexCount, const void* indexData, uint32_t indexDataSize);
+
+	Texture* acquireTexture(const std::string & fileName, VkFormat format);
+	bool isContainerUpToDate(const TextureContainerHeader& header, VkFormat format);
+	// Decodes the image, bakes its container into blob and writes it next to the image, false when the image cannot be loaded
+	bool bakeTexture(const std::string& path, VkFormat format, std::vector<uint8_t>& blob);
+	// Bakes the stale containers of all material textures in parallel before they are acquired one by one
+	void bakeTextures();
+	// Shared 1x1 white texture, keeps the material descriptor set valid when nothing is sampled
+	Texture *acquirePlaceholderTexture();
+	void releaseTexture(Texture *texture);
 	//Mesh processMesh(aiMesh * aMesh);
 	//std::vector<Texture> loadMaterialTextures(aiMaterial *mat, aiTextureType type);
 	//Image importTextureFromFile(const std::string& filePath);
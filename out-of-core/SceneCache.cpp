@@ -0,0 +1,171 @@
+#include "SceneCache.h"
+#include "DataUtils.h"
+
+#include <vulkan\vulkan.h>
+
+// Sections start on 16 byte boundaries
+static uint64_t alignSection(uint64_t offset)
+{
+	return (offset + 15) & ~static_cast<uint64_t>(15);
+}
+
+// Every index and range of a mesh has to point into its section, a corrupt cache is rejected instead of read out of bounds
+static bool isMeshValid(const SceneCacheHeader& header, const SceneCacheMesh& mesh, const Meshlet* pMeshlets, const SceneCacheLod* pLods)
+{
+	if (mesh.indexType != VK_INDEX_TYPE_UINT16 && mesh.indexType != VK_INDEX_TYPE_UINT32)
+		return false;
+
+	uint64_t indexSize = mesh.indexType == VK_INDEX_TYPE_UINT16 ? sizeof(uint16_t) : sizeof(uint32_t);
+
+	bool isValid =
+		mesh.materialIndex < header.materialCount &&
+		static_cast<uint64_t>(mesh.vertexBase) + mesh.vertexCount <= header.vertexCount &&
+		(static_cast<uint64_t>(mesh.indexBase) + mesh.indexCount) * indexSize <= header.indexDataSize &&
+		static_cast<uint64_t>(mesh.meshletBase) + mesh.meshletCount <= header.meshletCount &&
+		static_cast<uint64_t>(mesh.lodBase) + mesh.lodCount <= header.lodCount;
+
+	// Meshlets are drawn straight from the mesh's index range
+	for (uint32_t m = mesh.meshletBase; m < mesh.meshletBase + mesh.meshletCount && isValid; m++)
+		isValid = pMeshlets[m].indexOffset + static_cast<uint64_t>(pMeshlets[m].triangleCount) * 3 <= mesh.indexCount;
+
+	// Coarse levels are drawn in the mesh's index type from their byte range
+	for (uint32_t l = mesh.lodBase; l < mesh.lodBase + mesh.lodCount && isValid; l++)
+		isValid =
+			static_cast<uint64_t>(pLods[l].dataOffset) + pLods[l].dataSize <= header.lodIndexDataSize &&
+			pLods[l].indexCount * indexSize <= pLods[l].dataSize;
+
+	return isValid;
+}
+
+
+SceneCache::SceneCache()
+{
+}
+
+
+SceneCache::~SceneCache()
+{
+	close();
+}
+
+bool SceneCache::open(const std::string & cachePath, const std::string & sourcePath, uint32_t vertexLayout, const SceneCacheImportOptions& importOptions)
+{
+	close();
+
+	uint64_t sourceSize, sourceTime;
+	if (!MappedFile::getFileStamp(sourcePath, &sourceSize, &sourceTime))
+		return false;
+
+	if (!file.open(cachePath))
+		return false;
+
+	if (file.size() < sizeof(SceneCacheHeader)) {
+		file.close();
+		return false;
+	}
+
+	const SceneCacheHeader* pHeader = static_cast<const SceneCacheHeader*>(file.data());
+
+	bool isValid =
+		pHeader->magic == SCENE_CACHE_MAGIC &&
+		pHeader->version == SCENE_CACHE_VERSION &&
+		pHeader->sourceSize == sourceSize &&
+		pHeader->sourceTime == sourceTime &&
+		pHeader->vertexLayout == vertexLayout &&
+		pHeader->importOptions.flags == importOptions.flags &&
+		pHeader->importOptions.lodMaxLevels == importOptions.lodMaxLevels &&
+		pHeader->importOptions.lodMinTriangles == importOptions.lodMinTriangles &&
+		pHeader->importOptions.lodReduction == importOptions.lodReduction;
+
+	// Every section has to lie within the file
+	isValid = isValid &&
+		pHeader->meshOffset + static_cast<uint64_t>(pHeader->meshCount) * sizeof(SceneCacheMesh) <= file.size() &&
+		pHeader->materialOffset + static_cast<uint64_t>(pHeader->materialCount) * sizeof(SceneCacheMaterial) <= file.size() &&
+		pHeader->vertexOffset + static_cast<uint64_t>(pHeader->vertexCount) * pHeader->vertexStride <= file.size() &&
+		pHeader->indexOffset + pHeader->indexDataSize <= file.size() &&
+		pHeader->meshletOffset + static_cast<uint64_t>(pHeader->meshletCount) * sizeof(Meshlet) <= file.size() &&
+		pHeader->lodOffset + static_cast<uint64_t>(pHeader->lodCount) * sizeof(SceneCacheLod) <= file.size() &&
+		pHeader->lodIndexOffset + pHeader->lodIndexDataSize <= file.size();
+
+	const SceneCacheMesh* pMeshes = reinterpret_cast<const SceneCacheMesh*>(getSection(pHeader->meshOffset));
+	const Meshlet* pMeshlets = reinterpret_cast<const Meshlet*>(getSection(pHeader->meshletOffset));
+	const SceneCacheLod* pLods = reinterpret_cast<const SceneCacheLod*>(getSection(pHeader->lodOffset));
+	for (uint32_t i = 0; i < pHeader->meshCount && isValid; i++)
+		isValid = isMeshValid(*pHeader, pMeshes[i], pMeshlets, pLods);
+
+	if (!isValid) {
+		file.close();
+		return false;
+	}
+
+	header = pHeader;
+
+	return true;
+}
+
+void SceneCache::close()
+{
+	file.close();
+	header = nullptr;
+}
+
+bool SceneCache::write(
+	const std::string & cachePath,
+	const std::string & sourcePath,
+	uint32_t vertexLayout,
+	const SceneCacheImportOptions& importOptions,
+	uint32_t vertexStride,
+	const std::vector<SceneCacheMesh>& meshes,
+	const std::vector<SceneCacheMaterial>& materials,
+	const std::vector<Meshlet>& meshlets,
+	const std::vector<SceneCacheLod>& lods,
+	const std::vector<uint8_t>& lodIndexData,
+	const void * vertexData,
+	uint32_t vertexCount,
+	const void * indexData,
+	uint32_t indexDataSize)
+{
+	SceneCacheHeader header = {};
+	header.magic = SCENE_CACHE_MAGIC;
+	header.version = SCENE_CACHE_VERSION;
+
+	if (!MappedFile::getFileStamp(sourcePath, &header.sourceSize, &header.sourceTime))
+		return false;
+
+	header.vertexLayout = vertexLayout;
+	header.importOptions = importOptions;
+	header.vertexStride = vertexStride;
+	header.vertexCount = vertexCount;
+	header.indexDataSize = indexDataSize;
+	header.meshCount = static_cast<uint32_t>(meshes.size());
+	header.materialCount = static_cast<uint32_t>(materials.size());
+	header.meshletCount = static_cast<uint32_t>(meshlets.size());
+	header.lodCount = static_cast<uint32_t>(lods.size());
+	header.lodIndexDataSize = static_cast<uint32_t>(lodIndexData.size());
+
+	header.meshOffset = alignSection(sizeof(SceneCacheHeader));
+	header.materialOffset = alignSection(header.meshOffset + meshes.size() * sizeof(SceneCacheMesh));
+	header.vertexOffset = alignSection(header.materialOffset + materials.size() * sizeof(SceneCacheMaterial));
+	header.indexOffset = alignSection(header.vertexOffset + static_cast<uint64_t>(vertexCount) * vertexStride);
+	header.meshletOffset = alignSection(header.indexOffset + indexDataSize);
+	header.lodOffset = alignSection(header.meshletOffset + meshlets.size() * sizeof(Meshlet));
+	header.lodIndexOffset = alignSection(header.lodOffset + lods.size() * sizeof(SceneCacheLod));
+
+	return DataUtils::writeFile(cachePath, [&](std::ostream& os) {
+		const char padding[16] = {};
+		auto writeSection = [&](uint64_t offset, const void* pData, uint64_t size) {
+			uint64_t position = static_cast<uint64_t>(os.tellp());
+			os.write(padding, static_cast<std::streamsize>(offset - position));
+			os.write(static_cast<const char*>(pData), static_cast<std::streamsize>(size));
+		};
+
+		os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		writeSection(header.meshOffset, meshes.data(), meshes.size() * sizeof(SceneCacheMesh));
+		writeSection(header.materialOffset, materials.data(), materials.size() * sizeof(SceneCacheMaterial));
+		writeSection(header.vertexOffset, vertexData, static_cast<uint64_t>(vertexCount) * vertexStride);
+		writeSection(header.indexOffset, indexData, indexDataSize);
+		writeSection(header.meshletOffset, meshlets.data(), meshlets.size() * sizeof(Meshlet));
+		writeSection(header.lodOffset, lods.data(), lods.size() * sizeof(SceneCacheLod));
+		writeSection(header.lodIndexOffset, lodIndexData.data(), lodIndexData.size());
+	});
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include "MappedFile.h"
+#include "MeshOptimizer.h"
+
+#include <vector>
+
+// Precompiled binary scene, written after the first Assimp import and memory mapped on later loads
+// Bump the version whenever the layout of the stored vertex, index, mesh or material data changes
+#define SCENE_CACHE_MAGIC 0x53434F4F // "OOCS"
+#define SCENE_CACHE_VERSION 6
+#define SCENE_CACHE_EXTENSION ".ooc"
+
+// Import options baked into the stored geometry, a cache written with other options is stale
+#define SCENE_CACHE_OPTION_MESH_OPTIMIZATION 0x1
+#define SCENE_CACHE_OPTION_OVERDRAW_OPTIMIZATION 0x2
+#define SCENE_CACHE_OPTION_LOD 0x4
+
+#define SCENE_CACHE_NAME_LENGTH 64
+#define SCENE_CACHE_PATH_LENGTH 260
+
+struct SceneCacheImportOptions {
+	// SCENE_CACHE_OPTION_* flags
+	uint32_t flags;
+	// Parameters of the LOD chains, zero unless SCENE_CACHE_OPTION_LOD is set
+	uint32_t lodMaxLevels;
+	uint32_t lodMinTriangles;
+	float lodReduction;
+};
+
+struct SceneCacheHeader {
+	uint32_t magic;
+	uint32_t version;
+	// Stamp of the source model, the cache is stale once it changes
+	uint64_t sourceSize;
+	uint64_t sourceTime;
+
+	// VertexLayout of the stored vertices, the stride tells whether compact vertices carry color
+	uint32_t vertexLayout;
+	uint32_t vertexStride;
+	uint32_t vertexCount;
+	// Meshes mix 16 and 32 bit indices, so the index section is sized in bytes
+	uint32_t indexDataSize;
+	uint32_t meshCount;
+	uint32_t materialCount;
+	uint32_t meshletCount;
+	uint32_t lodCount;
+	// Coarse level indices, in the index type of their mesh
+	uint32_t lodIndexDataSize;
+	// Settings the geometry was imported with
+	SceneCacheImportOptions importOptions;
+	uint32_t reserved;
+
+	// Byte offsets of the sections from the start of the file
+	uint64_t meshOffset;
+	uint64_t materialOffset;
+	uint64_t vertexOffset;
+	uint64_t indexOffset;
+	uint64_t meshletOffset;
+	uint64_t lodOffset;
+	uint64_t lodIndexOffset;
+};
+
+struct SceneCacheMesh {
+	uint32_t indexBase;
+	uint32_t indexCount;
+	uint32_t vertexBase;
+	uint32_t vertexCount;
+	uint32_t materialIndex;
+	uint32_t indexType;
+	// Range of the mesh's meshlets in the meshlet section
+	uint32_t meshletBase;
+	uint32_t meshletCount;
+	// Dequantization of compact positions
+	float boundsScale[4];
+	float boundsOffset[4];
+	// Range of the mesh's coarse levels in the LOD section
+	uint32_t lodBase;
+	uint32_t lodCount;
+	uint32_t reserved[2];
+	float boundingSphere[4];
+};
+
+struct SceneCacheLod {
+	uint32_t indexCount;
+	// Byte range within the LOD index section
+	uint32_t dataOffset;
+	uint32_t dataSize;
+	float error;
+};
+
+struct SceneCacheMaterial {
+	char name[SCENE_CACHE_NAME_LENGTH];
+	// Diffuse texture relative to the asset path, empty if the material has none
+	char diffuseFile[SCENE_CACHE_PATH_LENGTH];
+	float ambient[4];
+	float diffuse[4];
+	float specular[4];
+	float opacity;
+};
+
+class SceneCache
+{
+public:
+	SceneCache();
+	virtual ~SceneCache();
+
+	// Map the cache and validate it against the source model, fails if missing, stale, of another vertex layout or other import options
+	bool open(const std::string& cachePath, const std::string& sourcePath, uint32_t vertexLayout, const SceneCacheImportOptions& importOptions);
+	void close();
+
+	inline const SceneCacheHeader& getHeader() { return *header; }
+	inline const SceneCacheMesh* getMeshes() { return reinterpret_cast<const SceneCacheMesh*>(getSection(header->meshOffset)); }
+	inline const SceneCacheMaterial* getMaterials() { return reinterpret_cast<const SceneCacheMaterial*>(getSection(header->materialOffset)); }
+	inline const void* getVertexData() { return getSection(header->vertexOffset); }
+	inline const void* getIndexData() { return getSection(header->indexOffset); }
+	inline const Meshlet* getMeshlets() { return reinterpret_cast<const Meshlet*>(getSection(header->meshletOffset)); }
+	inline const SceneCacheLod* getLods() { return reinterpret_cast<const SceneCacheLod*>(getSection(header->lodOffset)); }
+	inline const void* getLodIndexData() { return getSection(header->lodIndexOffset); }
+
+	static bool write(
+		const std::string& cachePath,
+		const std::string& sourcePath,
+		uint32_t vertexLayout,
+		const SceneCacheImportOptions& importOptions,
+		uint32_t vertexStride,
+		const std::vector<SceneCacheMesh>& meshes,
+		const std::vector<SceneCacheMaterial>& materials,
+		const std::vector<Meshlet>& meshlets,
+		const std::vector<SceneCacheLod>& lods,
+		const std::vector<uint8_t>& lodIndexData,
+		const void* vertexData,
+		uint32_t vertexCount,
+		const void* indexData,
+		uint32_t indexDataSize);
+
+private:
+	MappedFile file;
+	const SceneCacheHeader* header = nullptr;
+
+	inline const uint8_t* getSection(uint64_t offset) { return static_cast<const uint8_t*>(file.data()) + offset; }
+};
@@ -0,0 +1,109 @@
+#include "ShaderCache.h"
+#include "MappedFile.h"
+#include "DataUtils.h"
+
+#include <cstring>
+
+
+ShaderCache::ShaderCache(VkDevice device) : device(device)
+{
+}
+
+
+ShaderCache::~ShaderCache()
+{
+	for (auto& module : modules)
+		vkDestroyShaderModule(device, module.second.module, nullptr);
+}
+
+VkShaderModule ShaderCache::acquire(const std::string & filePath)
+{
+	uint64_t size = 0;
+	uint64_t modifiedTime = 0;
+	if (!MappedFile::getFileStamp(filePath, &size, &modifiedTime))
+		throw std::runtime_error("Could not open shader file \"" + filePath + "\"");
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	// Unchanged file whose module is still alive, nothing is read
+	auto fileIt = files.find(filePath);
+	if (fileIt != files.end() && fileIt->second.size == size && fileIt->second.modifiedTime == modifiedTime)
+	{
+		auto range = modules.equal_range(fileIt->second.codeHash);
+		for (auto moduleIt = range.first; moduleIt != range.second; ++moduleIt)
+		{
+			if (moduleIt->second.module != fileIt->second.module)
+				continue;
+
+			moduleIt->second.refCount++;
+			return moduleIt->second.module;
+		}
+	}
+
+	// The mapping is page aligned, so the words are passed to the driver without a copy
+	MappedFile file;
+	if (!file.open(filePath) || file.size() % sizeof(uint32_t) != 0)
+		throw std::runtime_error("Could not read shader file \"" + filePath + "\"");
+
+	const uint32_t* pCode = static_cast<const uint32_t*>(file.data());
+	size_t wordCount = file.size() / sizeof(uint32_t);
+	uint64_t codeHash = DATA_HASH_SEED;
+	DataUtils::hashBytes(codeHash, pCode, file.size());
+
+	ShaderFile shaderFile = {};
+	shaderFile.size = size;
+	shaderFile.modifiedTime = modifiedTime;
+	shaderFile.codeHash = codeHash;
+
+	// Same code under another name
+	auto range = modules.equal_range(codeHash);
+	for (auto moduleIt = range.first; moduleIt != range.second; ++moduleIt)
+	{
+		const std::vector<uint32_t>& code = moduleIt->second.code;
+		if (code.size() != wordCount || memcmp(code.data(), pCode, file.size()) != 0)
+			continue;
+
+		moduleIt->second.refCount++;
+		shaderFile.module = moduleIt->second.module;
+		files[filePath] = shaderFile;
+		return moduleIt->second.module;
+	}
+
+	VkShaderModuleCreateInfo moduleCreateInfo = {};
+	moduleCreateInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+	moduleCreateInfo.codeSize = file.size();
+	moduleCreateInfo.pCode = pCode;
+
+	ShaderModule module = {};
+	VK_CHECK_RESULT(vkCreateShaderModule(device, &moduleCreateInfo, nullptr, &module.module));
+	module.refCount = 1;
+	module.code.assign(pCode, pCode + wordCount);
+	shaderFile.module = module.module;
+	files[filePath] = shaderFile;
+	modules.insert(std::make_pair(codeHash, std::move(module)));
+
+	return shaderFile.module;
+}
+
+void ShaderCache::release(VkShaderModule shaderModule)
+{
+	if (shaderModule == VK_NULL_HANDLE)
+		return;
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	for (auto it = modules.begin(); it != modules.end(); ++it)
+	{
+		if (it->second.module != shaderModule)
+			continue;
+
+		if (--it->second.refCount == 0)
+		{
+			vkDestroyShaderModule(device, it->second.module, nullptr);
+			modules.erase(it);
+		}
+		return;
+	}
+
+	throw std::invalid_argument("f(x):release shader module is not owned by the cache.");
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "VkUtils.h"
+
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Shader modules shared by every pipeline that uses the same SPIR-V
+// Files are memory mapped and the mapping is handed to the driver directly, modules are keyed by a hash
+// of their code so copies of one shader share a module, and a file is only read again once its stamp changes
+// A hash hit is only taken once the stored code matches, so colliding shaders get modules of their own
+// Safe to use from job threads
+class ShaderCache
+{
+public:
+	ShaderCache(VkDevice device);
+	// Destroys modules that were never released
+	virtual ~ShaderCache();
+
+	// The module of the file's code, the first acquire creates it
+	// Throws if the file cannot be read
+	VkShaderModule acquire(const std::string& filePath);
+	// Destroys the module once the last user released it
+	void release(VkShaderModule shaderModule);
+
+	inline uint32_t getModuleCount() { std::lock_guard<std::mutex> lock(mutex); return static_cast<uint32_t>(modules.size()); }
+
+private:
+	struct ShaderModule {
+		VkShaderModule module;
+		uint32_t refCount;
+		// Compared on a hash hit
+		std::vector<uint32_t> code;
+	};
+
+	// Stamp of a file when its code was last hashed
+	struct ShaderFile {
+		uint64_t size;
+		uint64_t modifiedTime;
+		uint64_t codeHash;
+		VkShaderModule module;
+	};
+
+	VkDevice device;
+
+	std::mutex mutex;
+	std::unordered_multimap<uint64_t, ShaderModule> modules;
+	std::map<std::string, ShaderFile> files;
+};
@@ -1,4 +1,5 @@
 #include "TextOverlay.h"
+#include "Trace.h"
 
 
 
@@ -10,13 +11,18 @@ TextOverlay::TextOverlay(VkDevice device,
 	VkFormat depthformat,
 	uint32_t *framebufferwidth,
 	uint32_t *framebufferheight,
-	std::vector<VkPipelineShaderStageCreateInfo> shaderstages)
+	std::vector<VkPipelineShaderStageCreateInfo> shaderstages,
+	std::vector<VkPipelineShaderStageCreateInfo> graphshaderstages,
+	VkPipelineCache pipelineCache,
+	VkRenderPass sceneRenderPass)
 {
 	this->device = device;
 	this->resMan = resMan;
 	this->commandPool = cmdPool;
 	this->colorFormat = colorformat;
 	this->depthFormat = depthformat;
+	this->pipelineCache = pipelineCache;
+	this->sceneRenderPass = sceneRenderPass;
 
 	this->frameBuffers.resize(framebuffers.size());
 	for (uint32_t i = 0; i < framebuffers.size(); i++)
@@ -25,11 +31,24 @@ TextOverlay::TextOverlay(VkDevice device,
 	}
 
 	this->shaderStages = shaderstages;
+	this->graphShaderStages = graphshaderstages;
 
 	this->frameBufferWidth = framebufferwidth;
 	this->frameBufferHeight = framebufferheight;
 
 	cmdBuffers.resize(framebuffers.size());
+	inlineCmdBuffers.resize(framebuffers.size());
+
+	textVertices.resize(TEXTOVERLAY_MAX_CHAR_COUNT * TEXTOVERLAY_VERTICES_PER_CHAR);
+	frameTextVersions.resize(framebuffers.size(), 0);
+
+	graphSamples.resize(TEXTOVERLAY_GRAPH_LINE_COUNT * TEXTOVERLAY_GRAPH_SAMPLE_COUNT, 0.0f);
+	frameGraphVersions.resize(framebuffers.size(), 0);
+	for (auto& line : graphLines)
+	{
+		line.rect = glm::vec4(0.0f);
+		line.color = glm::vec4(1.0f);
+	}
 
 	VkSemaphoreCreateInfo semInfo = {};
 	semInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
@@ -40,26 +59,34 @@ TextOverlay::TextOverlay(VkDevice device,
 	prepareResources();
 	prepareRenderPass();
 	preparePipeline();
+	updateCommandBuffers();
 }
 
 
 TextOverlay::~TextOverlay()
 {
 	vkFreeCommandBuffers(device, commandPool, static_cast<uint32_t>(cmdBuffers.size()), cmdBuffers.data());
+	vkFreeCommandBuffers(device, commandPool, static_cast<uint32_t>(inlineCmdBuffers.size()), inlineCmdBuffers.data());
 	vkDestroySampler(device, sampler, nullptr);
 	vkDestroySemaphore(device, textOverlayComplete, nullptr);
 	vkDestroyDescriptorSetLayout(device, descriptorSetLayout, nullptr);
 	vkDestroyDescriptorPool(device, descriptorPool, nullptr);
 	vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
-	vkDestroyPipelineCache(device, pipelineCache, nullptr);
 	vkDestroyPipeline(device, pipeline, nullptr);
+	vkDestroyPipelineLayout(device, graphPipelineLayout, nullptr);
+	vkDestroyPipeline(device, graphPipeline, nullptr);
 	vkDestroyRenderPass(device, renderPass, nullptr);
+	resMan->destroyBuffer(vertexBuffer);
+	resMan->destroyBuffer(indexBuffer);
+	resMan->destroyBuffer(indirectBuffer);
+	resMan->destroyBuffer(graphBuffer);
+	resMan->destroyBuffer(graphIndirectBuffer);
 }
 
 void TextOverlay::beginTextUpdate()
 {
-	resMan->mapMemory(vertexBuffer.allocation, (void **)&mapped);
-	//VK_CHECK_RESULT(vkMapMemory(device, memory, 0, VK_WHOLE_SIZE, 0, (void **)&mapped));
+	// Frames may still read their slices, so the text is written to the host copy first
+	mapped = textVertices.data();
 	numLetters = 0;
 }
 
@@ -96,6 +123,10 @@ void TextOverlay::addText(std::string text, float x, float y, TextAlign align)
 	// Generate a uv mapped quad per char in the new text
 	for (auto letter : text)
 	{
+		// Chars beyond the buffer are dropped
+		if (numLetters == TEXTOVERLAY_MAX_CHAR_COUNT)
+			break;
+
 		stb_fontchar *charData = &stbFontData[(uint32_t)letter - STB_FIRST_CHAR];
 
 		mapped->x = (x + (float)charData->x0 * charW);
@@ -130,12 +161,78 @@ void TextOverlay::addText(std::string text, float x, float y, TextAlign align)
 
 void TextOverlay::endTextUpdate()
 {
-	resMan->unmapMemory(vertexBuffer.allocation);
-	//vkUnmapMemory(vulkanDevice->logicalDevice, memory);
 	mapped = nullptr;
+	textVersion++;
+}
+
+void TextOverlay::setGraphRect(float x, float y, float width, float height)
+{
+	float fbW = (float)*frameBufferWidth;
+	float fbH = (float)*frameBufferHeight;
+	glm::vec4 rect((x / fbW * 2.0f) - 1.0f, (y / fbH * 2.0f) - 1.0f, width / fbW * 2.0f, height / fbH * 2.0f);
+
+	for (auto& line : graphLines)
+		line.rect = rect;
+	hasGraph = true;
+
+	updateCommandBuffers();
+}
+
+void TextOverlay::setGraphColor(uint32_t line, glm::vec4 color)
+{
+	if (line >= TEXTOVERLAY_GRAPH_LINE_COUNT)
+		throw std::invalid_argument("f(x):setGraphColor line is out of range.");
+
+	graphLines[line].color = color;
 	updateCommandBuffers();
 }
 
+void TextOverlay::setGraphRange(float range)
+{
+	if (range <= 0.0f || range == graphRange)
+		return;
+
+	graphRange = range;
+	graphVersion++;
+}
+
+void TextOverlay::addGraphSample(const std::array<float, TEXTOVERLAY_GRAPH_LINE_COUNT>& values)
+{
+	for (uint32_t line = 0; line < TEXTOVERLAY_GRAPH_LINE_COUNT; line++)
+		graphSamples[line * TEXTOVERLAY_GRAPH_SAMPLE_COUNT + graphHead] = values[line];
+
+	graphHead = (graphHead + 1) % TEXTOVERLAY_GRAPH_SAMPLE_COUNT;
+	graphVersion++;
+}
+
+void TextOverlay::updateFrame(uint32_t bufferindex)
+{
+	if (frameTextVersions[bufferindex] != textVersion)
+	{
+		size_t sliceOffset = static_cast<size_t>(bufferindex) * TEXTOVERLAY_MAX_CHAR_COUNT * TEXTOVERLAY_VERTICES_PER_CHAR;
+		memcpy(pVertexData + sliceOffset, textVertices.data(), numLetters * TEXTOVERLAY_VERTICES_PER_CHAR * sizeof(glm::vec4));
+		frameTextVersions[bufferindex] = textVersion;
+	}
+
+	if (frameGraphVersions[bufferindex] != graphVersion)
+	{
+		// Oldest sample first, so the newest one is always at the right edge
+		float *pDst = pGraphData + bufferindex * TEXTOVERLAY_GRAPH_LINE_COUNT * TEXTOVERLAY_GRAPH_SAMPLE_COUNT;
+		for (uint32_t line = 0; line < TEXTOVERLAY_GRAPH_LINE_COUNT; line++)
+		{
+			const float *pSrc = &graphSamples[line * TEXTOVERLAY_GRAPH_SAMPLE_COUNT];
+			for (uint32_t i = 0; i < TEXTOVERLAY_GRAPH_SAMPLE_COUNT; i++)
+				*pDst++ = std::min(pSrc[(graphHead + i) % TEXTOVERLAY_GRAPH_SAMPLE_COUNT] / graphRange, 1.0f);
+		}
+		frameGraphVersions[bufferindex] = graphVersion;
+	}
+
+	// An empty draw hides the overlay without recording the scene again
+	pDrawCommands[bufferindex].indexCount = visible ? numLetters * TEXTOVERLAY_INDICES_PER_CHAR : 0;
+	for (uint32_t line = 0; line < TEXTOVERLAY_GRAPH_LINE_COUNT; line++)
+		pGraphDrawCommands[bufferindex * TEXTOVERLAY_GRAPH_LINE_COUNT + line].vertexCount = (visible && hasGraph) ? TEXTOVERLAY_GRAPH_SAMPLE_COUNT : 0;
+}
+
 void TextOverlay::updateCommandBuffers()
 {
 	VkCommandBufferBeginInfo cmdBufInfo = {};
@@ -154,50 +251,83 @@ void TextOverlay::updateCommandBuffers()
 	renderPassBeginInfo.clearValueCount = 2;
 	renderPassBeginInfo.pClearValues = clearValues;
 
+	// The overlay pass has the formats of the scene pass, so its pipeline is valid in both
+	VkCommandBufferInheritanceInfo inheritanceInfo = {};
+	inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+	inheritanceInfo.renderPass = sceneRenderPass;
+	inheritanceInfo.subpass = 0;
+
+	VkCommandBufferBeginInfo inlineBufInfo = {};
+	inlineBufInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	inlineBufInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+	inlineBufInfo.pInheritanceInfo = &inheritanceInfo;
+
 	for (int32_t i = 0; i < cmdBuffers.size(); ++i)
 	{
 		renderPassBeginInfo.framebuffer = *frameBuffers[i];
 
 		VK_CHECK_RESULT(vkBeginCommandBuffer(cmdBuffers[i], &cmdBufInfo));
-
 		vkCmdBeginRenderPass(cmdBuffers[i], &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+		recordDraw(cmdBuffers[i], i);
+		vkCmdEndRenderPass(cmdBuffers[i]);
+		VK_CHECK_RESULT(vkEndCommandBuffer(cmdBuffers[i]));
 
-		VkViewport viewport = {};
-		viewport.height = (float)*frameBufferWidth;
-		viewport.width = (float)*frameBufferHeight;
-		viewport.minDepth = (float) 0.0f;
-		viewport.maxDepth = (float) 1.0f;
-		vkCmdSetViewport(cmdBuffers[i], 0, 1, &viewport);
-
-		VkRect2D scissor = {};
-		scissor.extent.width = *frameBufferWidth;
-		scissor.extent.height = *frameBufferHeight;
-		scissor.offset.x = 0;
-		scissor.offset.y = 0;
-		vkCmdSetScissor(cmdBuffers[i], 0, 1, &scissor);
-
-		vkCmdBindPipeline(cmdBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
-		vkCmdBindDescriptorSets(cmdBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSet, 0, NULL);
-
-		VkDeviceSize offsets = 0;
-		vkCmdBindVertexBuffers(cmdBuffers[i], 0, 1, &vertexBuffer.buffer, &offsets);
-		vkCmdBindVertexBuffers(cmdBuffers[i], 1, 1, &vertexBuffer.buffer, &offsets);
-		for (uint32_t j = 0; j < numLetters; j++)
-		{
-			vkCmdDraw(cmdBuffers[i], 4, 1, j * 4, 0);
-		}
+		inheritanceInfo.framebuffer = *frameBuffers[i];
 
-		vkCmdEndRenderPass(cmdBuffers[i]);
+		VK_CHECK_RESULT(vkBeginCommandBuffer(inlineCmdBuffers[i], &inlineBufInfo));
+		recordDraw(inlineCmdBuffers[i], i);
+		VK_CHECK_RESULT(vkEndCommandBuffer(inlineCmdBuffers[i]));
+	}
+}
 
-		VK_CHECK_RESULT(vkEndCommandBuffer(cmdBuffers[i]));
+void TextOverlay::recordDraw(VkCommandBuffer cmdBuffer, uint32_t bufferindex)
+{
+	VkViewport viewport = {};
+	viewport.width = (float)*frameBufferWidth;
+	viewport.height = (float)*frameBufferHeight;
+	viewport.minDepth = (float) 0.0f;
+	viewport.maxDepth = (float) 1.0f;
+	vkCmdSetViewport(cmdBuffer, 0, 1, &viewport);
+
+	VkRect2D scissor = {};
+	scissor.extent.width = *frameBufferWidth;
+	scissor.extent.height = *frameBufferHeight;
+	scissor.offset.x = 0;
+	scissor.offset.y = 0;
+	vkCmdSetScissor(cmdBuffer, 0, 1, &scissor);
+
+	vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+	vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSet, 0, NULL);
+
+	// Each frame reads its own slice, so the host never writes what the GPU may still read
+	VkDeviceSize offsets = bufferindex * TEXTOVERLAY_MAX_CHAR_COUNT * TEXTOVERLAY_VERTICES_PER_CHAR * sizeof(glm::vec4);
+	vkCmdBindVertexBuffers(cmdBuffer, 0, 1, &vertexBuffer.buffer, &offsets);
+	vkCmdBindVertexBuffers(cmdBuffer, 1, 1, &vertexBuffer.buffer, &offsets);
+	vkCmdBindIndexBuffer(cmdBuffer, indexBuffer.buffer, 0, VK_INDEX_TYPE_UINT16);
+
+	// All chars in one draw, the index count is read from the buffer when the frame executes
+	vkCmdDrawIndexedIndirect(cmdBuffer, indirectBuffer.buffer, bufferindex * sizeof(VkDrawIndexedIndirectCommand), 1, sizeof(VkDrawIndexedIndirectCommand));
+
+	// A line strip per graph line, the lines start at their own first vertex in the frame's slice
+	vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphPipeline);
+
+	VkDeviceSize graphOffset = bufferindex * TEXTOVERLAY_GRAPH_LINE_COUNT * TEXTOVERLAY_GRAPH_SAMPLE_COUNT * sizeof(float);
+	vkCmdBindVertexBuffers(cmdBuffer, 0, 1, &graphBuffer.buffer, &graphOffset);
+
+	for (uint32_t line = 0; line < TEXTOVERLAY_GRAPH_LINE_COUNT; line++)
+	{
+		vkCmdPushConstants(cmdBuffer, graphPipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(GraphLine), &graphLines[line]);
+		vkCmdDrawIndirect(cmdBuffer, graphIndirectBuffer.buffer, (bufferindex * TEXTOVERLAY_GRAPH_LINE_COUNT + line) * sizeof(VkDrawIndirectCommand), 1, sizeof(VkDrawIndirectCommand));
 	}
 }
 
-void TextOverlay::submit(VkQueue queue, uint32_t bufferindex, VkSemaphore &waitSemaphore)
+VkSemaphore TextOverlay::submit(VkQueue queue, uint32_t bufferindex, VkSemaphore waitSemaphore)
 {
-	if (!visible)
+	TRACE_ZONE("TextOverlay::submit", "frame");
+
+	if (isInline || !visible)
 	{
-		return;
+		return waitSemaphore;
 	}
 
 	VkPipelineStageFlags stageFlags = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
@@ -214,6 +344,8 @@ void TextOverlay::submit(VkQueue queue, uint32_t bufferindex, VkSemaphore &waitS
 
 	VK_CHECK_RESULT(vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE));
 	VK_CHECK_RESULT(vkQueueWaitIdle(queue));
+
+	return textOverlayComplete;
 }
 
 void TextOverlay::prepareCmdBuffers()
@@ -225,29 +357,87 @@ void TextOverlay::prepareCmdBuffers()
 	cmdBufAllocateInfo.commandBufferCount = (uint32_t)cmdBuffers.size();
 
 	VK_CHECK_RESULT(vkAllocateCommandBuffers(device, &cmdBufAllocateInfo, cmdBuffers.data()));
+
+	cmdBufAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+	cmdBufAllocateInfo.commandBufferCount = (uint32_t)inlineCmdBuffers.size();
+	VK_CHECK_RESULT(vkAllocateCommandBuffers(device, &cmdBufAllocateInfo, inlineCmdBuffers.data()));
 }
 
 void TextOverlay::prepareResources()
 {
-	static unsigned char font24pixels[STB_FONT_HEIGHT][STB_FONT_WIDTH];
-	STB_FONT_NAME(stbFontData, font24pixels, STB_FONT_HEIGHT);
+	// Vertex buffer with a slice per frame, mapped once for the lifetime of the overlay
+	resMan->createBuffer(
+		VMA_MEMORY_USAGE_CPU_TO_GPU,
+		frameBuffers.size() * TEXTOVERLAY_MAX_CHAR_COUNT * TEXTOVERLAY_VERTICES_PER_CHAR * sizeof(glm::vec4),
+		VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+		&vertexBuffer,
+		reinterpret_cast<void**>(&pVertexData));
+
+	// The quads keep the winding of the former triangle strips
+	std::vector<uint16_t> indices(TEXTOVERLAY_MAX_CHAR_COUNT * TEXTOVERLAY_INDICES_PER_CHAR);
+	for (uint32_t i = 0; i < TEXTOVERLAY_MAX_CHAR_COUNT; i++)
+	{
+		uint16_t base = static_cast<uint16_t>(i * TEXTOVERLAY_VERTICES_PER_CHAR);
+		const uint16_t quad[TEXTOVERLAY_INDICES_PER_CHAR] = { 0, 1, 2, 1, 3, 2 };
+		for (uint32_t j = 0; j < TEXTOVERLAY_INDICES_PER_CHAR; j++)
+			indices[i * TEXTOVERLAY_INDICES_PER_CHAR + j] = base + quad[j];
+	}
+	resMan->createBufferInDevice(indices.size() * sizeof(uint16_t), VK_BUFFER_USAGE_INDEX_BUFFER_BIT, &indexBuffer, indices.data());
+
+	resMan->createBuffer(
+		VMA_MEMORY_USAGE_CPU_TO_GPU,
+		frameBuffers.size() * sizeof(VkDrawIndexedIndirectCommand),
+		VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+		&indirectBuffer,
+		reinterpret_cast<void**>(&pDrawCommands));
+
+	VkDrawIndexedIndirectCommand drawCommand = {};
+	drawCommand.instanceCount = 1;
+	for (size_t i = 0; i < frameBuffers.size(); i++)
+		pDrawCommands[i] = drawCommand;
+
+	// Graph samples and their draws, a slice per frame like the text
+	resMan->createBuffer(
+		VMA_MEMORY_USAGE_CPU_TO_GPU,
+		frameBuffers.size() * TEXTOVERLAY_GRAPH_LINE_COUNT * TEXTOVERLAY_GRAPH_SAMPLE_COUNT * sizeof(float),
+		VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+		&graphBuffer,
+		reinterpret_cast<void**>(&pGraphData));
+	memset(pGraphData, 0, frameBuffers.size() * TEXTOVERLAY_GRAPH_LINE_COUNT * TEXTOVERLAY_GRAPH_SAMPLE_COUNT * sizeof(float));
+
+	resMan->createBuffer(
+		VMA_MEMORY_USAGE_CPU_TO_GPU,
+		frameBuffers.size() * TEXTOVERLAY_GRAPH_LINE_COUNT * sizeof(VkDrawIndirectCommand),
+		VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+		&graphIndirectBuffer,
+		reinterpret_cast<void**>(&pGraphDrawCommands));
+
+	for (size_t i = 0; i < frameBuffers.size(); i++)
+	{
+		for (uint32_t line = 0; line < TEXTOVERLAY_GRAPH_LINE_COUNT; line++)
+		{
+			VkDrawIndirectCommand graphCommand = {};
+			graphCommand.instanceCount = 1;
+			graphCommand.firstVertex = line * TEXTOVERLAY_GRAPH_SAMPLE_COUNT;
+			pGraphDrawCommands[i * TEXTOVERLAY_GRAPH_LINE_COUNT + line] = graphCommand;
+		}
+	}
 
-	// Vertex buffer
-	resMan->createBufferInHost(
-		TEXTOVERLAY_MAX_CHAR_COUNT * sizeof(glm::vec4),
-		VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, 
-		&vertexBuffer, 
-		nullptr);
+	// Font texture, the glyphs are rasterized straight into staging memory
+	StagingSpan span;
+	resMan->beginUpload(STB_FONT_WIDTH * STB_FONT_HEIGHT, &span);
+	STB_FONT_NAME(stbFontData, static_cast<unsigned char(*)[STB_FONT_WIDTH]>(span.pData), STB_FONT_HEIGHT);
 
-	// Font texture
+	VkDeviceSize mipOffset = 0;
 	resMan->createImageInDevice(
 		STB_FONT_WIDTH,
 		STB_FONT_HEIGHT,
+		1,
 		VK_FORMAT_R8_UNORM,
 		VK_IMAGE_USAGE_SAMPLED_BIT,
 		&fontTexture,
-		&font24pixels[0][0],
-		STB_FONT_WIDTH * STB_FONT_HEIGHT
+		span,
+		&mipOffset
 	);
 
 	// Img View
@@ -305,6 +495,18 @@ void TextOverlay::prepareResources()
 	pipelineLayoutInfo.pSetLayouts = &descriptorSetLayout;
 	VK_CHECK_RESULT(vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipelineLayout));
 
+	// The graph reads nothing but its vertices and the push constants of a line
+	VkPushConstantRange pushConstantRange = {};
+	pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+	pushConstantRange.offset = 0;
+	pushConstantRange.size = sizeof(GraphLine);
+
+	VkPipelineLayoutCreateInfo graphPipelineLayoutInfo = {};
+	graphPipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	graphPipelineLayoutInfo.pushConstantRangeCount = 1;
+	graphPipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+	VK_CHECK_RESULT(vkCreatePipelineLayout(device, &graphPipelineLayoutInfo, nullptr, &graphPipelineLayout));
+
 	// Descriptor set
 	VkDescriptorSetAllocateInfo descriptorSetAllocInfo = {};
 	descriptorSetAllocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
@@ -321,18 +523,13 @@ void TextOverlay::prepareResources()
 	writeDescriptorSets[0].pImageInfo = &fontTexture.descInfo;
 	writeDescriptorSets[0].descriptorCount = 1;
 	vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, NULL);
-
-	// Pipeline cache
-	VkPipelineCacheCreateInfo pipelineCacheCreateInfo = {};
-	pipelineCacheCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
-	VK_CHECK_RESULT(vkCreatePipelineCache(device, &pipelineCacheCreateInfo, nullptr, &pipelineCache));
 }
 
 void TextOverlay::preparePipeline()
 {
 	VkPipelineInputAssemblyStateCreateInfo inputAssemblyState = {};
 	inputAssemblyState.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-	inputAssemblyState.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP;
+	inputAssemblyState.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
 	inputAssemblyState.flags = 0;
 	inputAssemblyState.primitiveRestartEnable = VK_FALSE;
 
@@ -364,8 +561,9 @@ void TextOverlay::preparePipeline()
 
 	VkPipelineDepthStencilStateCreateInfo depthStencilState = {};
 	depthStencilState.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
-	depthStencilState.depthTestEnable = VK_TRUE;
-	depthStencilState.depthWriteEnable = VK_TRUE;
+	// Inline the scene depth is still bound, the text goes on top of it either way
+	depthStencilState.depthTestEnable = VK_FALSE;
+	depthStencilState.depthWriteEnable = VK_FALSE;
 	depthStencilState.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
 	depthStencilState.back.compareOp = VK_COMPARE_OP_ALWAYS;
 	depthStencilState.front = depthStencilState.back;
@@ -439,6 +637,32 @@ void TextOverlay::preparePipeline()
 	pipelineCreateInfo.pStages = shaderStages.data();
 
 	VK_CHECK_RESULT(vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineCreateInfo, nullptr, &pipeline));
+
+	// The graph shares the blend and depth state of the text
+	inputAssemblyState.topology = VK_PRIMITIVE_TOPOLOGY_LINE_STRIP;
+	rasterizationState.cullMode = VK_CULL_MODE_NONE;
+
+	VkVertexInputBindingDescription graphBinding = {};
+	graphBinding.binding = 0;
+	graphBinding.stride = sizeof(float);
+	graphBinding.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+
+	VkVertexInputAttributeDescription graphAttrib = {};
+	graphAttrib.location = 0;
+	graphAttrib.binding = 0;
+	graphAttrib.format = VK_FORMAT_R32_SFLOAT;
+	graphAttrib.offset = 0;
+
+	inputState.vertexBindingDescriptionCount = 1;
+	inputState.pVertexBindingDescriptions = &graphBinding;
+	inputState.vertexAttributeDescriptionCount = 1;
+	inputState.pVertexAttributeDescriptions = &graphAttrib;
+
+	pipelineCreateInfo.layout = graphPipelineLayout;
+	pipelineCreateInfo.stageCount = static_cast<uint32_t>(graphShaderStages.size());
+	pipelineCreateInfo.pStages = graphShaderStages.data();
+
+	VK_CHECK_RESULT(vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineCreateInfo, nullptr, &graphPipeline));
 }
 
 void TextOverlay::prepareRenderPass()
@@ -16,6 +16,15 @@
 
 // Max. number of chars the text overlay buffer can hold
 #define TEXTOVERLAY_MAX_CHAR_COUNT 2048
+// Every char is a quad of 4 vertices drawn as 2 indexed triangles
+#define TEXTOVERLAY_VERTICES_PER_CHAR 4
+#define TEXTOVERLAY_INDICES_PER_CHAR 6
+// Draw the overlay inside the scene render pass instead of a separate submit that waits for the queue
+#define TEXTOVERLAY_INLINE 1
+// Scrolling line graph drawn with the text, every line keeps the same number of samples
+// graph.vert derives x from the vertex index and has the sample count compiled in
+#define TEXTOVERLAY_GRAPH_LINE_COUNT 2
+#define TEXTOVERLAY_GRAPH_SAMPLE_COUNT 256
 
 class TextOverlay
 {
@@ -28,23 +37,47 @@ public:
 		VkFormat depthformat,
 		uint32_t *framebufferwidth,
 		uint32_t *framebufferheight,
-		std::vector<VkPipelineShaderStageCreateInfo> shaderstages);
+		std::vector<VkPipelineShaderStageCreateInfo> shaderstages,
+		std::vector<VkPipelineShaderStageCreateInfo> graphshaderstages,
+		VkPipelineCache pipelineCache,
+		VkRenderPass sceneRenderPass);
 
 	virtual ~TextOverlay();
 
 	enum TextAlign { alignLeft, alignCenter, alignRight };
 
 	bool visible = true;
+	// Inline, the scene pass executes getInlineCommandBuffer and submit does nothing
+	// Changing it requires the scene command buffers to be recorded again
+	bool isInline = TEXTOVERLAY_INLINE;
 
+	// Text is collected on the host, updateFrame hands it to the frames one by one
 	void beginTextUpdate();
 	void addText(std::string text, float x, float y, TextAlign align);
 	void endTextUpdate();
 
+	// Position of the graph in pixels like addText, the graph is hidden until it is set
+	// Records the command buffers again, so it belongs before the scene records its own
+	void setGraphRect(float x, float y, float width, float height);
+	void setGraphColor(uint32_t line, glm::vec4 color);
+	// Samples are drawn relative to the range, larger ones are clamped to the top
+	void setGraphRange(float range);
+	// Appends one sample per line, the oldest scrolls out on the left
+	void addGraphSample(const std::array<float, TEXTOVERLAY_GRAPH_LINE_COUNT>& values);
+
+	// Copies the latest text and graph into the frame's vertex and indirect slices when they are older
+	// Called once the frame's previous use has finished, the command buffers stay as they are
+	void updateFrame(uint32_t bufferindex);
+
+	// Records all chars as one indirect indexed draw, only needed again when the framebuffers change
 	void updateCommandBuffers();
 
-	void submit(VkQueue queue, uint32_t bufferindex, VkSemaphore &waitSemaphore);
+	// Separate mode submits the overlay pass and waits for the queue
+	// Returns the semaphore presentation has to wait on, waitSemaphore when nothing was submitted
+	VkSemaphore submit(VkQueue queue, uint32_t bufferindex, VkSemaphore waitSemaphore);
 
-	inline VkSemaphore* getTextOverlaySemaphorePtr() { return &textOverlayComplete; };
+	// Secondary continuing the scene render pass
+	inline VkCommandBuffer getInlineCommandBuffer(uint32_t bufferindex) { return inlineCmdBuffers[bufferindex]; }
 
 private:
 	VkDevice device;
@@ -69,27 +102,70 @@ private:
 	//VkDeviceMemory imageMemory;
 
 	Buffer vertexBuffer;
+	// Two triangles per char slot, written once
+	Buffer indexBuffer;
+	// One VkDrawIndexedIndirectCommand whose index count follows the text
+	Buffer indirectBuffer;
 	Image fontTexture;
 
 	VkDescriptorPool descriptorPool;
 	VkDescriptorSetLayout descriptorSetLayout;
 	VkDescriptorSet descriptorSet;
 	VkPipelineLayout pipelineLayout;
+	// Owned by the caller
 	VkPipelineCache pipelineCache;
 	VkPipeline pipeline;
 	VkRenderPass renderPass;
 	VkCommandPool commandPool;
 	std::vector<VkCommandBuffer> cmdBuffers;
+	// Scene pass of the inline mode and its secondaries, one per frame
+	VkRenderPass sceneRenderPass;
+	std::vector<VkCommandBuffer> inlineCmdBuffers;
 	std::vector<VkFramebuffer*> frameBuffers;
 	std::vector<VkPipelineShaderStageCreateInfo> shaderStages;
 
-	// Pointer to mapped vertex buffer
+	// Persistent mapping of the vertex buffer, one slice of TEXTOVERLAY_MAX_CHAR_COUNT quads per frame
+	glm::vec4 *pVertexData = nullptr;
+	// Persistent mapping of the indirect draws, one per frame
+	VkDrawIndexedIndirectCommand *pDrawCommands = nullptr;
+
+	// Quads of the latest text, frames whose version differs get a copy
+	std::vector<glm::vec4> textVertices;
+	uint32_t textVersion = 1;
+	std::vector<uint32_t> frameTextVersions;
+
+	// One value per sample of every line per frame, in [0, 1] of the graph height
+	Buffer graphBuffer;
+	float *pGraphData = nullptr;
+	// One VkDrawIndirectCommand per line and frame
+	Buffer graphIndirectBuffer;
+	VkDrawIndirectCommand *pGraphDrawCommands = nullptr;
+	VkPipelineLayout graphPipelineLayout;
+	VkPipeline graphPipeline;
+	std::vector<VkPipelineShaderStageCreateInfo> graphShaderStages;
+
+	// Push constants of a line, the rect is in normalized device coordinates
+	struct GraphLine {
+		glm::vec4 rect;
+		glm::vec4 color;
+	};
+	std::array<GraphLine, TEXTOVERLAY_GRAPH_LINE_COUNT> graphLines;
+	bool hasGraph = false;
+	float graphRange = 1.0f;
+	// Sample history of every line, a ring whose next slot is graphHead
+	std::vector<float> graphSamples;
+	uint32_t graphHead = 0;
+	uint32_t graphVersion = 1;
+	std::vector<uint32_t> frameGraphVersions;
+	// Write position of the current update, null outside beginTextUpdate and endTextUpdate
 	glm::vec4 *mapped = nullptr;
 
 	stb_fontchar stbFontData[STB_NUM_CHARS];
-	uint32_t numLetters;
+	uint32_t numLetters = 0;
 
 	void prepareCmdBuffers();
+	// Viewport, pipelines, buffers of the frame and the indirect draws of the text and the graph
+	void recordDraw(VkCommandBuffer cmdBuffer, uint32_t bufferindex);
 	void prepareResources();
 	void preparePipeline();
 	void prepareRenderPass();
@@ -0,0 +1,229 @@
+#include "TextureContainer.h"
+#include "DataUtils.h"
+
+#include <cstring>
+#include <algorithm>
+
+// Mip data starts on 16 byte boundaries, enough for any texel block size
+static uint64_t alignMip(uint64_t offset)
+{
+	return (offset + 15) & ~static_cast<uint64_t>(15);
+}
+
+// Hash over the image extent and the texel data
+static uint64_t hashTexels(const uint8_t* pTexels, size_t size, uint32_t width, uint32_t height)
+{
+	uint64_t hash = DATA_HASH_SEED;
+	DataUtils::hashBytes(hash, &width, sizeof(width));
+	DataUtils::hashBytes(hash, &height, sizeof(height));
+	DataUtils::hashBytes(hash, pTexels, size);
+	return hash;
+}
+
+// 2x2 box filter of an RGBA8 level, odd edges reuse the last row or column
+static void downsample(const uint8_t* pSrc, uint32_t srcWidth, uint32_t srcHeight, uint8_t* pDst, uint32_t dstWidth, uint32_t dstHeight)
+{
+	for (uint32_t y = 0; y < dstHeight; y++)
+	{
+		uint32_t y0 = std::min(y * 2, srcHeight - 1);
+		uint32_t y1 = std::min(y * 2 + 1, srcHeight - 1);
+
+		for (uint32_t x = 0; x < dstWidth; x++)
+		{
+			uint32_t x0 = std::min(x * 2, srcWidth - 1);
+			uint32_t x1 = std::min(x * 2 + 1, srcWidth - 1);
+
+			for (uint32_t c = 0; c < 4; c++)
+			{
+				uint32_t sum =
+					pSrc[(y0 * srcWidth + x0) * 4 + c] +
+					pSrc[(y0 * srcWidth + x1) * 4 + c] +
+					pSrc[(y1 * srcWidth + x0) * 4 + c] +
+					pSrc[(y1 * srcWidth + x1) * 4 + c];
+
+				pDst[(y * dstWidth + x) * 4 + c] = static_cast<uint8_t>((sum + 2) / 4);
+			}
+		}
+	}
+}
+
+
+TextureContainer::TextureContainer()
+{
+}
+
+
+TextureContainer::~TextureContainer()
+{
+	close();
+}
+
+bool TextureContainer::open(const std::string & containerPath, const std::string & sourcePath)
+{
+	close();
+
+	uint64_t sourceSize, sourceTime;
+	if (!MappedFile::getFileStamp(sourcePath, &sourceSize, &sourceTime))
+		return false;
+
+	if (!file.open(containerPath))
+		return false;
+
+	pData = static_cast<const uint8_t*>(file.data());
+	dataSize = file.size();
+
+	if (!validate() || header->sourceSize != sourceSize || header->sourceTime != sourceTime) {
+		close();
+		return false;
+	}
+
+	return true;
+}
+
+bool TextureContainer::open(std::vector<uint8_t>&& blob)
+{
+	close();
+
+	memory = std::move(blob);
+	pData = memory.data();
+	dataSize = memory.size();
+
+	if (!validate()) {
+		close();
+		return false;
+	}
+
+	return true;
+}
+
+void TextureContainer::close()
+{
+	file.close();
+	memory.clear();
+
+	pData = nullptr;
+	dataSize = 0;
+	header = nullptr;
+	mips = nullptr;
+}
+
+bool TextureContainer::validate()
+{
+	if (dataSize < sizeof(TextureContainerHeader))
+		return false;
+
+	const TextureContainerHeader* pHeader = reinterpret_cast<const TextureContainerHeader*>(pData);
+
+	if (pHeader->magic != TEXTURE_CONTAINER_MAGIC ||
+		pHeader->version != TEXTURE_CONTAINER_VERSION ||
+		pHeader->width == 0 ||
+		pHeader->height == 0 ||
+		pHeader->blockFormat > BLOCK_FORMAT_BC7 ||
+		pHeader->mipCount == 0 ||
+		pHeader->mipCount > getMipCount(pHeader->width, pHeader->height) ||
+		dataSize < sizeof(TextureContainerHeader) + pHeader->mipCount * sizeof(TextureContainerMip))
+		return false;
+
+	const TextureContainerMip* pMips = reinterpret_cast<const TextureContainerMip*>(pData + sizeof(TextureContainerHeader));
+
+	// Copy regions are built from the header extent, so every mip has to match it exactly,
+	// follow the previous one and lie within the container
+	uint64_t minOffset = sizeof(TextureContainerHeader) + pHeader->mipCount * sizeof(TextureContainerMip);
+	for (uint32_t i = 0; i < pHeader->mipCount; i++)
+	{
+		uint32_t width = std::max(pHeader->width >> i, 1u);
+		uint32_t height = std::max(pHeader->height >> i, 1u);
+
+		if (pMips[i].width != width ||
+			pMips[i].height != height ||
+			pMips[i].size != BlockCompressor::getDataSize(static_cast<BlockFormat>(pHeader->blockFormat), width, height) ||
+			pMips[i].offset < minOffset ||
+			pMips[i].size > dataSize ||
+			pMips[i].offset > dataSize - pMips[i].size)
+			return false;
+
+		minOffset = pMips[i].offset + pMips[i].size;
+	}
+
+	header = pHeader;
+	mips = pMips;
+
+	return true;
+}
+
+void TextureContainer::bake(
+	const std::string & sourcePath,
+	uint32_t format,
+	BlockFormat blockFormat,
+	BlockQuality quality,
+	uint32_t width,
+	uint32_t height,
+	const uint8_t * pTexels,
+	std::vector<uint8_t>& blob)
+{
+	TextureContainerHeader header = {};
+	header.magic = TEXTURE_CONTAINER_MAGIC;
+	header.version = TEXTURE_CONTAINER_VERSION;
+	header.format = format;
+	header.blockFormat = blockFormat;
+	header.quality = quality;
+	header.width = width;
+	header.height = height;
+	header.mipCount = getMipCount(width, height);
+	header.contentHash = hashTexels(pTexels, static_cast<size_t>(width) * height * 4, width, height);
+
+	if (!MappedFile::getFileStamp(sourcePath, &header.sourceSize, &header.sourceTime))
+		header.sourceSize = header.sourceTime = 0;
+
+	std::vector<TextureContainerMip> mips(header.mipCount);
+
+	uint64_t offset = alignMip(sizeof(TextureContainerHeader) + mips.size() * sizeof(TextureContainerMip));
+	for (uint32_t i = 0; i < header.mipCount; i++)
+	{
+		mips[i].width = std::max(width >> i, 1u);
+		mips[i].height = std::max(height >> i, 1u);
+		mips[i].size = BlockCompressor::getDataSize(blockFormat, mips[i].width, mips[i].height);
+		mips[i].offset = offset;
+
+		offset = alignMip(offset + mips[i].size);
+	}
+
+	blob.assign(static_cast<size_t>(offset), 0);
+	memcpy(blob.data(), &header, sizeof(header));
+	memcpy(blob.data() + sizeof(header), mips.data(), mips.size() * sizeof(TextureContainerMip));
+
+	// Each level is filtered from the previous uncompressed one, then encoded into the blob
+	std::vector<uint8_t> level(pTexels, pTexels + static_cast<size_t>(width) * height * 4);
+	std::vector<uint8_t> nextLevel;
+	for (uint32_t i = 0; i < header.mipCount; i++)
+	{
+		if (i > 0) {
+			nextLevel.resize(static_cast<size_t>(mips[i].width) * mips[i].height * 4);
+			downsample(level.data(), mips[i - 1].width, mips[i - 1].height, nextLevel.data(), mips[i].width, mips[i].height);
+			level.swap(nextLevel);
+		}
+
+		BlockCompressor::compress(blockFormat, quality, level.data(), mips[i].width, mips[i].height, blob.data() + mips[i].offset);
+	}
+}
+
+bool TextureContainer::write(const std::string & containerPath, const std::vector<uint8_t>& blob)
+{
+	return DataUtils::writeFile(containerPath, [&](std::ostream& os) {
+		os.write(reinterpret_cast<const char*>(blob.data()), static_cast<std::streamsize>(blob.size()));
+	});
+}
+
+uint32_t TextureContainer::getMipCount(uint32_t width, uint32_t height)
+{
+	uint32_t mipCount = 1;
+	uint32_t size = std::max(width, height);
+
+	while (size > 1 && mipCount < TEXTURE_CONTAINER_MAX_MIPS)
+	{
+		size >>= 1;
+		mipCount++;
+	}
+
+	return mipCount;
+}
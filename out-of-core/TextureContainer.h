@@ -0,0 +1,90 @@
+#pragma once
+
+#include "MappedFile.h"
+#include "BlockCompressor.h"
+
+#include <vector>
+
+// GPU-ready texture container, baked from the source image on first load
+// Holds the final format and the full mip chain, every mip is addressable on its own
+// so a load is a straight copy into staging and single mips can be streamed from disk
+// Bump the version whenever the stored texel layout changes
+#define TEXTURE_CONTAINER_MAGIC 0x54434F4F // "OOCT"
+#define TEXTURE_CONTAINER_VERSION 3
+#define TEXTURE_CONTAINER_EXTENSION ".ooct"
+
+#define TEXTURE_CONTAINER_MAX_MIPS 16
+
+struct TextureContainerHeader {
+	uint32_t magic;
+	uint32_t version;
+	// Stamp of the source image, the container is stale once it changes
+	uint64_t sourceSize;
+	uint64_t sourceTime;
+	// Hash of the top level texels, used to share identical images
+	uint64_t contentHash;
+
+	// VkFormat of the stored texels, with the block encoding and encoder quality that produced them
+	uint32_t format;
+	uint32_t blockFormat;
+	uint32_t quality;
+	uint32_t width;
+	uint32_t height;
+	uint32_t mipCount;
+};
+
+struct TextureContainerMip {
+	// Byte offset from the start of the container, 16 byte aligned
+	uint64_t offset;
+	uint64_t size;
+	uint32_t width;
+	uint32_t height;
+};
+
+class TextureContainer
+{
+public:
+	TextureContainer();
+	virtual ~TextureContainer();
+
+	// Map a baked container from disk, fails if missing or stale
+	bool open(const std::string& containerPath, const std::string& sourcePath);
+	// Use a container baked in memory
+	bool open(std::vector<uint8_t>&& blob);
+	void close();
+
+	inline const TextureContainerHeader& getHeader() const { return *header; }
+	inline const TextureContainerMip& getMip(uint32_t level) const { return mips[level]; }
+	inline const uint8_t* getMipData(uint32_t level) const { return pData + mips[level].offset; }
+
+	// Mip chain as one contiguous range starting at the top level
+	inline const uint8_t* getData() const { return getMipData(0); }
+	inline uint64_t getDataSize() const { return mips[header->mipCount - 1].offset + mips[header->mipCount - 1].size - mips[0].offset; }
+
+	// Build a container with a full box filtered mip chain from RGBA8 texels, every mip encoded as blockFormat
+	static void bake(
+		const std::string& sourcePath,
+		uint32_t format,
+		BlockFormat blockFormat,
+		BlockQuality quality,
+		uint32_t width,
+		uint32_t height,
+		const uint8_t* pTexels,
+		std::vector<uint8_t>& blob);
+
+	static bool write(const std::string& containerPath, const std::vector<uint8_t>& blob);
+
+	static uint32_t getMipCount(uint32_t width, uint32_t height);
+
+private:
+	MappedFile file;
+	std::vector<uint8_t> memory;
+
+	const uint8_t* pData = nullptr;
+	size_t dataSize = 0;
+
+	const TextureContainerHeader* header = nullptr;
+	const TextureContainerMip* mips = nullptr;
+
+	bool validate();
+};
@@ -0,0 +1,145 @@
+#include "Trace.h"
+#include "DataUtils.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+struct TraceRing {
+	// Taken by the owning thread for every zone, only a dump contends for it
+	std::mutex mutex;
+	std::vector<TraceEvent> events;
+	// Zones ever recorded, the latest one sits at (count - 1) % TRACE_RING_SIZE
+	uint64_t count = 0;
+	uint32_t threadId = 0;
+	std::string threadName;
+};
+
+static const std::chrono::steady_clock::time_point traceStart = std::chrono::steady_clock::now();
+
+// Rings outlive their threads, so job threads that already exited still show up in a dump
+static std::mutex ringsMutex;
+static std::vector<std::unique_ptr<TraceRing>> rings;
+static thread_local TraceRing *currentRing = nullptr;
+
+static TraceRing* getRing()
+{
+	if (currentRing != nullptr)
+		return currentRing;
+
+	std::unique_ptr<TraceRing> ring(new TraceRing());
+	ring->events.resize(TRACE_RING_SIZE);
+
+	std::lock_guard<std::mutex> lock(ringsMutex);
+	ring->threadId = static_cast<uint32_t>(rings.size()) + 1;
+	ring->threadName = "Thread " + std::to_string(ring->threadId);
+	currentRing = ring.get();
+	rings.push_back(std::move(ring));
+
+	return currentRing;
+}
+
+static void writeString(std::ostream& os, const std::string& str)
+{
+	os << '"';
+	for (char c : str)
+	{
+		if (c == '"' || c == '\\')
+			os << '\\';
+		os << c;
+	}
+	os << '"';
+}
+
+uint64_t Trace::now()
+{
+	return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - traceStart).count());
+}
+
+void Trace::record(const char * name, const char * category, uint64_t start, uint64_t end)
+{
+	TraceRing *ring = getRing();
+
+	std::lock_guard<std::mutex> lock(ring->mutex);
+	TraceEvent& event = ring->events[ring->count % TRACE_RING_SIZE];
+	event.name = name;
+	event.category = category;
+	event.start = start;
+	event.duration = end - start;
+	ring->count++;
+}
+
+void Trace::setThreadName(const std::string & name)
+{
+	TraceRing *ring = getRing();
+
+	std::lock_guard<std::mutex> lock(ring->mutex);
+	ring->threadName = name;
+}
+
+bool Trace::dump(const std::string & filePath)
+{
+	// Copied first, so the threads only wait for the copy and not for the file
+	struct ThreadSnapshot {
+		uint32_t threadId;
+		std::string threadName;
+		std::vector<TraceEvent> events;
+	};
+	std::vector<ThreadSnapshot> snapshots;
+	{
+		std::lock_guard<std::mutex> lock(ringsMutex);
+		for (auto& ring : rings)
+		{
+			std::lock_guard<std::mutex> ringLock(ring->mutex);
+
+			ThreadSnapshot snapshot;
+			snapshot.threadId = ring->threadId;
+			snapshot.threadName = ring->threadName;
+
+			// Oldest zone first
+			uint64_t eventCount = std::min<uint64_t>(ring->count, TRACE_RING_SIZE);
+			snapshot.events.reserve(static_cast<size_t>(eventCount));
+			for (uint64_t i = ring->count - eventCount; i < ring->count; i++)
+				snapshot.events.push_back(ring->events[i % TRACE_RING_SIZE]);
+
+			snapshots.push_back(std::move(snapshot));
+		}
+	}
+
+	// Complete events in microseconds, plus a metadata event naming each thread's track
+	size_t zoneCount = 0;
+	bool isWritten = DataUtils::writeFile(filePath, [&](std::ostream& os) {
+		os << std::fixed << std::setprecision(3);
+		os << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+		bool isFirst = true;
+		for (auto& snapshot : snapshots)
+		{
+			os << (isFirst ? "\n" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << snapshot.threadId << ",\"args\":{\"name\":";
+			writeString(os, snapshot.threadName);
+			os << "}}";
+			isFirst = false;
+
+			for (auto& event : snapshot.events)
+			{
+				os << ",\n{\"name\":";
+				writeString(os, event.name);
+				os << ",\"cat\":";
+				writeString(os, event.category);
+				os << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << snapshot.threadId
+					<< ",\"ts\":" << event.start / 1000.0 << ",\"dur\":" << event.duration / 1000.0 << "}";
+			}
+			zoneCount += snapshot.events.size();
+		}
+		os << "\n]}\n";
+	});
+
+	if (!isWritten)
+		return false;
+
+	std::cout << "Wrote " << zoneCount << " trace zones of " << snapshots.size() << " threads to " << filePath << std::endl;
+	return true;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Scoped zones recorded into a ring per thread, dumped as Chrome trace JSON on demand
+// The file opens in chrome://tracing and ui.perfetto.dev, one track per thread
+#define TRACE_ENABLED 1
+// Zones kept per thread, the oldest are overwritten
+#define TRACE_RING_SIZE (64 * 1024)
+#define TRACE_FILE "trace.json"
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+
+#if TRACE_ENABLED
+// Times the rest of the enclosing scope, name and category are kept as pointers, so string literals
+#define TRACE_ZONE(name, category) TraceZone TRACE_CONCAT(traceZone, __LINE__)(name, category)
+#define TRACE_THREAD_NAME(name) Trace::setThreadName(name)
+#else
+#define TRACE_ZONE(name, category)
+#define TRACE_THREAD_NAME(name)
+#endif
+
+struct TraceEvent {
+	const char *name;
+	const char *category;
+	// Nanoseconds since the process started
+	uint64_t start;
+	uint64_t duration;
+};
+
+class Trace
+{
+public:
+	static uint64_t now();
+	// The first zone of a thread registers its ring, later ones only take the ring's uncontended lock
+	static void record(const char *name, const char *category, uint64_t start, uint64_t end);
+	// Track name of the calling thread
+	static void setThreadName(const std::string& name);
+
+	// Writes the zones every thread still holds, including threads that have exited
+	// Returns false if the file could not be written
+	static bool dump(const std::string& filePath);
+};
+
+class TraceZone
+{
+public:
+	inline TraceZone(const char *name, const char *category) : name(name), category(category), start(Trace::now()) {}
+	inline ~TraceZone() { Trace::record(name, category, start, Trace::now()); }
+
+private:
+	const char *name;
+	const char *category;
+	uint64_t start;
+
+	TraceZone(const TraceZone&) = delete;
+	TraceZone& operator=(const TraceZone&) = delete;
+};
@@ -1,4 +1,6 @@
 #include "VkBase.h"
+#include "Trace.h"
+#include "DataUtils.h"
 
 #include <chrono>
 #include <iomanip>
@@ -36,14 +38,27 @@ void DestroyDebugReportCallbackEXT(VkInstance instance, VkDebugReportCallbackEXT
 
 void VkBase::run(int width, int height, const char* appTitle)
 {
+	TRACE_THREAD_NAME("Main");
+
 	initWindow(width, height, appTitle);
-	initVulkan();
-	prepare();
+
+	auto tStart = std::chrono::high_resolution_clock::now();
+	{
+		TRACE_ZONE("VkBase::prepare", "load");
+		initVulkan();
+		prepare();
+	}
+	auto tEnd = std::chrono::high_resolution_clock::now();
+
+	std::cout << "Startup with " << (isPipelineCacheWarm ? "warm" : "cold") << " pipeline cache took "
+		<< std::chrono::duration<double, std::milli>(tEnd - tStart).count() << " ms" << std::endl;
+
 	renderLoop();
 }
 
 VkBase::~VkBase()
 {
+	savePipelineCache();
 	vkDestroyPipelineCache(device, pipelineCache, nullptr);
 
 	vkFreeCommandBuffers(device, cmdPool, static_cast<uint32_t>(drawCmdBuffers.size()), drawCmdBuffers.data());
@@ -62,7 +77,9 @@ VkBase::~VkBase()
 	vkDestroyCommandPool(device, cmdPool, nullptr);
 
 	delete textUI;
+	delete shaderCache;
 	delete resMan;
+	delete jobs;
 
 	vkDestroyDevice(device, nullptr);
 	DestroyDebugReportCallbackEXT(instance, debReportClbk, nullptr);
@@ -92,15 +109,17 @@ void VkBase::prepare()
 
 	shaderStages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
 	shaderStages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
-	shaderStages[0].module = loadSPIRVShader("shaders/text.vert.spv");
+	shaderStages[0].module = shaderCache->acquire("shaders/text.vert.spv");
 	shaderStages[0].pName = "main";
-	assert(shaderStages[0].module != VK_NULL_HANDLE);
 
 	shaderStages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
 	shaderStages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-	shaderStages[1].module = loadSPIRVShader("shaders/text.frag.spv");
+	shaderStages[1].module = shaderCache->acquire("shaders/text.frag.spv");
 	shaderStages[1].pName = "main";
-	assert(shaderStages[1].module != VK_NULL_HANDLE);
+
+	std::vector<VkPipelineShaderStageCreateInfo> graphShaderStages = shaderStages;
+	graphShaderStages[0].module = shaderCache->acquire("shaders/graph.vert.spv");
+	graphShaderStages[1].module = shaderCache->acquire("shaders/graph.frag.spv");
 
 	textUI = new TextOverlay(
 		device,
@@ -111,18 +130,41 @@ void VkBase::prepare()
 		depthFormat,
 		&screenWidth,
 		&screenHeight,
-		shaderStages
+		shaderStages,
+		graphShaderStages,
+		pipelineCache,
+		renderPass
 	);
 
+	// The overlay builds its pipelines in the constructor
+	for (auto& shaderStage : shaderStages)
+		shaderCache->release(shaderStage.module);
+	for (auto& shaderStage : graphShaderStages)
+		shaderCache->release(shaderStage.module);
+
+	// Device usage in green and host usage in orange, bottom left
+	textUI->setGraphColor(0, glm::vec4(0.2f, 1.0f, 0.2f, 1.0f));
+	textUI->setGraphColor(1, glm::vec4(1.0f, 0.6f, 0.1f, 1.0f));
+	textUI->setGraphRect(5.0f, screenHeight - OVERLAY_GRAPH_HEIGHT - 5.0f, OVERLAY_GRAPH_WIDTH, OVERLAY_GRAPH_HEIGHT);
+
+	updatePerfGraph();
 	updatePerfValue();
 }
 
 // Get next image in the swap chain (back/front buffer)
 void VkBase::prepareFrame()
 {
+	TRACE_ZONE("VkBase::prepareFrame", "frame");
+
 	vkQueueWaitIdle(stdQueues.present);
 
 	VK_CHECK_RESULT(vkAcquireNextImageKHR(device, swapChain.handle, std::numeric_limits<uint64_t>::max(), stdSemaphores.presentComplete, VK_NULL_HANDLE, &currentBuffer));
+
+	// Like the scene uniforms, only the slice of the acquired frame is written
+	auto tStart = std::chrono::high_resolution_clock::now();
+	textUI->updateFrame(currentBuffer);
+	auto tEnd = std::chrono::high_resolution_clock::now();
+	overlayCost += std::chrono::duration<double, std::milli>(tEnd - tStart).count();
 }
 
 // Present the current buffer to the swap chain
@@ -131,14 +173,16 @@ void VkBase::prepareFrame()
 //VK_CHECK_RESULT(swapChain.queuePresent(queue, currentBuffer, renderCompleteSemaphore));
 void VkBase::submitFrame()
 {
-	// text overlay
-	textUI->submit(stdQueues.graphic, currentBuffer, stdSemaphores.renderComplete);
+	TRACE_ZONE("VkBase::submitFrame", "frame");
+
+	// text overlay, inline it was drawn by the scene pass and nothing is submitted
+	VkSemaphore waitSemaphore = textUI->submit(stdQueues.graphic, currentBuffer, stdSemaphores.renderComplete);
 
 	// present queue
 	VkPresentInfoKHR presentInfo = {};
 	presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
 	presentInfo.waitSemaphoreCount = 1;
-	presentInfo.pWaitSemaphores = (textUI->visible) ? textUI->getTextOverlaySemaphorePtr() : &stdSemaphores.renderComplete;
+	presentInfo.pWaitSemaphores = &waitSemaphore;
 	presentInfo.swapchainCount = 1;
 	presentInfo.pSwapchains = &swapChain.handle;
 	presentInfo.pImageIndices = &currentBuffer;
@@ -149,6 +193,9 @@ void VkBase::submitFrame()
 void VkBase::renderLoop()
 {
 	while (!glfwWindowShouldClose(window)) {
+		// One zone per loop iteration, the frame's phases nest inside it
+		TRACE_ZONE("Frame", "frame");
+
 		glfwPollEvents();
 
 		auto tStart = std::chrono::high_resolution_clock::now();
@@ -158,22 +205,64 @@ void VkBase::renderLoop()
 		auto tEnd = std::chrono::high_resolution_clock::now();
 		auto tDiff = std::chrono::duration<double, std::milli>(tEnd - tStart).count();
 
+		overlayFrameTime += tDiff;
+		overlayFrameCount++;
+		perfFrameCount++;
+
+		graphTimer += (float)tDiff;
+		if (graphTimer > OVERLAY_GRAPH_INTERVAL_MS * overlayIntervalScale)
+		{
+			auto tOverlay = std::chrono::high_resolution_clock::now();
+			updatePerfGraph();
+			overlayCost += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - tOverlay).count();
+
+			graphTimer = 0.0f;
+		}
+
 		fpsTimer += (float)tDiff; // need
-		if (fpsTimer > 500.0f)
+		if (fpsTimer > OVERLAY_UPDATE_INTERVAL_MS * overlayIntervalScale)
 		{
 			lastFPS = static_cast<uint32_t>(1000.0f / (float)tDiff); // need
+			lastOverlayCost = overlayCost / perfFrameCount;
 
+			auto tOverlay = std::chrono::high_resolution_clock::now();
 			updatePerfValue();
+			// The HUD update counts towards the next interval
+			overlayCost = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - tOverlay).count();
 
+			// Over budget the overlay refreshes less often, well below it goes back towards the default
+			if (lastOverlayCost > OVERLAY_BUDGET_MS && overlayIntervalScale < OVERLAY_MAX_INTERVAL_SCALE)
+				overlayIntervalScale *= 2;
+			else if (lastOverlayCost < OVERLAY_BUDGET_MS / 2.0 && overlayIntervalScale > 1)
+				overlayIntervalScale /= 2;
+
+			perfFrameCount = 0;
+			perfMigratedBytes = resMan->getMigratedBytes();
 			fpsTimer = 0.0f;
 		}
 	}
 
+	printOverlayFrameTime();
+
 	vkDeviceWaitIdle(device);
 }
 
+void VkBase::printOverlayFrameTime()
+{
+	if (overlayFrameCount > 0)
+	{
+		std::cout << "Text overlay " << (textUI->isInline ? "inline" : "separate") << ": " << overlayFrameCount << " frames, average "
+			<< std::fixed << std::setprecision(3) << overlayFrameTime / overlayFrameCount << " ms" << std::endl;
+	}
+
+	overlayFrameTime = 0.0;
+	overlayFrameCount = 0;
+}
+
 void VkBase::updatePerfValue()
 {
+	TRACE_ZONE("VkBase::updatePerfValue", "overlay");
+
 	textUI->beginTextUpdate();
 
 	// 20.0f each line
@@ -193,11 +282,54 @@ void VkBase::updatePerfValue()
 	ss << std::fixed << std::setprecision(3) << "Total Host Usage : " << resMan->getHostUsage() / 1000000.0f << " MBs"; // resMan->getHostUsage();
 	textUI->addText(ss.str(), 5.0f, 65.0f, TextOverlay::alignLeft);
 
-	// getOverlayText(textUI); future work - pure virtual f(x)
+	// Negative once the device usage is over budget and the next bound change migrates
+	ss.str(std::string());
+	ss << std::fixed << std::setprecision(3) << "Budget Headroom : "
+		<< (static_cast<double>(resMan->getDeviceBudget()) - static_cast<double>(resMan->getDeviceUsage())) / 1000000.0 << " of " << resMan->getDeviceBudget() / 1000000.0f << " MBs";
+	textUI->addText(ss.str(), 5.0f, 85.0f, TextOverlay::alignLeft);
+
+	ss.str(std::string());
+	ss << "Heaps : " << resMan->getDeviceHeapSize() << " device, " << resMan->getHostHeapSize() << " host resources";
+	textUI->addText(ss.str(), 5.0f, 105.0f, TextOverlay::alignLeft);
+
+	uint32_t frameCount = std::max(perfFrameCount, 1u);
+	ss.str(std::string());
+	ss << std::fixed << std::setprecision(3) << "Migrated : " << (resMan->getMigratedBytes() - perfMigratedBytes) / 1000.0 / frameCount << " KBs/frame, "
+		<< resMan->getMigrationCount() << " migrations, " << resMan->getEvictionCount() << " evictions";
+	textUI->addText(ss.str(), 5.0f, 125.0f, TextOverlay::alignLeft);
+
+	// Compression ratio of the textures packed right now, codec throughput since the start
+	ss.str(std::string());
+	ss << std::fixed << std::setprecision(2) << "Packed : " << (resMan->isCompressedHostTier() ? "on, " : "off, ")
+		<< resMan->getPackedDataSize() / 1000000.0 << " -> " << resMan->getPackedSize() / 1000000.0 << " MBs, "
+		<< resMan->getPackThroughput() / 1000000.0 << " MB/s pack, " << resMan->getUnpackThroughput() / 1000000.0 << " MB/s unpack";
+	textUI->addText(ss.str(), 5.0f, 145.0f, TextOverlay::alignLeft);
+
+	ss.str(std::string());
+	ss << std::fixed << std::setprecision(3) << "Overlay : " << lastOverlayCost << " of " << OVERLAY_BUDGET_MS << " ms/frame, refresh x" << overlayIntervalScale;
+	textUI->addText(ss.str(), 5.0f, 165.0f, TextOverlay::alignLeft);
+
+	getOverlayText(textUI, 185.0f, frameCount);
+
+	ss.str(std::string());
+	ss << std::fixed << std::setprecision(1) << "Memory : device (green), host (orange), top " << resMan->getMemoryBound() / 1000000.0f << " MBs";
+	textUI->addText(ss.str(), 5.0f, screenHeight - OVERLAY_GRAPH_HEIGHT - 25.0f, TextOverlay::alignLeft);
 
 	textUI->endTextUpdate();
 }
 
+void VkBase::updatePerfGraph()
+{
+	// The top of the graph is the memory bound, host usage above it is clamped
+	textUI->setGraphRange(static_cast<float>(resMan->getMemoryBound()));
+
+	std::array<float, TEXTOVERLAY_GRAPH_LINE_COUNT> values = { {
+		static_cast<float>(resMan->getDeviceUsage()),
+		static_cast<float>(resMan->getHostUsage())
+	} };
+	textUI->addGraphSample(values);
+}
+
 uint32_t VkBase::getMemoryTypeIndex(uint32_t typeBits, VkMemoryPropertyFlags properties)
 {
 	vkGetPhysicalDeviceMemoryProperties(physicalDevice, &deviceMemoryProperties);
@@ -270,46 +402,6 @@ void VkBase::flushCmdBuffer(VkCommandBuffer cmdBuffer)
 	vkFreeCommandBuffers(device, cmdPool, 1, &cmdBuffer);
 }
 
-VkShaderModule VkBase::loadSPIRVShader(std::string filePath)
-{
-	size_t shaderSize;
-	char* shaderCode = nullptr;
-
-	std::ifstream is(filePath.c_str(), std::ios::binary | std::ios::in | std::ios::ate);
-
-	if (is.is_open())
-	{
-		shaderSize = is.tellg();
-		is.seekg(0, std::ios::beg);
-		// Copy file contents into a buffer
-		shaderCode = new char[shaderSize];
-		is.read(shaderCode, shaderSize);
-		is.close();
-		assert(shaderSize > 0);
-	}
-
-	if (shaderCode)
-	{
-		// Create a new shader module that will be used for pipeline creation
-		VkShaderModuleCreateInfo moduleCreateInfo{};
-		moduleCreateInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-		moduleCreateInfo.codeSize = shaderSize;
-		moduleCreateInfo.pCode = (uint32_t*)shaderCode;
-
-		VkShaderModule shaderModule;
-		VK_CHECK_RESULT(vkCreateShaderModule(device, &moduleCreateInfo, NULL, &shaderModule));
-
-		delete[] shaderCode;
-
-		return shaderModule;
-	}
-	else
-	{
-		std::cerr << "Error: Could not open shader file \"" << filePath << "\"" << std::endl;
-		return VK_NULL_HANDLE;
-	}
-}
-
 VkFormat VkBase::getSupportedDepthFormat(VkPhysicalDevice physicalDevice)
 {
 	// Since all depth formats may be optional, we need to find a suitable depth format to use
@@ -439,7 +531,7 @@ void VkBase::setupDevice()
 	}
 
 	vkGetPhysicalDeviceProperties(physicalDevice, &deviceProperties);
-	//vkGetPhysicalDeviceFeatures(physicalDevice, &deviceFeatures);
+	vkGetPhysicalDeviceFeatures(physicalDevice, &deviceFeatures);
 	//vkGetPhysicalDeviceMemoryProperties(physicalDevice, &deviceMemoryProperties);
 
 	depthFormat = getSupportedDepthFormat(physicalDevice);
@@ -457,8 +549,11 @@ void VkBase::setupDevice()
 		queueCreateInfos.push_back(queueCreateInfo);
 	}
 
-	VkPhysicalDeviceFeatures requiredFeatures = {};
-	requiredFeatures.samplerAnisotropy = VK_TRUE;
+	enabledFeatures.samplerAnisotropy = VK_TRUE;
+	// Optional, textures fall back to RGBA8 without it
+	enabledFeatures.textureCompressionBC = deviceFeatures.textureCompressionBC;
+	// Optional, meshlets are drawn with one indirect call each without it
+	enabledFeatures.multiDrawIndirect = deviceFeatures.multiDrawIndirect;
 
 	VkDeviceCreateInfo createInfo = {};
 	createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
@@ -466,7 +561,7 @@ void VkBase::setupDevice()
 	createInfo.queueCreateInfoCount = static_cast<uint32_t>(queueCreateInfos.size());
 	createInfo.pQueueCreateInfos = queueCreateInfos.data();
 
-	createInfo.pEnabledFeatures = &requiredFeatures;
+	createInfo.pEnabledFeatures = &enabledFeatures;
 
 	createInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
 	createInfo.ppEnabledExtensionNames = deviceExtensions.data();
@@ -487,7 +582,9 @@ void VkBase::setupDevice()
 
 void VkBase::setupResourceManager()
 {
-	resMan = new ResourceManager(physicalDevice, device, cmdPool, stdQueues.graphic);
+	jobs = new JobSystem();
+	resMan = new ResourceManager(physicalDevice, enabledFeatures, device, cmdPool, stdQueues.graphic, jobs);
+	shaderCache = new ShaderCache(device);
 }
 
 void VkBase::createStandardSemaphores()
@@ -509,12 +606,74 @@ void VkBase::createStandardSemaphores()
 
 void VkBase::createPipelineCache()
 {
+	std::vector<char> cacheData = loadPipelineCacheData();
+	isPipelineCacheWarm = !cacheData.empty();
+
 	VkPipelineCacheCreateInfo plCacheCreateInfo = {};
 	plCacheCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+	plCacheCreateInfo.initialDataSize = cacheData.size();
+	plCacheCreateInfo.pInitialData = cacheData.empty() ? nullptr : cacheData.data();
 
 	VK_CHECK_RESULT(vkCreatePipelineCache(device, &plCacheCreateInfo, nullptr, &pipelineCache));
 }
 
+std::vector<char> VkBase::loadPipelineCacheData()
+{
+	std::vector<char> cacheData;
+
+	std::ifstream is(PIPELINE_CACHE_FILE, std::ios::binary | std::ios::in | std::ios::ate);
+	if (!is.is_open())
+		return cacheData;
+
+	std::streamoff fileSize = is.tellg();
+	is.seekg(0, std::ios::beg);
+
+	PipelineCacheHeader header = {};
+	if (fileSize < static_cast<std::streamoff>(sizeof(header)) || !is.read(reinterpret_cast<char*>(&header), sizeof(header)))
+		return cacheData;
+
+	// A driver update or another GPU makes the stored pipelines useless
+	if (header.magic != PIPELINE_CACHE_MAGIC || header.version != PIPELINE_CACHE_VERSION ||
+		header.vendorID != deviceProperties.vendorID || header.deviceID != deviceProperties.deviceID ||
+		header.driverVersion != deviceProperties.driverVersion ||
+		memcmp(header.pipelineCacheUUID, deviceProperties.pipelineCacheUUID, VK_UUID_SIZE) != 0 ||
+		fileSize - static_cast<std::streamoff>(sizeof(header)) != header.dataSize)
+	{
+		std::cout << "Pipeline cache \"" << PIPELINE_CACHE_FILE << "\" is stale, starting cold" << std::endl;
+		return cacheData;
+	}
+
+	cacheData.resize(header.dataSize);
+	if (!is.read(cacheData.data(), cacheData.size()))
+		cacheData.clear();
+
+	return cacheData;
+}
+
+void VkBase::savePipelineCache()
+{
+	size_t dataSize = 0;
+	VK_CHECK_RESULT(vkGetPipelineCacheData(device, pipelineCache, &dataSize, nullptr));
+
+	std::vector<char> cacheData(dataSize);
+	VK_CHECK_RESULT(vkGetPipelineCacheData(device, pipelineCache, &dataSize, cacheData.data()));
+
+	PipelineCacheHeader header = {};
+	header.magic = PIPELINE_CACHE_MAGIC;
+	header.version = PIPELINE_CACHE_VERSION;
+	header.vendorID = deviceProperties.vendorID;
+	header.deviceID = deviceProperties.deviceID;
+	header.driverVersion = deviceProperties.driverVersion;
+	header.dataSize = static_cast<uint32_t>(dataSize);
+	memcpy(header.pipelineCacheUUID, deviceProperties.pipelineCacheUUID, VK_UUID_SIZE);
+
+	// A truncated file would only be rejected on the next start
+	DataUtils::writeFile(PIPELINE_CACHE_FILE, [&](std::ostream& os) {
+		os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		os.write(cacheData.data(), static_cast<std::streamsize>(dataSize));
+	});
+}
+
 void VkBase::createSwapChain()
 {
 	SwapChainSupportDetails swapChainSupport = querySwapChainSupport(physicalDevice);
@@ -4,11 +4,39 @@
 
 #include <GLFW/glfw3.h>
 
+#include "JobSystem.h"
 #include "ResourceManager.h"
+#include "ShaderCache.h"
 #include "TextOverlay.h"
 
 #define DEFAULT_FENCE_TIMEOUT 100000000000
 
+// Pipeline cache data saved on shutdown and loaded on the next start
+// The header guards against data from another device or driver, which drivers are not required to reject
+#define PIPELINE_CACHE_FILE "pipeline.cache"
+#define PIPELINE_CACHE_MAGIC 0x43504F4F // "OOPC"
+#define PIPELINE_CACHE_VERSION 1
+
+// Refresh of the overlay, the HUD text and the samples of the memory graph
+#define OVERLAY_UPDATE_INTERVAL_MS 500.0f
+#define OVERLAY_GRAPH_INTERVAL_MS 100.0f
+#define OVERLAY_GRAPH_WIDTH 300.0f
+#define OVERLAY_GRAPH_HEIGHT 100.0f
+// CPU time per frame the overlay may take, above it both refresh intervals double up to OVERLAY_MAX_INTERVAL_SCALE times
+#define OVERLAY_BUDGET_MS 0.25
+#define OVERLAY_MAX_INTERVAL_SCALE 8
+
+struct PipelineCacheHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t vendorID;
+	uint32_t deviceID;
+	uint32_t driverVersion;
+	// Size of the cache data following the header
+	uint32_t dataSize;
+	uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+};
+
 
 struct QueueFamilyIndices {
 	int graphicsFamily = -1;
@@ -47,21 +75,32 @@ protected:
 	VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
 	VkPhysicalDeviceProperties deviceProperties;
 	VkPhysicalDeviceFeatures deviceFeatures;
+	// Features actually turned on at device creation
+	VkPhysicalDeviceFeatures enabledFeatures = {};
 	VkPhysicalDeviceMemoryProperties deviceMemoryProperties;
 
 	VkFormat depthFormat;
 
 	VkDevice device;
 
+	// Worker threads shared by loading, streaming and command recording
+	JobSystem *jobs = nullptr;
+
 	ResourceManager *resMan = nullptr;
 
+	// Shader modules of all pipelines, text overlay included
+	ShaderCache *shaderCache = nullptr;
+
 	TextOverlay *textUI = nullptr;
 
 	VkCommandPool cmdPool;
 
 	std::vector<VkCommandBuffer> drawCmdBuffers;
 
+	// Shared by all pipelines, including the text overlay
 	VkPipelineCache pipelineCache;
+	// Whether the cache was filled from PIPELINE_CACHE_FILE
+	bool isPipelineCacheWarm = false;
 
 	VkRenderPass renderPass;
 
@@ -94,6 +133,11 @@ protected:
 
 	Image depthStencil;
 
+	struct {
+		uint32_t graphic;
+		uint32_t present;
+	} queueFamilyIndices;
+
 	virtual void setupInputHndCallback() = 0;
 
 	virtual void prepare();
@@ -103,11 +147,17 @@ protected:
 	void prepareFrame();
 	void submitFrame();
 
+	// Prints the average frame time since the last call for the current overlay mode and starts over
+	void printOverlayFrameTime();
+
+	// Lines of the application below the HUD, starting at y, returns the y of the next line
+	// frameCount is the number of frames since the last HUD update
+	virtual float getOverlayText(TextOverlay *textOverlay, float y, uint32_t frameCount) { return y; }
+
 	// support functions
 	uint32_t getMemoryTypeIndex(uint32_t typeBits, VkMemoryPropertyFlags properties);
 	VkCommandBuffer createCmdBuffer(bool begin);
 	void flushCmdBuffer(VkCommandBuffer cmdBuffer);
-	VkShaderModule loadSPIRVShader(std::string filePath);
 
 	void createDrawCmdBuffer();
 
@@ -115,15 +165,22 @@ private:
 	float fpsTimer = 0.0f;
 	uint32_t lastFPS = 0;
 
+	// Frame times of the current overlay mode, see printOverlayFrameTime
+	double overlayFrameTime = 0.0;
+	uint32_t overlayFrameCount = 0;
+
+	float graphTimer = 0.0f;
+	// Frames, overlay CPU time and migrated bytes since the last HUD update
+	uint32_t perfFrameCount = 0;
+	double overlayCost = 0.0;
+	double lastOverlayCost = 0.0;
+	VkDeviceSize perfMigratedBytes = 0;
+	uint32_t overlayIntervalScale = 1;
+
 	VkSurfaceKHR surface;
 
 	VkDebugReportCallbackEXT debReportClbk;
 
-	struct {
-		uint32_t graphic;
-		uint32_t present;
-	} queueFamilyIndices;
-
 	void initWindow(int width, int height, const char* appTitle);
 	void initVulkan();
 
@@ -141,10 +198,14 @@ private:
 	
 	void createStandardSemaphores();
 	void createPipelineCache();
+	// Reads PIPELINE_CACHE_FILE, returns an empty vector when it is missing or was written for another device or driver
+	std::vector<char> loadPipelineCacheData();
+	void savePipelineCache();
 
 	void renderLoop();
 
 	void updatePerfValue();
+	void updatePerfGraph();
 
 	// support functions
 	bool checkValidationLayerSupport();
@@ -0,0 +1,27 @@
+#version 450 core
+
+// Samples per line, TEXTOVERLAY_GRAPH_SAMPLE_COUNT
+#define SAMPLE_COUNT 256
+
+layout (location = 0) in float inValue;
+
+layout (push_constant) uniform PushConsts {
+	// Left, top, width and height in normalized device coordinates
+	vec4 rect;
+	vec4 color;
+} pushConsts;
+
+layout (location = 0) out vec4 outColor;
+
+out gl_PerVertex 
+{
+    vec4 gl_Position;   
+};
+
+void main(void)
+{
+	// The lines follow each other in the vertex buffer, the sample index gives x
+	float x = float(gl_VertexIndex % SAMPLE_COUNT) / float(SAMPLE_COUNT - 1);
+	gl_Position = vec4(pushConsts.rect.xy + vec2(x, 1.0 - inValue) * pushConsts.rect.zw, 0.0, 1.0);
+	outColor = pushConsts.color;
+}
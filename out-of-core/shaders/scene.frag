@@ -5,11 +5,29 @@
 
 layout (set = 1, binding = 0) uniform sampler2D samplerColorMap;
 
+// Material features, each material's pipeline is specialized for the ones it uses
+layout (constant_id = 0) const bool HAS_DIFFUSE_MAP = true;
+layout (constant_id = 1) const bool HAS_SPECULAR = true;
+layout (constant_id = 2) const bool ALPHA_BLEND = false;
+
 layout (location = 0) in vec3 inNormal;
 layout (location = 1) in vec3 inColor;
 layout (location = 2) in vec2 inUV;
 layout (location = 3) in vec3 inViewVec;
 layout (location = 4) in vec3 inLightVec;
+layout (location = 5) flat in uint inMaterialIndex;
+
+struct MaterialData {
+	vec4 ambient;
+	vec4 diffuse;
+	vec4 specular;
+	float opacity;
+};
+
+// Materials an instance can use instead of the material of the mesh
+layout (std430, set = 0, binding = 3) readonly buffer Materials {
+	MaterialData materials[];
+};
 
 layout(push_constant) uniform Material 
 {
@@ -22,12 +40,19 @@ layout(push_constant) uniform Material
 layout (location = 0) out vec4 outFragColor;
 
 void main() {
-    vec4 color = texture(samplerColorMap, inUV); //* vec4(inColor, 1.0);
+	vec4 color = HAS_DIFFUSE_MAP ? texture(samplerColorMap, inUV) : vec4(1.0); //* vec4(inColor, 1.0);
 	vec3 N = normalize(inNormal);
 	vec3 L = normalize(inLightVec);
-	vec3 V = normalize(inViewVec);
-	vec3 R = reflect(-L, N);
-	vec3 diffuse = max(dot(N, L), 0.0) * material.diffuse.rgb;
-	vec3 specular = pow(max(dot(R, V), 0.0), 16.0) * material.specular.rgb;
-	outFragColor = vec4((material.ambient.rgb + diffuse) * color.rgb + specular, 1.0-material.opacity);
+	MaterialData m = MaterialData(material.ambient, material.diffuse, material.specular, material.opacity);
+	if (inMaterialIndex != 0xFFFFFFFFu)
+		m = materials[inMaterialIndex];
+	vec3 diffuse = max(dot(N, L), 0.0) * m.diffuse.rgb;
+	vec3 specular = vec3(0.0);
+	if (HAS_SPECULAR)
+	{
+		vec3 V = normalize(inViewVec);
+		vec3 R = reflect(-L, N);
+		specular = pow(max(dot(R, V), 0.0), 16.0) * m.specular.rgb;
+	}
+	outFragColor = vec4((m.ambient.rgb + diffuse) * color.rgb + specular, ALPHA_BLEND ? 1.0-m.opacity : 1.0);
 }
\ No newline at end of file
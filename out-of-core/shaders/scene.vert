@@ -5,39 +5,76 @@
 
 layout(set = 0, binding = 0) uniform UniformBufferObject {
 	mat4 proj;
-    mat4 model;
-    mat4 view;
+	mat4 view;
 	vec4 lightPos;
 } ubo;
 
-layout (location = 0) in vec3 inPos;
+struct Instance {
+	mat4 model;
+	uint materialIndex;
+};
+
+// Transforms of all instances in the scene
+layout(std430, set = 0, binding = 1) readonly buffer Instances {
+	Instance instances[];
+};
+
+// Ids of the instances that passed culling, each mesh owns a range starting at instanceBase
+layout(std430, set = 0, binding = 2) readonly buffer VisibleInstances {
+	uint visibleInstances[];
+};
+
+// Compact vertices carry quantized positions and octahedral normals
+layout (constant_id = 0) const bool COMPACT_VERTEX = false;
+
+// Position dequantization of the mesh, identity for full vertices
+layout(push_constant) uniform MeshBounds {
+	layout(offset = 64) vec4 scale;
+	vec4 offset;
+	uint instanceBase;
+} bounds;
+
+layout (location = 0) in vec3 inPosition;
 layout (location = 1) in vec3 inColor;
 layout (location = 2) in vec2 inUV;
-layout (location = 3) in vec3 inNormal;
+layout (location = 3) in vec3 inNormalData;
 
 layout (location = 0) out vec3 outNormal;
 layout (location = 1) out vec3 outColor;
 layout (location = 2) out vec2 outUV;
 layout (location = 3) out vec3 outViewVec;
 layout (location = 4) out vec3 outLightVec;
+layout (location = 5) flat out uint outMaterialIndex;
 
 out gl_PerVertex {
     vec4 gl_Position;
 };
 
+vec3 decodeOctahedral(vec2 e)
+{
+	vec3 n = vec3(e.xy, 1.0 - abs(e.x) - abs(e.y));
+	float t = max(-n.z, 0.0);
+	n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);
+	return normalize(n);
+}
+
 void main() {
-	outNormal = inNormal;
+	vec3 inPos = inPosition * bounds.scale.xyz + bounds.offset.xyz;
+	vec3 inNormal = COMPACT_VERTEX ? decodeOctahedral(inNormalData.xy) : inNormalData;
+
+	Instance instance = instances[visibleInstances[bounds.instanceBase + gl_InstanceIndex]];
+
 	outColor = inColor;
 	outUV = inUV;
+	outMaterialIndex = instance.materialIndex;
+
+	vec4 worldPos = instance.model * vec4(inPos, 1.0);
 
-	mat4 modelView = ubo.view * ubo.model;
+	gl_Position = ubo.proj * ubo.view * worldPos;
 
-	gl_Position = ubo.proj * modelView * vec4(inPos.xyz, 1.0);
-	
-	vec4 pos = modelView * vec4(inPos, 0.0);
-	outNormal = mat3(ubo.model) * inNormal;
+	outNormal = mat3(instance.model) * inNormal;
 
 	vec3 lPos = ubo.lightPos.xyz;
-	outLightVec = lPos - (ubo.model * vec4(inPos, 1.0)).xyz;
-	outViewVec = -(ubo.model * vec4(inPos, 1.0)).xyz;
-}
\ No newline at end of file
+	outLightVec = lPos - worldPos.xyz;
+	outViewVec = -worldPos.xyz;
+}